@@ -32,11 +32,15 @@
 using std::min;
 using std::max;
 
-/// A structure to represent a single triangle in the mesh
-struct Triangle {
+/// The indices, which define a single triangle in the mesh
+struct TriangleIndices {
 	int v[3]; //!< holds indices to the three vertices of the triangle (indexes in the `vertices' array in the Mesh)
 	int n[3]; //!< holds indices to the three normals of the triangle (indexes in the `normals' array)
 	int t[3]; //!< holds indices to the three texture coordinates of the triangle (indexes in the `uvs' array)
+};
+
+/// A structure to represent a single triangle in the mesh, with some precomputed data for the intersection
+struct Triangle: public TriangleIndices {
 	Vector gnormal; //!< The geometric normal of the mesh (AB ^ AC, normalized)
 	Vector AB, AC, ABcrossAC; //!< precomputed AB, AC and AB^AC
 	Vector dNdx, dNdy;
@@ -55,6 +59,17 @@ enum Axis {
 // from mesh.cpp
 bool intersectTriangleFast(const Ray& ray, const Vector& A, const Vector& B, const Vector& C, double& dist);
 
+/// returns the per-component reciprocal of a ray direction, for use with BBox::clipRay().
+/// Components which are (almost) zero are replaced with a huge, but finite value, so that
+/// the slab test stays well-defined even with -ffast-math.
+inline Vector inverseDirection(const Vector& dir)
+{
+	Vector result;
+	for (int dim = 0; dim < 3; dim++)
+		result[dim] = (fabs(dir[dim]) < 1e-12) ? signOf(dir[dim]) * 1e+12 : 1 / dir[dim];
+	return result;
+}
+
 /**
  * @Brief a class that represents an axis-aligned bounding box around some object
  * The more precise definition of our BBox is the volume, bounded by the vectors vmin, vmax, so that any point p inside the volume satisfies
@@ -89,6 +104,45 @@ struct BBox {
 		add(other.vmin);
 		add(other.vmax);
 	}
+	/// Checks if the box is empty (i.e., makeEmpty() was called, and nothing was added since)
+	inline bool isEmpty() const
+	{
+		return vmin.x > vmax.x;
+	}
+	inline Vector center() const
+	{
+		return (vmin + vmax) * 0.5;
+	}
+	/// returns the surface area of the box (the SAH builders need this)
+	inline double surfaceArea() const
+	{
+		Vector d = vmax - vmin;
+		return 2 * (d.x * d.y + d.x * d.z + d.y * d.z);
+	}
+	/// returns the distance from a point to the box (0 if the point is inside)
+	inline double distanceTo(const Vector& p) const
+	{
+		Vector d;
+		for (int dim = 0; dim < 3; dim++)
+			d[dim] = max(0.0, max(vmin[dim] - p[dim], p[dim] - vmax[dim]));
+		return d.length();
+	}
+	/// Clips the [tmin, tmax] interval of a ray against the box (the "slab" test).
+	/// @param invDir - the reciprocal of ray.dir, as computed by inverseDirection()
+	/// @returns true if a part of the interval remains, i.e. the ray passes through the box
+	///          somewhere between tmin and tmax. Both are updated to the clipped interval.
+	inline bool clipRay(const Ray& ray, const Vector& invDir, double& tmin, double& tmax) const
+	{
+		for (int dim = 0; dim < 3; dim++) {
+			double t0 = (vmin[dim] - ray.start[dim]) * invDir[dim];
+			double t1 = (vmax[dim] - ray.start[dim]) * invDir[dim];
+			if (t0 > t1) std::swap(t0, t1);
+			tmin = max(tmin, t0);
+			tmax = min(tmax, t1);
+			if (tmin > tmax) return false;
+		}
+		return true;
+	}
 	/// Test for ray-box intersection
 	/// @returns true if an intersection exists; false otherwise.
 	inline bool testIntersect(const Ray& ray) const
@@ -198,7 +252,8 @@ struct BBox {
 				ray.start.set((mask & 1) ? vmax.x : vmin.x, (mask & 2) ? vmax.y : vmin.y, (mask & 4) ? vmax.z : vmin.z);
 				Vector rayEnd = ray.start;
 				rayEnd[j] = vmax[j];
-				if (signOf(ray.start * ABcrossAC - D) != signOf(rayEnd * ABcrossAC - D)) {
+				// (the edge may also just touch the plane, e.g. when the triangle lies on a face of the box):
+				if ((ray.start * ABcrossAC - D) * (rayEnd * ABcrossAC - D) <= 0) {
 					ray.dir = rayEnd - ray.start;
 					double gamma = 1.0000001;
 					if (intersectTriangleFast(ray, A, B, C, gamma)) return true;
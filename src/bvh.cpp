@@ -0,0 +1,286 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2024 by Veselin Georgiev, Slavomir Kaslev,         *
+ *                              Deyan Hadzhiev et al                       *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File bvh.cpp
+ * @Brief Contains the implementation of the BVH builder
+ */
+
+#include <algorithm>
+#include <numeric>
+#include <math.h>
+#include "bvh.h"
+
+static const int SAH_BINS = 16;
+static const int MAX_BVH_DEPTH = 60; // keep in sync with the traversal stack size in BVH::traverse()
+
+void BVH::clear()
+{
+	nodes.clear();
+	primIndices.clear();
+	leafOrder = false;
+}
+
+/// rounds a double to a float, which is not greater (dir = -1) or not less (dir = +1) than the original
+static float roundConservative(double x, int dir)
+{
+	float f = float(x);
+	if (dir < 0 && f > x) f = nextafterf(f, -1e30f);
+	if (dir > 0 && f < x) f = nextafterf(f, +1e30f);
+	return f;
+}
+
+void BVHNode4::setChildBox(int i, const BBox& bbox)
+{
+	for (int dim = 0; dim < 3; dim++) {
+		// the traversal works with float rays, so leave some room for their roundoff, too:
+		double eps = 1e-6 * max(1.0, max(fabs(bbox.vmin[dim]), fabs(bbox.vmax[dim])));
+		bounds[0][dim][i] = roundConservative(bbox.vmin[dim] - eps, -1);
+		bounds[1][dim][i] = roundConservative(bbox.vmax[dim] + eps, +1);
+	}
+}
+
+void BVH::build(const std::vector<BBox>& primBoxes, int maxLeafSize, int minLeafSize)
+{
+	clear();
+	if (primBoxes.empty()) return;
+	this->maxLeafSize = std::max(1, maxLeafSize);
+	this->minLeafSize = std::max(1, std::min(minLeafSize, this->maxLeafSize));
+	std::vector<Vector> centroids(primBoxes.size());
+	for (int i = 0; i < int(primBoxes.size()); i++)
+		centroids[i] = primBoxes[i].center();
+	primIndices.resize(primBoxes.size());
+	std::iota(primIndices.begin(), primIndices.end(), 0);
+	std::vector<BVHBuildNode> buildNodes;
+	buildNodes.reserve(2 * primBoxes.size());
+	buildNodes.emplace_back();
+	buildNode(buildNodes, 0, 0, int(primBoxes.size()), primBoxes, centroids, 0);
+	nodes.reserve(buildNodes.size() / 2 + 1);
+	collapse(buildNodes, 0);
+}
+
+void BVH::refit(const std::vector<BBox>& primBoxes)
+{
+	// every node comes after its parent in `nodes' (see collapse()), so by going backwards, the children
+	// of a node are always updated before it:
+	for (int nodeIdx = int(nodes.size()) - 1; nodeIdx >= 0; nodeIdx--) {
+		BVHNode4& node = nodes[nodeIdx];
+		for (int i = 0; i < 4; i++) {
+			if (node.count[i] > 0) {
+				BBox bbox;
+				bbox.makeEmpty();
+				for (int j = node.child[i]; j < node.child[i] + node.count[i]; j++)
+					bbox.extend(primBoxes[getPrimIndex(j)]);
+				node.setChildBox(i, bbox);
+			} else if (node.count[i] == 0) {
+				// an inner child: merge its (already rounded) child boxes. The unused slots have inverted
+				// boxes, so they don't affect the result:
+				const BVHNode4& child = nodes[node.child[i]];
+				for (int dim = 0; dim < 3; dim++) {
+					float lo = child.bounds[0][dim][0], hi = child.bounds[1][dim][0];
+					for (int k = 1; k < 4; k++) {
+						lo = std::min(lo, child.bounds[0][dim][k]);
+						hi = std::max(hi, child.bounds[1][dim][k]);
+					}
+					node.bounds[0][dim][i] = lo;
+					node.bounds[1][dim][i] = hi;
+				}
+			}
+		}
+	}
+}
+
+double BVH::getSAHCost() const
+{
+	if (nodes.empty()) return 0;
+	auto childArea = [] (const BVHNode4& node, int i) {
+		double size[3];
+		for (int dim = 0; dim < 3; dim++) size[dim] = double(node.bounds[1][dim][i]) - node.bounds[0][dim][i];
+		return 2 * (size[0] * size[1] + size[1] * size[2] + size[2] * size[0]);
+	};
+	BBox root;
+	root.makeEmpty();
+	for (int i = 0; i < 4; i++) if (nodes[0].count[i] >= 0) {
+		root.add(Vector(nodes[0].bounds[0][0][i], nodes[0].bounds[0][1][i], nodes[0].bounds[0][2][i]));
+		root.add(Vector(nodes[0].bounds[1][0][i], nodes[0].bounds[1][1][i], nodes[0].bounds[1][2][i]));
+	}
+	double rootArea = root.surfaceArea();
+	if (rootArea <= 0) return 0;
+	// each node costs a (4-wide) box test, and each primitive a primitive test, weighted by the
+	// probability that a ray through the root reaches them:
+	double cost = 1;
+	for (auto& node: nodes)
+		for (int i = 0; i < 4; i++)
+			if (node.count[i] >= 0) cost += childArea(node, i) / rootArea * (node.count[i] > 0 ? node.count[i] : 1);
+	return cost;
+}
+
+/**
+ * Creates a 4-wide node out of a binary subtree: starting with the two children of the given node,
+ * the inner child with the largest surface area is repeatedly replaced by its own children, until
+ * there are four of them (or only leaves remain).
+ * @returns the index of the new node in `nodes'
+ */
+int BVH::collapse(const std::vector<BVHBuildNode>& buildNodes, int buildIdx)
+{
+	int nodeIdx = int(nodes.size());
+	nodes.emplace_back();
+	const BVHBuildNode& root = buildNodes[buildIdx];
+	int children[4], numChildren = 0;
+	if (root.isLeaf()) {
+		children[numChildren++] = buildIdx; // the whole tree is a single leaf
+	} else {
+		children[numChildren++] = root.first;
+		children[numChildren++] = root.first + 1;
+		while (numChildren < 4) {
+			int best = -1;
+			double bestArea = -1;
+			for (int i = 0; i < numChildren; i++) {
+				const BVHBuildNode& c = buildNodes[children[i]];
+				if (!c.isLeaf() && c.bbox.surfaceArea() > bestArea) {
+					bestArea = c.bbox.surfaceArea();
+					best = i;
+				}
+			}
+			if (best == -1) break;
+			int opened = children[best];
+			children[best] = buildNodes[opened].first;
+			children[numChildren++] = buildNodes[opened].first + 1;
+		}
+	}
+	int childIdx[4], childCount[4];
+	for (int i = 0; i < numChildren; i++) {
+		const BVHBuildNode& c = buildNodes[children[i]];
+		if (c.isLeaf()) {
+			childIdx[i] = c.first;
+			childCount[i] = c.count;
+		} else {
+			childIdx[i] = collapse(buildNodes, children[i]); // (this may reallocate `nodes')
+			childCount[i] = 0;
+		}
+	}
+	BVHNode4& node = nodes[nodeIdx];
+	BBox unused;
+	unused.vmin.set(+1e18, +1e18, +1e18);
+	unused.vmax.set(-1e18, -1e18, -1e18);
+	for (int i = 0; i < 4; i++) {
+		if (i < numChildren) {
+			node.setChildBox(i, buildNodes[children[i]].bbox);
+			node.child[i] = childIdx[i];
+			node.count[i] = childCount[i];
+		} else {
+			node.setChildBox(i, unused);
+			node.child[i] = 0;
+			node.count[i] = -1;
+		}
+	}
+	return nodeIdx;
+}
+
+void BVH::buildNode(std::vector<BVHBuildNode>& buildNodes, int nodeIdx, int begin, int end,
+                    const std::vector<BBox>& primBoxes, const std::vector<Vector>& centroids, int depth)
+{
+	BBox bbox, centroidBox;
+	bbox.makeEmpty();
+	centroidBox.makeEmpty();
+	for (int i = begin; i < end; i++) {
+		bbox.extend(primBoxes[primIndices[i]]);
+		centroidBox.add(centroids[primIndices[i]]);
+	}
+	buildNodes[nodeIdx].bbox = bbox;
+	int count = end - begin;
+	auto makeLeaf = [&] {
+		buildNodes[nodeIdx].first = begin;
+		buildNodes[nodeIdx].count = count;
+	};
+	if (count <= minLeafSize || depth >= MAX_BVH_DEPTH) {
+		makeLeaf();
+		return;
+	}
+	// find the best split among SAH_BINS bins along each axis:
+	int bestAxis = -1, bestSplit = 0;
+	double bestCost = INF;
+	for (int axis = 0; axis < 3; axis++) {
+		double lo = centroidBox.vmin[axis], hi = centroidBox.vmax[axis];
+		if (hi - lo < 1e-12) continue;
+		double binScale = SAH_BINS / (hi - lo);
+		BBox binBoxes[SAH_BINS];
+		int binCounts[SAH_BINS] = { 0 };
+		for (int b = 0; b < SAH_BINS; b++) binBoxes[b].makeEmpty();
+		for (int i = begin; i < end; i++) {
+			int b = std::min(SAH_BINS - 1, int((centroids[primIndices[i]][axis] - lo) * binScale));
+			binBoxes[b].extend(primBoxes[primIndices[i]]);
+			binCounts[b]++;
+		}
+		// sweep from the right to get the area and count of all the "right" sides:
+		double rightArea[SAH_BINS];
+		int rightCount[SAH_BINS];
+		BBox acc;
+		acc.makeEmpty();
+		int accCount = 0;
+		for (int b = SAH_BINS - 1; b > 0; b--) {
+			acc.extend(binBoxes[b]);
+			accCount += binCounts[b];
+			rightArea[b] = acc.isEmpty() ? 0 : acc.surfaceArea();
+			rightCount[b] = accCount;
+		}
+		// ...then from the left, evaluating the cost of splitting before bin `b':
+		acc.makeEmpty();
+		accCount = 0;
+		for (int b = 1; b < SAH_BINS; b++) {
+			acc.extend(binBoxes[b - 1]);
+			accCount += binCounts[b - 1];
+			if (accCount == 0 || rightCount[b] == 0) continue;
+			double cost = acc.surfaceArea() * accCount + rightArea[b] * rightCount[b];
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = b;
+			}
+		}
+	}
+	int mid;
+	if (bestAxis == -1) {
+		// all centroids coincide; no spatial split is possible, so just halve the list:
+		mid = (begin + end) / 2;
+	} else {
+		// small enough nodes become leaves, if the SAH says splitting doesn't pay off
+		// (the cost of a traversal step is taken to be the same as one primitive test):
+		double leafCost = count;
+		double splitCost = 1 + bestCost / bbox.surfaceArea();
+		if (splitCost >= leafCost && count <= maxLeafSize) {
+			makeLeaf();
+			return;
+		}
+		double lo = centroidBox.vmin[bestAxis];
+		double binScale = SAH_BINS / (centroidBox.vmax[bestAxis] - lo);
+		int* middle = std::partition(&primIndices[begin], &primIndices[begin] + count, [&] (int primIdx) {
+			return std::min(SAH_BINS - 1, int((centroids[primIdx][bestAxis] - lo) * binScale)) < bestSplit;
+		});
+		mid = int(middle - &primIndices[0]);
+	}
+	int left = int(buildNodes.size());
+	buildNodes.emplace_back();
+	buildNodes.emplace_back();
+	buildNodes[nodeIdx].first = left;
+	buildNodes[nodeIdx].count = 0;
+	buildNode(buildNodes, left, begin, mid, primBoxes, centroids, depth + 1);
+	buildNode(buildNodes, left + 1, mid, end, primBoxes, centroids, depth + 1);
+}
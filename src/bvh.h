@@ -0,0 +1,327 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2024 by Veselin Georgiev, Slavomir Kaslev,         *
+ *                              Deyan Hadzhiev et al                       *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File bvh.h
+ * @Brief Contains the BVH (bounding volume hierarchy) class.
+ */
+#pragma once
+
+#include <vector>
+#include "vector.h"
+#include "bbox.h"
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#	define BVH_USE_SSE
+#	include <xmmintrin.h>
+#endif
+
+/// A node of the binary BVH, which is only used during the build (see BVH::build())
+struct BVHBuildNode {
+	BBox bbox;
+	int first; //!< inner nodes: index of the left child (the right one is at first + 1); leaves: index of the first primitive
+	int count; //!< number of primitives in a leaf (0 for inner nodes)
+
+	bool isLeaf() const { return count > 0; }
+};
+
+/**
+ * A node of the 4-wide BVH (128 bytes, i.e. two cache lines).
+ *
+ * The bounding boxes of the (up to) four children are stored in SoA layout, as floats, so that a
+ * single SIMD slab test checks the ray against all of them at once. Unused child slots have an
+ * inverted box, which no ray can hit.
+ */
+struct alignas(64) BVHNode4 {
+	float bounds[2][3][4]; //!< bounds[0 = min, 1 = max][axis][child]
+	int child[4];          //!< inner children: index of the node; leaves: index of the first primitive in BVH::primIndices
+	int count[4];          //!< number of primitives, if the child is a leaf; 0 for inner children, -1 for unused slots
+
+	void setChildBox(int i, const BBox& bbox);
+};
+
+/**
+ * @Brief A bounding volume hierarchy over a set of abstract primitives.
+ *
+ * The BVH only knows the bounding boxes of the primitives (as passed to build()); the actual
+ * intersection is done by the caller, in the visitor callback passed to traverse().
+ * It is built top-down, using the binned Surface Area Heuristic over the primitive centroids, as a
+ * binary tree, which is then collapsed into a 4-wide one (BVHNode4), for faster traversal.
+ */
+class BVH {
+	std::vector<BVHNode4> nodes;
+	std::vector<int> primIndices;
+	bool leafOrder = false; //!< after releasePrimIndices(): the primitives are numbered in leaf order
+	int maxLeafSize = 4;
+	int minLeafSize = 1;
+
+	void buildNode(std::vector<BVHBuildNode>& buildNodes, int nodeIdx, int begin, int end,
+	               const std::vector<BBox>& primBoxes, const std::vector<Vector>& centroids, int depth);
+	int collapse(const std::vector<BVHBuildNode>& buildNodes, int buildIdx);
+	int getPrimIndex(int i) const { return leafOrder ? i : primIndices[i]; }
+public:
+	/// (re)builds the hierarchy. primBoxes[i] is the bounding box of the i-th primitive; the indices
+	/// in this array are what traverse() passes to its visitor.
+	/// Leaves hold at most maxLeafSize primitives (unless they can't be split); below that size,
+	/// the SAH decides whether splitting is worth it. Use 1 if primitives are expensive to intersect.
+	/// Nodes of up to minLeafSize primitives are never split, which trades traversal speed for fewer nodes.
+	void build(const std::vector<BBox>& primBoxes, int maxLeafSize = 4, int minLeafSize = 1);
+	/// updates the bounding boxes after the primitives have moved, keeping the tree structure. This is
+	/// O(n), but the tree gets worse if the primitives move far from where they were at build time
+	/// (see getSAHCost()). primBoxes must have the same size and order as for build() (after
+	/// releasePrimIndices(), that is the leaf order).
+	void refit(const std::vector<BBox>& primBoxes);
+	/// the expected cost of a ray through the tree, in box and primitive tests, per the Surface Area
+	/// Heuristic. Comparing it to the value after build() tells how much refitting has degraded the tree
+	double getSAHCost() const;
+	void clear();
+	bool empty() const { return nodes.empty(); }
+	int getNumNodes() const { return int(nodes.size()); }
+	size_t getMemoryUsage() const { return nodes.size() * sizeof(BVHNode4) + primIndices.size() * sizeof(int); }
+
+	/// the primitive indices, in leaf order; each leaf refers to a contiguous range in this array
+	const std::vector<int>& getPrimIndices() const { return primIndices; }
+	/// frees getPrimIndices(), once the caller has stored its primitives in that order. From then on, the
+	/// primitive indices are positions in the leaf order: the leaf ranges of traverseLeaves() and forEachLeaf()
+	/// index the caller's array directly, and so do the indices, which traverse() and traversePacket() pass
+	/// to their visitors, and the boxes, which refit() expects
+	void releasePrimIndices()
+	{
+		std::vector<int>().swap(primIndices);
+		leafOrder = true;
+	}
+	/// the nodes; nodes[0] is the root, and every node comes after its parent
+	const std::vector<BVHNode4>& getNodes() const { return nodes; }
+
+	/// calls f(first, count) for every leaf, where [first, first + count) is its range in getPrimIndices()
+	template<typename LeafFunc>
+	void forEachLeaf(LeafFunc&& f) const
+	{
+		for (auto& node: nodes)
+			for (int i = 0; i < 4; i++)
+				if (node.count[i] > 0) f(node.child[i], node.count[i]);
+	}
+
+	/**
+	 * Walks the hierarchy along the ray, nearest boxes first.
+	 *
+	 * For every primitive in a leaf, which the ray enters before `maxDist', calls visit(primIdx, maxDist).
+	 * The visitor may shrink maxDist (e.g. when it finds a closer hit), which culls the rest of the
+	 * traversal accordingly. If the visitor returns true, the traversal stops right away (this is useful
+	 * for shadow rays, where any hit will do).
+	 *
+	 * @returns the number of nodes visited (for statistics)
+	 */
+	template<typename Visitor>
+	int traverse(const Ray& ray, double& maxDist, Visitor&& visit) const
+	{
+		return traverseLeaves(ray, maxDist, [this, &visit] (int first, int count, double& maxDist) {
+			for (int i = first; i < first + count; i++)
+				if (visit(getPrimIndex(i), maxDist)) return true;
+			return false;
+		});
+	}
+
+	/**
+	 * Walks the hierarchy with a whole packet of rays: a node is entered if any of the active rays hits its
+	 * box, so the node fetches and the stack work are shared by the rays.
+	 *
+	 * For every primitive in a leaf, calls visit(primIdx, rayMask), with the mask of the rays which reach
+	 * the leaf before their packet.maxDist[]. As in traverse(), the visitor may shrink packet.maxDist[]. It
+	 * returns the mask of rays, which need no further traversal (e.g. shadow rays, which are already
+	 * blocked); these are removed from packet.activeMask.
+	 *
+	 * @returns the number of nodes visited
+	 */
+	template<typename Visitor>
+	int traversePacket(RayPacket& packet, Visitor&& visit) const
+	{
+		static_assert(RayPacket::SIZE == 4, "the packet traversal tests the four rays in the lanes of a SIMD register");
+		if (nodes.empty() || !packet.activeMask) return 0;
+		alignas(16) float org[3][4], invDir[3][4];
+		for (int lane = 0; lane < 4; lane++) {
+			Vector invDirD = inverseDirection(packet.rays[lane].dir);
+			for (int dim = 0; dim < 3; dim++) {
+				org[dim][lane] = float(packet.rays[lane].start[dim]);
+				invDir[dim][lane] = float(invDirD[dim]);
+			}
+		}
+		const float FAR_SCALE = 1.0000004f; // (see traverseNodes())
+		struct StackEntry {
+			int child, count, rayMask;
+			float tNear[4];
+		} stack[192];
+		int sp = 0;
+		stack[sp++] = { 0, 0, packet.activeMask, { 0, 0, 0, 0 } };
+		int visited = 0;
+		while (sp > 0) {
+			const StackEntry entry = stack[--sp];
+			int rayMask = entry.rayMask & packet.activeMask;
+			for (int lane = 0; lane < 4; lane++)
+				if (entry.tNear[lane] > packet.maxDist[lane]) rayMask &= ~(1 << lane);
+			if (!rayMask) continue;
+			if (entry.count > 0) {
+				for (int i = entry.child; i < entry.child + entry.count && rayMask; i++) {
+					int done = visit(getPrimIndex(i), rayMask);
+					packet.activeMask &= ~done;
+					rayMask &= ~done;
+				}
+				continue;
+			}
+			const BVHNode4& node = nodes[entry.child];
+			visited++;
+			alignas(16) float tMax[4], tNear[4][4];
+			for (int lane = 0; lane < 4; lane++) tMax[lane] = float(min(packet.maxDist[lane], 1e30)) * FAR_SCALE;
+			// test each child box against the four rays at once. The rays may point in different directions,
+			// so the near and far planes are sorted per ray:
+			int childMask[4];
+			for (int i = 0; i < 4; i++) {
+				childMask[i] = 0;
+				if (node.count[i] < 0) continue;
+#ifdef BVH_USE_SSE
+				__m128 t0 = _mm_setzero_ps(), t1 = _mm_load_ps(tMax);
+				for (int dim = 0; dim < 3; dim++) {
+					__m128 o = _mm_load_ps(org[dim]), inv = _mm_load_ps(invDir[dim]);
+					__m128 ta = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bounds[0][dim][i]), o), inv);
+					__m128 tb = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bounds[1][dim][i]), o), inv);
+					t0 = _mm_max_ps(t0, _mm_min_ps(ta, tb));
+					t1 = _mm_min_ps(t1, _mm_mul_ps(_mm_max_ps(ta, tb), _mm_set1_ps(FAR_SCALE)));
+				}
+				_mm_store_ps(tNear[i], t0);
+				childMask[i] = _mm_movemask_ps(_mm_cmple_ps(t0, t1)) & rayMask;
+#else
+				for (int lane = 0; lane < 4; lane++) {
+					float t0 = 0, t1 = tMax[lane];
+					for (int dim = 0; dim < 3; dim++) {
+						float ta = (node.bounds[0][dim][i] - org[dim][lane]) * invDir[dim][lane];
+						float tb = (node.bounds[1][dim][i] - org[dim][lane]) * invDir[dim][lane];
+						t0 = max(t0, min(ta, tb));
+						t1 = min(t1, max(ta, tb) * FAR_SCALE);
+					}
+					tNear[i][lane] = t0;
+					if (t0 <= t1) childMask[i] |= (1 << lane) & rayMask;
+				}
+#endif
+			}
+			// push the children that were hit, farthest first, by the nearest entry point among their rays:
+			float childNear[4];
+			int order[4], numHit = 0;
+			for (int i = 0; i < 4; i++) if (childMask[i]) {
+				childNear[i] = 1e30f;
+				for (int lane = 0; lane < 4; lane++)
+					if (childMask[i] & (1 << lane)) childNear[i] = min(childNear[i], tNear[i][lane]);
+				int j = numHit++;
+				for (; j > 0 && childNear[order[j - 1]] < childNear[i]; j--) order[j] = order[j - 1];
+				order[j] = i;
+			}
+			for (int j = 0; j < numHit; j++) {
+				int i = order[j];
+				StackEntry& e = stack[sp++];
+				e.child = node.child[i];
+				e.count = node.count[i];
+				e.rayMask = childMask[i];
+				for (int lane = 0; lane < 4; lane++) e.tNear[lane] = tNear[i][lane];
+			}
+		}
+		return visited;
+	}
+
+	/// same as traverse(), but the visitor is called once per leaf, as visitLeaf(first, count, maxDist),
+	/// with the leaf's range in getPrimIndices() (see forEachLeaf())
+	template<typename LeafVisitor>
+	int traverseLeaves(const Ray& ray, double& maxDist, LeafVisitor&& visitLeaf) const
+	{
+		if (nodes.empty()) return 0;
+		return traverseNodes(nodes.data(), ray, maxDist, visitLeaf);
+	}
+
+	/// the traversal behind traverseLeaves(), on an arbitrary (non-empty) node array, laid out like getNodes().
+	/// visitLeaf() gets the `child' and `count' fields of the leaves, so they may mean something else than
+	/// ranges in primIndices (e.g. for trees stored in a file, see Mesh::outOfCore)
+	template<typename LeafVisitor>
+	static int traverseNodes(const BVHNode4* nodes, const Ray& ray, double& maxDist, LeafVisitor&& visitLeaf)
+	{
+		Vector invDirD = inverseDirection(ray.dir);
+		float org[3], invDir[3];
+		int nearSide[3];
+		for (int dim = 0; dim < 3; dim++) {
+			org[dim] = float(ray.start[dim]);
+			invDir[dim] = float(invDirD[dim]);
+			nearSide[dim] = invDir[dim] < 0 ? 1 : 0; // for negative directions, the "max" plane is hit first
+		}
+		// the boxes are stored as floats, with conservative rounding, and the intervals are widened a bit,
+		// to account for the roundoff in the slab test itself:
+		const float FAR_SCALE = 1.0000004f;
+		struct StackEntry {
+			int child, count;
+			float tNear;
+		} stack[192];
+		int sp = 0;
+		stack[sp++] = { 0, 0, 0.0f };
+		int visited = 0;
+		while (sp > 0) {
+			const StackEntry entry = stack[--sp];
+			if (entry.tNear > maxDist) continue;
+			if (entry.count > 0) {
+				if (visitLeaf(entry.child, entry.count, maxDist)) return visited;
+				continue;
+			}
+			const BVHNode4& node = nodes[entry.child];
+			visited++;
+			float tNear[4];
+			int hitMask = 0;
+			float tMax = float(min(maxDist, 1e30)) * FAR_SCALE;
+#ifdef BVH_USE_SSE
+			__m128 t0 = _mm_setzero_ps(), t1 = _mm_set1_ps(tMax);
+			for (int dim = 0; dim < 3; dim++) {
+				__m128 o = _mm_set1_ps(org[dim]), inv = _mm_set1_ps(invDir[dim]);
+				__m128 tn = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[nearSide[dim]][dim]), o), inv);
+				__m128 tf = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[1 - nearSide[dim]][dim]), o), inv);
+				t0 = _mm_max_ps(t0, tn);
+				t1 = _mm_min_ps(t1, _mm_mul_ps(tf, _mm_set1_ps(FAR_SCALE)));
+			}
+			_mm_storeu_ps(tNear, t0);
+			hitMask = _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+#else
+			for (int i = 0; i < 4; i++) {
+				float t0 = 0, t1 = tMax;
+				for (int dim = 0; dim < 3; dim++) {
+					t0 = max(t0, (node.bounds[nearSide[dim]][dim][i] - org[dim]) * invDir[dim]);
+					t1 = min(t1, (node.bounds[1 - nearSide[dim]][dim][i] - org[dim]) * invDir[dim] * FAR_SCALE);
+				}
+				tNear[i] = t0;
+				if (t0 <= t1) hitMask |= 1 << i;
+			}
+#endif
+			// push the children that were hit, farthest first, so that the nearest one is popped next:
+			int order[4], numHit = 0;
+			for (int i = 0; i < 4; i++) if (hitMask & (1 << i)) {
+				int j = numHit++;
+				for (; j > 0 && tNear[order[j - 1]] < tNear[i]; j--) order[j] = order[j - 1];
+				order[j] = i;
+			}
+			for (int j = 0; j < numHit; j++) {
+				int i = order[j];
+				stack[sp++] = { node.child[i], node.count[i], tNear[i] };
+			}
+		}
+		return visited;
+	}
+};
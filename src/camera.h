@@ -50,6 +50,8 @@ public:
 	Ray getDOFScreenRay(double x, double y, double u, double v, double stereoOffset = 0.0);
 	Vector getFrontDir() const { return m_frontDir; }
 	double getApertureSize() const { return m_apertureSize; }
+	/// the (angular) size of a pixel, i.e. its width at a distance of 1 in front of the camera
+	double getPixelSize() const { return distance(m_topLeft, m_topRight) / m_width; }
 	void move(double sideways, double front_back);
 	void rotate(double yawDiff, double pitchDiff);
     //
@@ -27,6 +27,10 @@
 #include "util.h"
 #include "node.h"
 #include <algorithm>
+#include <memory>
+#include <type_traits>
+
+thread_local float lodDither = 0.5f;
 
 bool Plane::intersect(const Ray& ray, IntersectionInfo& info)
 {
@@ -49,6 +53,14 @@ bool Plane::intersect(const Ray& ray, IntersectionInfo& info)
     return true;
 }
 
+bool Plane::getBBox(BBox& bbox)
+{
+    if (limit >= INF) return false;
+    bbox.vmin.set(-limit, y, -limit);
+    bbox.vmax.set(+limit, y, +limit);
+    return true;
+}
+
 bool Sphere::intersect(const Ray& ray, IntersectionInfo& info)
 {
     double A = ray.dir.lengthSqr();
@@ -69,7 +81,13 @@ bool Sphere::intersect(const Ray& ray, IntersectionInfo& info)
     else p = p1;
     //
     info.dist = p;
-    info.ip = ray.start + ray.dir * p;
+    info.geom = this;
+    return true;
+}
+
+void Sphere::computeSurface(const Ray& ray, IntersectionInfo& info)
+{
+    info.ip = ray.start + ray.dir * info.dist;
     info.norm = info.ip - O;
     info.norm.normalize();
     info.v = asin(info.norm.y); // [-pi/2..+pi/2]
@@ -80,7 +98,48 @@ bool Sphere::intersect(const Ray& ray, IntersectionInfo& info)
         info.u *= uvscaling;
         info.v *= uvscaling;
     }
+}
+
+bool Sphere::occluded(const Ray& ray, double maxDist)
+{
+    double A = ray.dir.lengthSqr();
+    Vector H = ray.start - O;
+    double B = 2 * dot(ray.dir, H);
+    double C = H.lengthSqr() - R*R;
+    double D = B*B - 4*A*C;
+    if (D < 0) return false;
+    //
+    double sqrtD = sqrt(D);
+    double p1 = (-B-sqrtD)/(2*A);
+    double p2 = (-B+sqrtD)/(2*A);
+    // the same choice of root as in intersect():
+    double p = (p1 < 0) ? p2 : p1;
+    return p >= 0 && p < maxDist;
+}
+
+void Sphere::intersectAll(const Ray& ray, HitList& hits)
+{
+    double A = ray.dir.lengthSqr();
+    Vector H = ray.start - O;
+    double B = 2 * dot(ray.dir, H);
+    double C = H.lengthSqr() - R*R;
+    double D = B*B - 4*A*C;
+    if (D < 0) return;
+    //
+    double sqrtD = sqrt(D);
+    IntersectionInfo info;
     info.geom = this;
+    for (double p: { (-B-sqrtD)/(2*A), (-B+sqrtD)/(2*A) }) {
+        if (p < 0) continue;
+        info.dist = p;
+        hits.add(info);
+    }
+}
+
+bool Sphere::getBBox(BBox& bbox)
+{
+    bbox.vmin = O - Vector(R, R, R);
+    bbox.vmax = O + Vector(R, R, R);
     return true;
 }
 
@@ -94,115 +153,390 @@ static inline bool inBounds(double x, double center, double halfSide)
     return (x > center - halfSide - 1e-6 && x < center + halfSide + 1e-6);
 }
 
-int Cube::intersectCubeSide(
-            const Vector& norm,
-            double startCoord, // "A"
-            double dir,
-            double target,     // "B"
-            const Ray& ray,
-            IntersectionInfo& info,
-            std::function<void(IntersectionInfo&)> genUV)
+/**
+ * finds where the ray crosses the sides of the cube. The sides are numbered axis * 2 + (0 for the side
+ * facing -axis, 1 for the one facing +axis).
+ * @returns the number of hits, sorted by distance; at the same distance (at an edge), the lower side comes first
+ */
+int Cube::findSideHits(const Ray& ray, double dist[6], int side[6])
+{
+    int numHits = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        double startCoord = ray.start[axis], dir = ray.dir[axis];
+        // startCoord + dir * p == target
+        if (fabs(dir) < 1e-9) continue;
+        for (int k = 0; k < 2; k++) {
+            double target = O[axis] + (k ? m_halfSide : -m_halfSide);
+            if (startCoord < target && dir < 0) continue;
+            if (startCoord > target && dir > 0) continue;
+            double p = (target - startCoord) / dir;
+            Vector ip = ray.start + ray.dir * p;
+            if (!inBounds(ip.x, O.x, m_halfSide)
+             || !inBounds(ip.y, O.y, m_halfSide)
+             || !inBounds(ip.z, O.z, m_halfSide)) continue;
+            // insert, keeping the order:
+            int i = numHits++;
+            for (; i > 0 && dist[i - 1] > p; i--) {
+                dist[i] = dist[i - 1];
+                side[i] = side[i - 1];
+            }
+            dist[i] = p;
+            side[i] = axis * 2 + k;
+        }
+    }
+    return numHits;
+}
+
+bool Cube::intersect(const Ray& ray, IntersectionInfo& info)
 {
-    // startCoord + dir * p == target
-    if (fabs(dir) < 1e-9) return 0;
-    if (startCoord < target && dir < 0) return 0;
-    if (startCoord > target && dir > 0) return 0;
-    //
-    double p = (target - startCoord) / dir;
-    if (p < info.dist) {
-        Vector ip = ray.start + ray.dir * p;
-        if (!inBounds(ip.x, O.x, m_halfSide)
-         || !inBounds(ip.y, O.y, m_halfSide)
-         || !inBounds(ip.z, O.z, m_halfSide)) return 0;
-        info.dist = p;
-        info.ip = ip;
-        info.norm = norm;
-        genUV(info);
+    double dist[6];
+    int side[6];
+    if (!findSideHits(ray, dist, side)) return false;
+    info.dist = dist[0];
+    info.primIdx = side[0];
+    info.geom = this;
+    return true;
+}
+
+void Cube::computeSurface(const Ray& ray, IntersectionInfo& info)
+{
+    int axis = info.primIdx / 2;
+    info.ip = ray.start + ray.dir * info.dist;
+    info.norm.makeZero();
+    info.norm[axis] = (info.primIdx % 2) ? +1 : -1;
+    // the UVs are the other two coordinates:
+    info.u = info.ip[axis == 0 ? 1 : 0];
+    info.v = info.ip[axis == 2 ? 1 : 2];
+}
+
+void Cube::intersectAll(const Ray& ray, HitList& hits)
+{
+    double dist[6];
+    int side[6];
+    int numHits = findSideHits(ray, dist, side);
+    for (int i = 0; i < numHits; i++) {
+        IntersectionInfo info;
+        info.dist = dist[i];
+        info.primIdx = side[i];
         info.geom = this;
+        hits.add(info);
+    }
+}
+
+bool Cube::getBBox(BBox& bbox)
+{
+    // not using m_halfSide, since this may get called before beginFrame()
+    double halfSide = side * 0.5;
+    bbox.vmin = O - Vector(halfSide, halfSide, halfSide);
+    bbox.vmax = O + Vector(halfSide, halfSide, halfSide);
+    return true;
+}
 
-        return 1;
+void HitList::add(const IntersectionInfo& info)
+{
+    if (count < CAPACITY) {
+        hits[count++] = info;
+        return;
     }
-    return 0;
+    // full; replace the farthest hit, if this one is closer:
+    int farthest = 0;
+    for (int i = 1; i < count; i++)
+        if (hits[i].dist > hits[farthest].dist) farthest = i;
+    if (info.dist < hits[farthest].dist) hits[farthest] = info;
 }
 
-bool Cube::intersect(const Ray& ray, IntersectionInfo& info)
+void HitList::sort()
 {
-    auto UV_X = [] (IntersectionInfo& info) { info.u = info.ip.y; info.v = info.ip.z; };
-    auto UV_Y = [] (IntersectionInfo& info) { info.u = info.ip.x; info.v = info.ip.z; };
-    auto UV_Z = [] (IntersectionInfo& info) { info.u = info.ip.x; info.v = info.ip.y; };
-    int numIntersections = 0;
-    //
-    // +-X:
-    info.dist = INF;
-    numIntersections += intersectCubeSide(Vector(-1, 0, 0), ray.start.x, ray.dir.x, O.x - m_halfSide, ray, info, UV_X);
-    numIntersections += intersectCubeSide(Vector(+1, 0, 0), ray.start.x, ray.dir.x, O.x + m_halfSide, ray, info, UV_X);
-    // +-Y:
-    numIntersections += intersectCubeSide(Vector( 0,-1, 0), ray.start.y, ray.dir.y, O.y - m_halfSide, ray, info, UV_Y);
-    numIntersections += intersectCubeSide(Vector( 0,+1, 0), ray.start.y, ray.dir.y, O.y + m_halfSide, ray, info, UV_Y);
-    // +-Z:
-    numIntersections += intersectCubeSide(Vector( 0, 0,-1), ray.start.z, ray.dir.z, O.z - m_halfSide, ray, info, UV_Z);
-    numIntersections += intersectCubeSide(Vector( 0, 0,+1), ray.start.z, ray.dir.z, O.z + m_halfSide, ray, info, UV_Z);
-    //
-    return numIntersections > 0;
+    // (insertion sort; the lists are short, and usually (nearly) sorted already)
+    for (int i = 1; i < count; i++) {
+        if (hits[i - 1].dist <= hits[i].dist) continue;
+        IntersectionInfo info = hits[i];
+        int j = i;
+        for (; j > 0 && hits[j - 1].dist > info.dist; j--) hits[j] = hits[j - 1];
+        hits[j] = info;
+    }
 }
 
-std::vector<IntersectionInfo> findAllIntersections(Ray ray, Geometry* geom)
+void Geometry::intersectAll(const Ray& ray, HitList& hits)
 {
-    std::vector<IntersectionInfo> result;
-    Vector origin = ray.start;
-    // doing a for loop just to ensure we eventually terminate. Typically though,
-    // the loop will terminate after 1-2 iterations due to the geom->intersect() break.
-    for (int counter = 0; counter < 30; counter++) {
+    Ray restarted = ray;
+    double offset = 0;
+    // the loop is bounded, in case a hit doesn't move the ray forward:
+    for (int counter = 0; counter < HitList::CAPACITY; counter++) {
         IntersectionInfo info;
         info.dist = INF;
-        if (!geom->intersect(ray, info)) break;
-        //
-        result.push_back(info);
-        ray.start = info.ip + ray.dir * 1e-6;
+        if (!intersect(restarted, info)) break;
+        // the distances are from the original start (computeSurface() will get the original ray, too):
+        info.dist += offset;
+        hits.add(info);
+        offset = info.dist + 1e-6;
+        restarted.start = ray.start + ray.dir * offset;
     }
-    for (auto& info: result) info.dist = distance(origin, info.ip);
-    return result;
 }
 
-bool CSGBase::intersect(const Ray& ray, IntersectionInfo& info)
+/**
+ * The HitLists of the CSG operations come from a per-thread stack: each CSG takes two of them (for its
+ * operands) for the duration of the call, so nested CSGs take the next ones. The lists are only allocated
+ * the first time a thread gets that deep, so there are no allocations per ray.
+ */
+class ScopedHitList {
+    static thread_local std::vector<std::unique_ptr<HitList>> stack;
+    static thread_local int top;
+public:
+    HitList& list;
+    ScopedHitList(): list(acquire()) { list.count = 0; }
+    ~ScopedHitList() { top--; }
+    static HitList& acquire()
+    {
+        if (top == int(stack.size())) stack.emplace_back(new HitList);
+        return *stack[top++];
+    }
+};
+
+thread_local std::vector<std::unique_ptr<HitList>> ScopedHitList::stack;
+thread_local int ScopedHitList::top = 0;
+
+void CSGBase::beginFrame()
 {
-    std::vector<IntersectionInfo> xLeft = findAllIntersections(ray, left);
-    std::vector<IntersectionInfo> xRight = findAllIntersections(ray, right);
+    // pad the boxes slightly, so that the rays, which only graze an operand, still find it (see Cube's inBounds()):
+    for (auto operand: { std::make_pair(left, &leftBBox), std::make_pair(right, &rightBBox) }) {
+        BBox& bbox = *operand.second;
+        if (!operand.first->getBBox(bbox)) {
+            bbox.makeEmpty();
+            continue;
+        }
+        Vector pad = (bbox.vmax - bbox.vmin) * 1e-6 + Vector(1e-6, 1e-6, 1e-6);
+        bbox.vmin += -pad;
+        bbox.vmax += pad;
+    }
+}
 
-    std::vector<IntersectionInfo> allIntersections = xLeft;
-    allIntersections.insert(allIntersections.end(), xRight.cbegin(), xRight.cend());
-    //
-    std::sort(allIntersections.begin(), allIntersections.end(),
-        [] (const IntersectionInfo& left, const IntersectionInfo& right) -> bool {
-            return left.dist < right.dist;
-    });
-    //
-    bool inA = (xLeft.size() % 2);
-    bool inB = (xRight.size() % 2);
-    bool initial = inside(inA, inB);
-    for (auto& infoCandidate: allIntersections) {
-        if (infoCandidate.geom == left) inA = !inA;
-        else                            inB = !inB;
-        if (inside(inA, inB) != initial) {
-            info = infoCandidate;
-            info.norm = faceforward(ray.dir, info.norm);
-            info.geom = this;
-            return true;
+/// gets the sorted hits of an operand, skipping it altogether, if the ray misses its box
+void CSGBase::getOperandHits(Geometry* operand, const BBox& bbox, const Ray& ray, HitList& hits)
+{
+    if (!bbox.isEmpty() && !bbox.testIntersect(ray)) return;
+    operand->intersectAll(ray, hits);
+    hits.sort();
+}
+
+void CSGBase::intersectAll(const Ray& ray, HitList& hits)
+{
+    ScopedHitList leftHits, rightHits;
+    getOperandHits(left, leftBBox, ray, leftHits.list);
+    // if the ray doesn't hit the left operand, the right one may not matter at all (e.g., for intersection
+    // and difference):
+    if (leftHits.list.count || inside(false, false) != inside(false, true))
+        getOperandHits(right, rightBBox, ray, rightHits.list);
+    const HitList& a = leftHits.list;
+    const HitList& b = rightHits.list;
+    // the operands are closed, so there's an odd number of hits ahead, iff the ray starts inside:
+    bool inA = (a.count % 2);
+    bool inB = (b.count % 2);
+    bool state = inside(inA, inB);
+    // merge the two lists, and report the hits, where the result changes:
+    for (int i = 0, j = 0; i < a.count || j < b.count; ) {
+        bool fromA = (j == b.count || (i < a.count && a.hits[i].dist <= b.hits[j].dist));
+        const IntersectionInfo& info = fromA ? a.hits[i++] : b.hits[j++];
+        if (fromA) inA = !inA;
+        else       inB = !inB;
+        if (inside(inA, inB) != state) {
+            state = !state;
+            hits.add(info);
         }
     }
-    return false;
+}
+
+bool CSGBase::intersect(const Ray& ray, IntersectionInfo& info)
+{
+    ScopedHitList hits;
+    intersectAll(ray, hits.list);
+    if (!hits.list.count) return false;
+    // complete the first hit (its geom is the primitive, which was hit, even for nested CSGs):
+    info = hits.list.hits[0];
+    info.geom->computeSurface(ray, info);
+    info.norm = faceforward(ray.dir, info.norm);
+    info.geom = this;
+    return true;
+}
+
+bool CSGBase::occluded(const Ray& ray, double maxDist)
+{
+    // the surface of the result is a part of the operands' surfaces, so if the ray doesn't
+    // reach any of them, we're done without computing all the intersections:
+    if (!left->occluded(ray, maxDist) && !right->occluded(ray, maxDist)) return false;
+    ScopedHitList hits;
+    intersectAll(ray, hits.list);
+    return hits.list.count && hits.list.hits[0].dist < maxDist;
+}
+
+bool CSGBase::getBBox(BBox& bbox)
+{
+    // the union of both operands' boxes encloses the result of any CSG operation:
+    BBox rightBBox;
+    if (!left->getBBox(bbox) || !right->getBBox(rightBBox)) return false;
+    bbox.extend(rightBBox);
+    return true;
+}
+
+/**
+ * transforms a ray into object space (the same as Transform::untransformRay()), in the cheapest way for the kind
+ * of the transform (see Transform::classify()).
+ * @returns the factor, by which the distances along the ray get multiplied in object space (the direction is
+ *          normalized there, and the transform may scale)
+ */
+template<TransformKind kind>
+static inline double untransformRay(const Transform& T, const Ray& ray, Ray& tRay)
+{
+	tRay = ray;
+	if constexpr (kind == TRANSFORM_IDENTITY) {
+		return 1.0;
+	} else if constexpr (kind == TRANSFORM_TRANSLATE) {
+		tRay.start = ray.start - T.offset;
+		return 1.0;
+	} else if constexpr (kind == TRANSFORM_UNIFORM) {
+		// (the direction stays normalized, as ray.dir is)
+		tRay.start = T.untransformPoint(ray.start);
+		tRay.dir = ray.dir * T.invRotation;
+		return 1.0 / T.uniformScale;
+	} else {
+		tRay.start = T.untransformPoint(ray.start);
+		Vector tDir = ray.dir * T.invM;
+		tRay.dir = normalize(tDir);
+		return (tRay.dir == tDir) ? 1.0 : tDir.length();
+	}
+}
+
+/// calls f(std::integral_constant<TransformKind, T.kind>()), so that f gets compiled for each kind
+template<typename Func>
+static inline auto dispatchTransformKind(const Transform& T, Func&& f)
+{
+	switch (T.kind) {
+		case TRANSFORM_IDENTITY:  return f(std::integral_constant<TransformKind, TRANSFORM_IDENTITY>());
+		case TRANSFORM_TRANSLATE: return f(std::integral_constant<TransformKind, TRANSFORM_TRANSLATE>());
+		case TRANSFORM_UNIFORM:   return f(std::integral_constant<TransformKind, TRANSFORM_UNIFORM>());
+		default:                  return f(std::integral_constant<TransformKind, TRANSFORM_GENERAL>());
+	}
+}
+
+void Node::beginFrame()
+{
+	// (every frame, as the transforms may change between them)
+	T.classify();
 }
 
 bool Node::intersect(const Ray& ray, IntersectionInfo& info)
 {
-	Ray tRay = ray;
-	tRay.start = T.untransformPoint(ray.start);
-	tRay.dir = T.untransformDir(ray.dir);
-	if (!geom->intersect(tRay, info)) return false;
-	//
-	info.ip = T.transformPoint(info.ip);
-	info.norm = T.normal(info.norm);
-	info.norm.normalize();
-	info.dist = distance(ray.start, info.ip);
+	return dispatchTransformKind(T, [&] (auto kind) {
+		Ray tRay;
+		double distScale = untransformRay<decltype(kind)::value>(T, ray, tRay);
+		if (!selectLOD()->intersect(tRay, info)) return false;
+		// the transform is affine, so the distance is enough to compare the hits; the point and
+		// normal are only transformed for the final one, in computeSurface():
+		info.dist /= distScale;
+		return true;
+	});
+}
+
+void Node::computeSurface(const Ray& ray, IntersectionInfo& info)
+{
+	dispatchTransformKind(T, [&] (auto kind) {
+		const TransformKind K = decltype(kind)::value;
+		Ray tRay;
+		double worldDist = info.dist;
+		info.dist *= untransformRay<K>(T, ray, tRay);
+		info.geom->computeSurface(tRay, info); // (info.geom is the LOD, which was hit)
+		if constexpr (K == TRANSFORM_TRANSLATE) {
+			info.ip += T.offset;
+		} else if constexpr (K != TRANSFORM_IDENTITY) {
+			info.ip = T.transformPoint(info.ip);
+			info.norm = T.normal(info.norm);
+		}
+		info.norm.normalize();
+		// the distance along the ray is the same in both spaces (up to the scale), so it needn't be recomputed:
+		info.dist = worldDist;
+	});
+}
+
+bool Node::occluded(const Ray& ray, double maxDist)
+{
+	return dispatchTransformKind(T, [&] (auto kind) {
+		Ray tRay;
+		// the transform is affine, so the end of the segment scales along with the distances:
+		double distScale = untransformRay<decltype(kind)::value>(T, ray, tRay);
+		return selectLOD()->occluded(tRay, (maxDist >= INF) ? INF : maxDist * distScale);
+	});
+}
+
+/// transforms the active rays of a packet (and the lengths of their segments) into object space.
+/// distScale[i] receives the factor of untransformRay() for each ray
+template<TransformKind kind>
+static void untransformPacket(const Transform& T, const RayPacket& packet, RayPacket& tPacket, double distScale[])
+{
+	tPacket.activeMask = packet.activeMask;
+	for (int i = 0; i < RayPacket::SIZE; i++) if (packet.activeMask & (1 << i)) {
+		distScale[i] = untransformRay<kind>(T, packet.rays[i], tPacket.rays[i]);
+		double maxDist = packet.maxDist[i];
+		tPacket.maxDist[i] = (maxDist >= INF) ? INF : maxDist * distScale[i];
+	}
+}
+
+int Node::intersectPacket(const RayPacket& packet, IntersectionInfo infos[])
+{
+	RayPacket tPacket;
+	double distScale[RayPacket::SIZE];
+	dispatchTransformKind(T, [&] (auto kind) {
+		untransformPacket<decltype(kind)::value>(T, packet, tPacket, distScale);
+	});
+	int hitMask = selectLOD()->intersectPacket(tPacket, infos);
+	for (int i = 0; i < RayPacket::SIZE; i++) if (hitMask & (1 << i)) {
+		infos[i].dist /= distScale[i]; // (see intersect())
+		if (infos[i].dist >= packet.maxDist[i]) hitMask &= ~(1 << i);
+	}
+	return hitMask;
+}
+
+int Node::occludedPacket(const RayPacket& packet)
+{
+	RayPacket tPacket;
+	double distScale[RayPacket::SIZE];
+	dispatchTransformKind(T, [&] (auto kind) {
+		untransformPacket<decltype(kind)::value>(T, packet, tPacket, distScale);
+	});
+	return selectLOD()->occludedPacket(tPacket);
+}
+
+bool Node::getWorldBBox(BBox& bbox)
+{
+	BBox local;
+	if (!geom->getBBox(local)) return false;
+	// transform all eight corners of the object-space box:
+	bbox.makeEmpty();
+	for (int mask = 0; mask < 8; mask++) {
+		Vector corner(
+			(mask & 1) ? local.vmax.x : local.vmin.x,
+			(mask & 2) ? local.vmax.y : local.vmin.y,
+			(mask & 4) ? local.vmax.z : local.vmin.z
+		);
+		bbox.add(T.transformPoint(corner));
+	}
 	return true;
 }
+
+void Node::updateLOD(const Vector& cameraPos, double pixelSize, double maxPixelError)
+{
+	lodLevel = 0;
+	lodBlend = 0;
+	int numLODs = geom->getNumLODs();
+	BBox bbox;
+	if (numLODs <= 1 || !geom->getBBox(bbox)) return;
+	// the error, which is allowed at the closest point of the object (the distance is in object space, so
+	// that it's comparable with the LOD errors, as long as the transform scales uniformly):
+	double allowed = bbox.distanceTo(T.untransformPoint(cameraPos)) * pixelSize * maxPixelError;
+	while (lodLevel + 1 < numLODs && geom->getLODError(lodLevel + 1) <= allowed) lodLevel++;
+	if (lodLevel + 1 < numLODs) {
+		// between two levels, the rays are split so that the expected error is the allowed one. This
+		// changes continuously with the distance, so there's no popping, when a level switches:
+		double e0 = geom->getLODError(lodLevel), e1 = geom->getLODError(lodLevel + 1);
+		lodBlend = float(std::clamp((allowed - e0) / (e1 - e0), 0.0, 1.0));
+	}
+}
@@ -27,6 +27,7 @@
 #include "vector.h"
 #include <functional>
 #include "scene.h"
+#include "bbox.h"
 
 class Geometry;
 
@@ -37,6 +38,22 @@ struct IntersectionInfo {
     Vector dNdx, dNdy;
     double u, v;
     Geometry *geom;
+    // what the intersection itself found, for the deferred computeSurface():
+    int primIdx;          //!< the primitive, which was hit, if the geometry consists of many (e.g., a triangle index)
+    int primGroup;        //!< the group of primIdx (e.g., the cluster of an out-of-core mesh), or -1
+    double baryU, baryV;  //!< the barycentric coordinates of the hit on that primitive
+    int instanceIdx;      //!< the copy, which was hit, if the geometry is an InstanceSet
+};
+
+/// all the hits of a ray with a geometry (see Geometry::intersectAll()). The capacity is
+/// fixed, so that the lists can be reused without allocations; if a ray has more hits, the farthest are dropped
+struct HitList {
+	static const int CAPACITY = 32;
+	IntersectionInfo hits[CAPACITY];
+	int count = 0;
+
+	void add(const IntersectionInfo& info);
+	void sort(); //!< sorts the hits by distance (stable, so hits at the same distance keep their order)
 };
 
 /**
@@ -45,11 +62,59 @@ struct IntersectionInfo {
  */
 class Intersectable {
 public:
+	/// finds the closest intersection of the ray. Only info.dist and info.geom are guaranteed to be filled
+	/// in; the rest of the surface (ip, norm, u, v, ...) may be left for computeSurface(), since most hits
+	/// that are found aren't the closest in the end.
 	virtual bool intersect(const Ray&, IntersectionInfo& info) = 0;
+	/// completes the IntersectionInfo of a hit, returned by intersect() for the same ray. It's called only
+	/// once per ray, for the final closest hit. The default implementation does nothing, for the geometries
+	/// which compute everything in intersect().
+	virtual void computeSurface(const Ray& ray, IntersectionInfo& info) {}
+	/// checks whether the ray hits anything closer than maxDist (e.g., for shadow rays). Unlike intersect(),
+	/// it may return on the first hit found, and it doesn't compute normals, UVs, etc.
+	/// The default implementation just calls intersect().
+	virtual bool occluded(const Ray& ray, double maxDist)
+	{
+		IntersectionInfo info;
+		return intersect(ray, info) && info.dist < maxDist;
+	}
+	/// intersects all active rays of a packet. For each ray with a hit closer than packet.maxDist[i],
+	/// fills infos[i] and sets bit i in the returned mask.
+	/// The default implementation intersects the rays one by one.
+	virtual int intersectPacket(const RayPacket& packet, IntersectionInfo infos[])
+	{
+		int hitMask = 0;
+		for (int i = 0; i < RayPacket::SIZE; i++)
+			if ((packet.activeMask & (1 << i)) && intersect(packet.rays[i], infos[i]) && infos[i].dist < packet.maxDist[i])
+				hitMask |= 1 << i;
+		return hitMask;
+	}
+	/// the packet version of occluded(): returns the mask of the active rays, which hit something closer than packet.maxDist[i]
+	virtual int occludedPacket(const RayPacket& packet)
+	{
+		int hitMask = 0;
+		for (int i = 0; i < RayPacket::SIZE; i++)
+			if ((packet.activeMask & (1 << i)) && occluded(packet.rays[i], packet.maxDist[i]))
+				hitMask |= 1 << i;
+		return hitMask;
+	}
 };
 
 class Geometry: public Intersectable, public SceneElement {
 public:
+    /// finds all the hits of the ray with the surface, and adds them to `hits' (in any order). As with
+    /// intersect(), the hits only need to be complete enough for computeSurface(), which is only called for
+    /// the one that's used in the end. The default implementation calls intersect() repeatedly, restarting
+    /// the ray just past each hit.
+    virtual void intersectAll(const Ray& ray, HitList& hits);
+    /// gets the bounding box of the geometry (in object space).
+    /// Only valid after beginRender(); returns false if the geometry is unbounded
+    virtual bool getBBox(BBox& bbox) { return false; }
+    /// the number of levels of detail of the geometry; level 0 is the geometry itself (see Mesh::lodLevels)
+    virtual int getNumLODs() { return 1; }
+    virtual Geometry* getLOD(int level) { return this; }
+    /// the largest deviation of the given level from the original surface, in object space
+    virtual double getLODError(int level) { return 0; }
     //
    	virtual ElementType getElementType() const override { return ELEM_GEOMETRY; }
 };
@@ -64,6 +129,7 @@ public:
 		pb.getDoubleProp("limit", &limit);
 	}
     virtual bool intersect(const Ray& ray, IntersectionInfo& info) override;
+    virtual bool getBBox(BBox& bbox) override;
 };
 
 class Sphere: public Geometry {
@@ -78,19 +144,15 @@ public:
         pb.getDoubleProp("uvscaling", &uvscaling, 1e-6);
 	}
     virtual bool intersect(const Ray& ray, IntersectionInfo& info) override;
+    virtual void computeSurface(const Ray& ray, IntersectionInfo& info) override;
+    virtual bool occluded(const Ray& ray, double maxDist) override;
+    virtual void intersectAll(const Ray& ray, HitList& hits) override;
+    virtual bool getBBox(BBox& bbox) override;
 };
 
 class Cube: public Geometry {
     double m_halfSide;
-    int intersectCubeSide(
-        const Vector& norm,
-        double startCoord,
-        double dir,
-        double target,
-        const Ray& ray,
-        IntersectionInfo& info,
-        std::function<void(IntersectionInfo&)> genUV
-        );
+    int findSideHits(const Ray& ray, double dist[6], int side[6]);
 public:
     Vector O  = Vector(0, 0, 0);
     double side = 1;
@@ -104,12 +166,21 @@ public:
         m_halfSide = side * 0.5;
     }
     virtual bool intersect(const Ray& ray, IntersectionInfo& info) override;
+    virtual void computeSurface(const Ray& ray, IntersectionInfo& info) override;
+    virtual void intersectAll(const Ray& ray, HitList& hits) override;
+    virtual bool getBBox(BBox& bbox) override;
 };
 
 class CSGBase: public Geometry {
     Geometry* left, *right;
+    BBox leftBBox, rightBBox; //!< the (padded) boxes of the operands, or empty if they're unbounded
+    void getOperandHits(Geometry* operand, const BBox& bbox, const Ray& ray, HitList& hits);
 public:
+    void beginFrame() override;
     virtual bool intersect(const Ray& ray, IntersectionInfo& info) override;
+    virtual bool occluded(const Ray& ray, double maxDist) override;
+    virtual void intersectAll(const Ray& ray, HitList& hits) override;
+    virtual bool getBBox(BBox& bbox) override;
     virtual bool inside(bool inA, bool inB) = 0;
 	void fillProperties(ParsedBlock& pb)
 	{
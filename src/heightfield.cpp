@@ -103,18 +103,22 @@ Vector Heightfield::getNormal(float x, float y) const
 	return v;
 }
 
-bool Heightfield::intersect(const Ray& ray, IntersectionInfo& info)
+/// marches the ray through the heightfield, until it finds the first hit (returned in `dist'),
+/// or passes beyond maxDist
+bool Heightfield::findHit(const Ray& ray, double maxDist, double& dist) const
 {
 	Vector step = ray.dir;
 	double distHoriz = sqrt(sqr(step.x) + sqr(step.z));
 	step /= distHoriz;
-	double dist = bbox.closestIntersection(ray);
-	Vector p = ray.start + ray.dir * (dist + 1e-6); // step firmly inside the bbox
+	double entryDist = bbox.closestIntersection(ray);
+	if (entryDist >= maxDist) return false;
+	Vector p = ray.start + ray.dir * (entryDist + 1e-6); // step firmly inside the bbox
 
 	double mx = 1.0 / ray.dir.x; // mx = how much to go along ray.dir until the unit distance along X is traversed
 	double mz = 1.0 / ray.dir.z; // same as mx, for Z
 
 	while (bbox.inside(p)) {
+		if (dot(p - ray.start, ray.dir) > maxDist) break;
 		int x0 = (int) floor(p.x);
 		int z0 = (int) floor(p.z);
 		if (x0 < 0 || x0 >= W || z0 < 0 || z0 >= H) break; // if outside the [0..W)x[0..H) rect, get out
@@ -152,17 +156,10 @@ bool Heightfield::intersect(const Ray& ray, IntersectionInfo& info)
 
 			if (b1 || b2) {
 				// intersection found: ray hits either triangle ABD or BCD. Which one exactly isn't
-				// important, because we calculate the normals by bilinear interpolation of the
-				// precalculated normals at the four corners:
-				info.dist = closestDist;
-				info.ip = ray.start + ray.dir * closestDist;
-				info.norm = getNormal((float) info.ip.x, (float) info.ip.z);
-				info.u = info.ip.x / W;
-				info.v = info.ip.z / H;
-				info.dNdx = Vector(1, 0, 0);
-				info.dNdy = Vector(0, 0, 1);
-				info.geom = this;
-				return true;
+				// important, because the normals are calculated by bilinear interpolation of the
+				// precalculated normals at the four corners (see intersect()):
+				dist = closestDist;
+				return dist < maxDist;
 			}
 		}
 		p = p_next;
@@ -170,6 +167,31 @@ bool Heightfield::intersect(const Ray& ray, IntersectionInfo& info)
 	return false;
 }
 
+bool Heightfield::intersect(const Ray& ray, IntersectionInfo& info)
+{
+	double dist;
+	if (!findHit(ray, INF, dist)) return false;
+	info.dist = dist;
+	info.geom = this;
+	return true;
+}
+
+void Heightfield::computeSurface(const Ray& ray, IntersectionInfo& info)
+{
+	info.ip = ray.start + ray.dir * info.dist;
+	info.norm = getNormal((float) info.ip.x, (float) info.ip.z);
+	info.u = info.ip.x / W;
+	info.v = info.ip.z / H;
+	info.dNdx = Vector(1, 0, 0);
+	info.dNdy = Vector(0, 0, 1);
+}
+
+bool Heightfield::occluded(const Ray& ray, double maxDist)
+{
+	double dist;
+	return findHit(ray, maxDist, dist);
+}
+
 void Heightfield::fillProperties(ParsedBlock& pb)
 {
 	pb.getBoolProp("useOptimization", &useOptimization);
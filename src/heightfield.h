@@ -37,6 +37,7 @@ class Heightfield: public Geometry {
 	Vector getNormal(float x, float y) const;
 
 	void buildHighMap();
+	bool findHit(const Ray& ray, double maxDist, double& dist) const;
 
 	int maxK;
 	struct HighMap { float h[16]; }; // h[0]: radius 2**0 = radius 1; blocks 3x3
@@ -46,6 +47,9 @@ public:
 	bool useOptimization = true;
 	void beginRender();
 	virtual bool intersect(const Ray& ray, IntersectionInfo& info) override;
+	virtual void computeSurface(const Ray& ray, IntersectionInfo& info) override;
+	virtual bool occluded(const Ray& ray, double maxDist) override;
+	virtual bool getBBox(BBox& bbox) override { bbox = this->bbox; return true; }
 	bool isInside(const Vector& p ) const { return false; }
 	void fillProperties(ParsedBlock& pb);
 };
@@ -0,0 +1,271 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2024 by Veselin Georgiev, Slavomir Kaslev,         *
+ *                              Deyan Hadzhiev et al                       *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File instancearray.cpp
+ * @Brief Implementation of the InstanceArray node
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <charconv>
+#include <SDL.h>
+#include "instancearray.h"
+#include "constants.h"
+#include "util.h"
+
+// the leaves hold several instances (4-8 with these limits), as with one instance per leaf, the BVH nodes
+// would take more memory than the transforms themselves:
+static const int MIN_INSTANCES_PER_LEAF = 4, MAX_INSTANCES_PER_LEAF = 8;
+
+static const char INSTANCES_MAGIC[8] = { 'H', 'X', 'I', 'N', 'S', 'T', '0', '1' };
+
+/// transforms a ray into the object space of an instance (see untransformRay() in geometry.cpp)
+/// @returns the factor, by which the distances along the ray get multiplied in object space
+static double untransformRay(const InstanceTransform& T, const Ray& ray, Ray& tRay)
+{
+	const float (*m)[4] = T.m;
+	tRay = ray;
+	tRay.start = Vector(
+		m[0][0] * ray.start.x + m[0][1] * ray.start.y + m[0][2] * ray.start.z + m[0][3],
+		m[1][0] * ray.start.x + m[1][1] * ray.start.y + m[1][2] * ray.start.z + m[1][3],
+		m[2][0] * ray.start.x + m[2][1] * ray.start.y + m[2][2] * ray.start.z + m[2][3]
+	);
+	Vector tDir(
+		m[0][0] * ray.dir.x + m[0][1] * ray.dir.y + m[0][2] * ray.dir.z,
+		m[1][0] * ray.dir.x + m[1][1] * ray.dir.y + m[1][2] * ray.dir.z,
+		m[2][0] * ray.dir.x + m[2][1] * ray.dir.y + m[2][2] * ray.dir.z
+	);
+	double length = tDir.length();
+	tRay.dir = tDir / length;
+	return length;
+}
+
+bool InstanceSet::hitsLocalBox(const Ray& tRay, double maxDist) const
+{
+	double tmin = 0, tmax = maxDist;
+	return localBox.clipRay(tRay, inverseDirection(tRay.dir), tmin, tmax);
+}
+
+bool InstanceSet::addInstance(const float forward[12])
+{
+	Matrix a;
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 3; j++)
+			a.m[i][j] = forward[i * 4 + j];
+	if (fabs(determinant(a)) < 1e-12) return false;
+	Matrix inv = inverseMatrix(a);
+	InstanceTransform T;
+	for (int i = 0; i < 3; i++) {
+		double t = 0;
+		for (int j = 0; j < 3; j++) {
+			T.m[i][j] = float(inv.m[i][j]);
+			t -= inv.m[i][j] * forward[j * 4 + 3];
+		}
+		T.m[i][3] = float(t);
+	}
+	transforms.push_back(T);
+	return true;
+}
+
+void InstanceSet::beginRender()
+{
+	bbox.makeEmpty();
+	BBox& local = localBox;
+	if (!instanced->getBBox(local)) {
+		printf("InstanceArray: the instanced geometry is unbounded, so the instances are ignored\n");
+		transforms.clear();
+	} else {
+		// hitsLocalBox() must not miss hits exactly on the box, so it gets a bit of slack:
+		Vector pad = (local.vmax - local.vmin) * 1e-7 + Vector(1e-9, 1e-9, 1e-9);
+		local.vmin += -pad;
+		local.vmax += pad;
+	}
+	// the boxes are only needed for the build; the instances keep just their (inverse) transforms:
+	std::vector<BBox> boxes(transforms.size());
+	for (int i = 0; i < int(transforms.size()); i++) {
+		// recover the forward transform from the stored floats, so that the box encloses what the rays see:
+		const float (*m)[4] = transforms[i].m;
+		Matrix a;
+		for (int r = 0; r < 3; r++)
+			for (int c = 0; c < 3; c++) a.m[r][c] = m[r][c];
+		Vector t(m[0][3], m[1][3], m[2][3]);
+		Matrix forward = inverseMatrix(a);
+		BBox& box = boxes[i];
+		box.makeEmpty();
+		for (int mask = 0; mask < 8; mask++) {
+			Vector q = Vector(
+				(mask & 1) ? local.vmax.x : local.vmin.x,
+				(mask & 2) ? local.vmax.y : local.vmin.y,
+				(mask & 4) ? local.vmax.z : local.vmin.z
+			) - t;
+			box.add(Vector(
+				forward.m[0][0] * q.x + forward.m[0][1] * q.y + forward.m[0][2] * q.z,
+				forward.m[1][0] * q.x + forward.m[1][1] * q.y + forward.m[1][2] * q.z,
+				forward.m[2][0] * q.x + forward.m[2][1] * q.y + forward.m[2][2] * q.z
+			));
+		}
+		// pad for the roundoff of the float transforms:
+		Vector pad = (box.vmax - box.vmin) * 1e-5 + Vector(1e-6, 1e-6, 1e-6);
+		box.vmin += -pad;
+		box.vmax += pad;
+		bbox.extend(box);
+	}
+	bvh.build(boxes, MAX_INSTANCES_PER_LEAF, MIN_INSTANCES_PER_LEAF);
+	std::vector<BBox>().swap(boxes);
+	// store the transforms in leaf order, so that the leaves index them directly:
+	const std::vector<int>& order = bvh.getPrimIndices();
+	std::vector<InstanceTransform> sorted(order.size());
+	for (int i = 0; i < int(order.size()); i++) sorted[i] = transforms[order[i]];
+	transforms.swap(sorted);
+	bvh.releasePrimIndices();
+}
+
+bool InstanceSet::intersect(const Ray& ray, IntersectionInfo& info)
+{
+	if (bvh.empty()) return false;
+	double closestDist = INF;
+	bool found = false;
+	bvh.traverseLeaves(ray, closestDist, [&] (int first, int count, double& maxDist) {
+		for (int idx = first; idx < first + count; idx++) {
+			Ray tRay;
+			double distScale = untransformRay(transforms[idx], ray, tRay);
+			if (!hitsLocalBox(tRay, maxDist * distScale)) continue;
+			IntersectionInfo tInfo;
+			if (instanced->intersect(tRay, tInfo) && tInfo.dist / distScale < maxDist) {
+				maxDist = tInfo.dist / distScale;
+				info = tInfo;
+				info.dist = maxDist;
+				info.instanceIdx = idx;
+				found = true;
+			}
+		}
+		return false;
+	});
+	if (found) info.geom = this;
+	return found;
+}
+
+void InstanceSet::computeSurface(const Ray& ray, IntersectionInfo& info)
+{
+	const InstanceTransform& T = transforms[info.instanceIdx];
+	Ray tRay;
+	double dist = info.dist;
+	info.dist *= untransformRay(T, ray, tRay);
+	instanced->computeSurface(tRay, info);
+	info.ip = ray.start + ray.dir * dist;
+	info.dist = dist;
+	// the normals transform with the inverse transpose of the forward matrix, i.e. the transpose of T.m:
+	const Vector n = info.norm;
+	info.norm = Vector(
+		T.m[0][0] * n.x + T.m[1][0] * n.y + T.m[2][0] * n.z,
+		T.m[0][1] * n.x + T.m[1][1] * n.y + T.m[2][1] * n.z,
+		T.m[0][2] * n.x + T.m[1][2] * n.y + T.m[2][2] * n.z
+	);
+	info.norm.normalize();
+	info.geom = this;
+}
+
+bool InstanceSet::occluded(const Ray& ray, double maxDist)
+{
+	if (bvh.empty()) return false;
+	bool found = false;
+	bvh.traverseLeaves(ray, maxDist, [&] (int first, int count, double& maxDist) {
+		for (int idx = first; idx < first + count && !found; idx++) {
+			Ray tRay;
+			double distScale = untransformRay(transforms[idx], ray, tRay);
+			double tMaxDist = maxDist >= INF ? INF : maxDist * distScale;
+			found = hitsLocalBox(tRay, tMaxDist) && instanced->occluded(tRay, tMaxDist);
+		}
+		return found;
+	});
+	return found;
+}
+
+bool InstanceArray::loadFromFile(const char* fileName)
+{
+	MappedFile file;
+	if (!file.open(fileName)) return false;
+	const char* data = file.getData();
+	size_t size = file.getSize();
+	float forward[12];
+	if (size >= sizeof(INSTANCES_MAGIC) && !memcmp(data, INSTANCES_MAGIC, sizeof(INSTANCES_MAGIC))) {
+		int count;
+		if (size < sizeof(INSTANCES_MAGIC) + sizeof(count)) return false;
+		memcpy(&count, data + sizeof(INSTANCES_MAGIC), sizeof(count));
+		const char* p = data + sizeof(INSTANCES_MAGIC) + sizeof(count);
+		if (count < 0 || size_t(data + size - p) / sizeof(forward) < size_t(count)) {
+			fprintf(stderr, "%s: the file is truncated\n", fileName);
+			return false;
+		}
+		for (int i = 0; i < count; i++, p += sizeof(forward)) {
+			memcpy(forward, p, sizeof(forward));
+			if (!instances.addInstance(forward)) {
+				fprintf(stderr, "%s: the transform of instance %d is singular\n", fileName, i);
+				return false;
+			}
+		}
+		return true;
+	}
+	// the text format: the numbers may be split over the lines in any way; `#' comments to the end of the line
+	int line = 1, numValues = 0;
+	for (const char* p = data, *end = data + size; p < end; ) {
+		char c = *p;
+		if (c == '\n') line++;
+		if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+			p++;
+			continue;
+		}
+		if (c == '#') {
+			while (p < end && *p != '\n') p++;
+			continue;
+		}
+		if (c == '+') p++; // (from_chars doesn't accept a leading plus)
+		std::from_chars_result result = std::from_chars(p, end, forward[numValues]);
+		if (result.ec != std::errc()) {
+			fprintf(stderr, "%s:%d: expected a number\n", fileName, line);
+			return false;
+		}
+		p = result.ptr;
+		if (++numValues == 12) {
+			numValues = 0;
+			if (!instances.addInstance(forward)) {
+				fprintf(stderr, "%s:%d: the transform of instance %d is singular\n", fileName, line,
+				        instances.getNumInstances());
+				return false;
+			}
+		}
+	}
+	if (numValues) {
+		fprintf(stderr, "%s: the last instance is incomplete (each one needs 12 numbers)\n", fileName);
+		return false;
+	}
+	return true;
+}
+
+void InstanceArray::beginRender()
+{
+	Uint32 startBuild = SDL_GetTicks();
+	instances.beginRender();
+	int numInstances = instances.getNumInstances();
+	printf("InstanceArray `%s': %d instances, BVH built in %.2fs, %.1f bytes per instance\n", name, numInstances,
+	       (SDL_GetTicks() - startBuild) / 1000.0,
+	       numInstances ? double(instances.getMemoryUsage()) / numInstances : 0.0);
+}
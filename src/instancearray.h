@@ -0,0 +1,103 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2024 by Veselin Georgiev, Slavomir Kaslev,         *
+ *                              Deyan Hadzhiev et al                       *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File instancearray.h
+ * @Brief Contains the InstanceArray class: many transformed copies of a single geometry.
+ */
+#pragma once
+
+#include <vector>
+#include "geometry.h"
+#include "node.h"
+#include "bvh.h"
+
+/// the placement of an instance, stored as the inverse (array space -> object space) affine transform,
+/// in floats: p_object = m * p + t, where m is m[0..2][0..2] and t is the last column
+struct InstanceTransform {
+	float m[3][4];
+};
+
+/**
+ * @Brief The geometry of an InstanceArray: the union of all the instances, in the array's space.
+ *
+ * The instances are indexed by their own BVH, with a few instances per leaf; the transforms are kept in
+ * leaf order, and each one transforms the ray into the instance's object space, to intersect the shared
+ * geometry there.
+ */
+class InstanceSet: public Geometry {
+	std::vector<InstanceTransform> transforms;
+	BVH bvh;
+	BBox bbox;
+	BBox localBox; //!< the bounding box of the instanced geometry, in object space
+	/// a cheap test, done before the (much costlier) intersection with the instanced geometry, as the
+	/// leaves hold several instances, and most of them are missed
+	bool hitsLocalBox(const Ray& tRay, double maxDist) const;
+public:
+	Geometry* instanced = nullptr;
+
+	/// adds an instance, given its forward (object space -> array space) 3x4 matrix, in row-major order
+	/// @returns false if the matrix is singular
+	bool addInstance(const float forward[12]);
+	int getNumInstances() const { return int(transforms.size()); }
+	size_t getMemoryUsage() const { return transforms.size() * sizeof(InstanceTransform) + bvh.getMemoryUsage(); }
+
+	void beginRender();
+	virtual bool intersect(const Ray& ray, IntersectionInfo& info) override;
+	virtual void computeSurface(const Ray& ray, IntersectionInfo& info) override;
+	virtual bool occluded(const Ray& ray, double maxDist) override;
+	virtual bool getBBox(BBox& bbox) override
+	{
+		bbox = this->bbox;
+		return !bbox.isEmpty();
+	}
+};
+
+/**
+ * @Brief A node, which places thousands of copies of one geometry, each with its own transform.
+ *
+ * The per-instance transforms are read from a file, either as text (12 numbers per instance: the rows of
+ * the 3x4 object-to-array matrix; `#' starts a comment), or in binary: the 8-byte magic "HXINST01", an
+ * int32 instance count and then 12 float32s per instance, in the same order (all little-endian).
+ * Each instance costs one InstanceTransform (48 bytes), plus its share of the BVH (about 20 bytes, as the
+ * leaves hold 4-8 instances and no index list is kept). The usual node
+ * transform (scale, rotate, translate) places the whole array in the world.
+ */
+struct InstanceArray: public Node {
+	InstanceSet instances;
+
+	InstanceArray() { geom = &instances; shader = nullptr; }
+	bool loadFromFile(const char* fileName);
+	void beginRender() override;
+
+	void fillProperties(ParsedBlock& pb)
+	{
+		if (!pb.getGeometryProp("geometry", &instances.instanced)) pb.requiredProp("geometry");
+		pb.getShaderProp("shader", &shader);
+		pb.getTransformProp(T);
+		pb.getTextureProp("bump", &bump);
+		char fn[256];
+		if (pb.getFilenameProp("file", fn)) {
+			if (!loadFromFile(fn)) pb.signalError("Could not load the instances file!");
+		} else {
+			pb.requiredProp("file");
+		}
+	}
+};
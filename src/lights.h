@@ -43,6 +43,9 @@ public:
 	/// @param color [out] - the light color/brightness of the sample. Depends on shadePos for things
 	///                      like falloff/obliquity
 	virtual void getNthSample(int sampleIdx, const Vector& shadePos, Vector& samplePos, Color& color) = 0;
+	/// true if getNthSample() is deterministic (i.e., doesn't jitter the samples), so the shadow rays
+	/// towards the light can be traced ahead of time
+	virtual bool hasFixedSamples() const { return false; }
 
 	/**
 	 * intersects a ray with the light. The param intersectionDist is in/out;
@@ -91,6 +94,7 @@ public:
 		samplePos = this->pos;
 		color = this->color;
 	}
+	bool hasFixedSamples() const override { return true; }
 	int intersect(const Ray& ray, double& intersectionDist) override;
 	double getSolidAngle(const Vector& p) override { return 0; }
 };
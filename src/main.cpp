@@ -27,6 +27,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <vector>
+#include <algorithm>
 #include <filesystem>
 #include <optional>
 #include <atomic>
@@ -58,21 +59,22 @@ struct TraceContext {
 	Node* closestNode;
 
 	std::optional<Color> raycast(const Ray& ray);
+	std::optional<Color> processHit(const Ray& ray);
 };
 
 std::optional<Color> TraceContext::raycast(const Ray& ray)
 {
 	if (ray.depth > scene.settings.maxTraceDepth) return Color(0, 0, 0);
 	closestIntersection.dist = INF;
-	closestNode = nullptr;
 	// check for ray->node intersection:
-	for (auto& node: scene.nodes) {
-		IntersectionInfo info;
-		if (node->intersect(ray, info) && info.dist < closestIntersection.dist) {
-			closestIntersection = info;
-			closestNode = node;
-		}
-	}
+	closestNode = scene.findClosestIntersection(ray, closestIntersection);
+	return processHit(ray);
+}
+
+/// the rest of raycast(), once the closest node is found (closestNode is nullptr if there's none)
+std::optional<Color> TraceContext::processHit(const Ray& ray)
+{
+	if (!closestNode) closestIntersection.dist = INF;
 	// check if the closest intersection point is actually a light:
 	std::optional<Color> hitLightColor;
 	for (auto& light: scene.lights) {
@@ -95,6 +97,9 @@ std::optional<Color> TraceContext::raycast(const Ray& ray)
 		if (scene.environment) return scene.environment->getEnvironment(ray.dir);
 		return scene.settings.backgroundColor;
 	}
+	// we'll shade this hit, so compute its point, normal, texture coordinates, etc. (the intersection
+	// only finds the distance and what's needed to compute the rest; see Intersectable::computeSurface()):
+	closestNode->computeSurface(ray, closestIntersection);
 	// if we intersect a node which has a bump map applied, modify our intersection point normal:
 	if (closestNode->bump) {
 		closestNode->bump->modifyNormal(closestIntersection);
@@ -168,20 +173,41 @@ Color pathtrace(const Ray& ray, Color pathMultiplier = Color(1, 1, 1))
 	return fromGI + fromLight * pathMultiplier / pThisPath;
 }
 
+/**
+ * The results of the shadow rays, which were traced ahead of time, in packets (see prefetchShadowRays()).
+ * It only holds the rays for the pixels, which are being shaded right now, so it's looked up linearly.
+ */
+struct ShadowRayCache {
+	static const int MAX_ENTRIES = 64;
+	struct Entry {
+		Vector A, B;
+		bool visible;
+	} entries[MAX_ENTRIES];
+	int numEntries = 0;
+
+	bool lookup(const Vector& A, const Vector& B, bool& result) const
+	{
+		for (int i = 0; i < numEntries; i++)
+			if (entries[i].A == A && entries[i].B == B) {
+				result = entries[i].visible;
+				return true;
+			}
+		return false;
+	}
+};
+static thread_local ShadowRayCache shadowRayCache;
+
 bool visible(const Vector& A, const Vector& B)
 {
+	bool cached;
+	if (shadowRayCache.lookup(A, B, cached)) return cached;
 	double D = distance(A, B);
 	Ray ray;
 	ray.start = A;
 	ray.dir = B - A;
 	ray.dir.normalize();
 	//
-	for (auto& node: scene.nodes) {
-		IntersectionInfo info;
-		if (node->intersect(ray, info) && info.dist < D) {
-			return false;
-		}
-	}
+	if (scene.findAnyIntersection(ray, D)) return false;
 	for (auto& light: scene.lights) {
 		if (light->intersect(ray, D)) return false;
 	}
@@ -189,6 +215,143 @@ bool visible(const Vector& A, const Vector& B)
 	return true;
 }
 
+/// the packet version of visible(): returns a mask of the rays, which hit something (geometry or a light)
+/// before their maxDist
+static int findOccludedRays(const RayPacket& packet)
+{
+	int occludedMask = scene.findAnyIntersections(packet);
+	for (int i = 0; i < RayPacket::SIZE; i++) if ((packet.activeMask & ~occludedMask) & (1 << i)) {
+		double maxDist = packet.maxDist[i];
+		for (auto& light: scene.lights)
+			if (light->intersect(packet.rays[i], maxDist)) {
+				occludedMask |= 1 << i;
+				break;
+			}
+	}
+	return occludedMask;
+}
+
+/**
+ * Traces the shadow rays, which Lambert::computeColor() (and the like) are about to trace for the given hits,
+ * in packets, and puts the results in the shadowRayCache. Only lights with a single, fixed sample (i.e. point
+ * lights) are considered; their rays start at the same point (see visible()), so they're very coherent.
+ */
+static void prefetchShadowRays(const TraceContext tc[], int shadeMask)
+{
+	ShadowRayCache& cache = shadowRayCache;
+	cache.numEntries = 0;
+	for (auto& light: scene.lights) {
+		if (light->getNumSamples() != 1 || !light->hasFixedSamples()) continue;
+		if (cache.numEntries + RayPacket::SIZE > ShadowRayCache::MAX_ENTRIES) break;
+		RayPacket packet;
+		int entryIdx[RayPacket::SIZE];
+		for (int i = 0; i < RayPacket::SIZE; i++) if (shadeMask & (1 << i)) {
+			const IntersectionInfo& info = tc[i].closestIntersection;
+			Vector lightPos;
+			Color lightColor;
+			light->getNthSample(0, info.ip, lightPos, lightColor);
+			if (lightColor.isZero()) continue; // (the shader won't ask about these)
+			// the same segment, that the shader would check, in the same direction:
+			Vector A = lightPos, B = info.ip + info.norm * 1e-6;
+			Ray& ray = packet.rays[i];
+			ray.start = A;
+			ray.dir = B - A;
+			ray.dir.normalize();
+			packet.maxDist[i] = distance(A, B);
+			packet.activeMask |= 1 << i;
+			entryIdx[i] = cache.numEntries++;
+			cache.entries[entryIdx[i]] = { A, B, true };
+		}
+		if (!packet.activeMask) continue;
+		int occludedMask = findOccludedRays(packet);
+		for (int i = 0; i < RayPacket::SIZE; i++) if (packet.activeMask & (1 << i))
+			cache.entries[entryIdx[i]].visible = !(occludedMask & (1 << i));
+	}
+}
+
+/**
+ * The packet version of raytrace(): traces the (primary) rays of a packet through the scene together, then
+ * their shadow rays to the point lights, and then shades every ray on its own.
+ */
+static void raytracePacket(const RayPacket& packet, Color colors[])
+{
+	TraceContext tc[RayPacket::SIZE];
+	IntersectionInfo infos[RayPacket::SIZE];
+	Node* closestNodes[RayPacket::SIZE];
+	scene.findClosestIntersections(packet, infos, closestNodes);
+	int shadeMask = 0;
+	bool needShadowRays = false;
+	for (int i = 0; i < RayPacket::SIZE; i++) if (packet.activeMask & (1 << i)) {
+		tc[i].closestIntersection = infos[i];
+		tc[i].closestNode = closestNodes[i];
+		auto earlyResult = tc[i].processHit(packet.rays[i]);
+		if (earlyResult) {
+			colors[i] = *earlyResult;
+		} else {
+			shadeMask |= 1 << i;
+			if (tc[i].closestNode->shader->usesShadowRays()) needShadowRays = true;
+		}
+	}
+	if (needShadowRays) prefetchShadowRays(tc, shadeMask);
+	for (int i = 0; i < RayPacket::SIZE; i++) if (shadeMask & (1 << i))
+		colors[i] = tc[i].closestNode->shader->computeColor(packet.rays[i], tc[i].closestIntersection);
+	shadowRayCache.numEntries = 0;
+}
+
+/// a hash of a sample's position in the image, for lodDither. It doesn't consume random numbers, and it
+/// stays the same from frame to frame, so the LOD blend changes only where the blend factor does
+static float sampleDither(double x, double y)
+{
+	unsigned h = unsigned(int(x * 64)) * 0x9e3779b1u ^ unsigned(int(y * 64)) * 0x85ebca77u;
+	h ^= h >> 15;
+	h *= 0x2c1b3c6du;
+	h ^= h >> 12;
+	h *= 0x297a2d39u;
+	h ^= h >> 15;
+	return (h >> 8) * (1.0f / 16777216.0f);
+}
+
+/// renders the pixels of a rectangle with 2x2 ray packets (this is only used for the plain raytracing,
+/// without depth of field, stereo, or path tracing; see renderWithoutMonteCarlo())
+static void renderRectWithPackets(const Rect& r)
+{
+	for (int y = r.y0; y < r.y1; y += 2) {
+		if (checkForUserExit()) return;
+		for (int x = r.x0; x < r.x1; x += 2) {
+			RayPacket packet;
+			int px[RayPacket::SIZE], py[RayPacket::SIZE];
+			for (int i = 0; i < RayPacket::SIZE; i++) {
+				px[i] = x + (i & 1);
+				py[i] = y + (i >> 1);
+				if (px[i] >= r.x1 || py[i] >= r.y1) continue;
+				packet.rays[i] = scene.camera->getScreenRay(px[i], py[i]);
+				packet.maxDist[i] = INF;
+				packet.activeMask |= 1 << i;
+			}
+			Color colors[RayPacket::SIZE];
+			// the whole packet must intersect the same LODs. Each pixel has its own lodDither (as in
+			// traceSingleRay()), so the pixels, whose dithers select different LODs, go in separate packets:
+			int lodClass[RayPacket::SIZE];
+			for (int i = 0; i < RayPacket::SIZE; i++)
+				if (packet.activeMask & (1 << i)) lodClass[i] = scene.getLODClass(sampleDither(px[i], py[i]));
+			int remaining = packet.activeMask;
+			while (remaining) {
+				int first = 0;
+				while (!(remaining & (1 << first))) first++;
+				RayPacket part = packet;
+				part.activeMask = 0;
+				for (int i = first; i < RayPacket::SIZE; i++)
+					if ((remaining & (1 << i)) && lodClass[i] == lodClass[first]) part.activeMask |= 1 << i;
+				remaining &= ~part.activeMask;
+				lodDither = sampleDither(px[first], py[first]);
+				raytracePacket(part, colors);
+			}
+			for (int i = 0; i < RayPacket::SIZE; i++)
+				if (packet.activeMask & (1 << i)) vfb[py[i]][px[i]] = colors[i];
+		}
+	}
+}
+
 static void detectAApixels()
 {
 	const int neighbours[8][2] = {
@@ -227,6 +390,7 @@ std::function<Ray(double, double, double, double, double)> rayGenerator;
 Color traceSingleRay(double x, double y, bool fast = false)
 {
 	//if (sqr(x - vipX) + sqr(y - vipY) < 100) return Color(1, 1, 0);
+	lodDither = sampleDither(x, y);
 	double u, v;
 	if (scene.camera->dof) unitDiskSample(u, v);
 	//sum += raytrace(scene.camera->getDOFScreenRay(x + randDouble(), y + randDouble(), u, v));
@@ -268,13 +432,19 @@ bool renderWithoutMonteCarlo(bool displayProgress) // returns true if the comple
 	};
 	static const int AA_KERNEL_SIZE = int(COUNT_OF(AA_KERNEL));
 	int foveated_thresh = sqr(scene.settings.foveatedRadius);
+	// the packets are only for the plain raytracing (the path tracing and DOF are handled in renderWithMonteCarlo()):
+	bool usePackets = scene.settings.rayPackets && scene.camera->stereoSeparation == 0.0 && !scene.camera->dof
+		&& !scene.settings.gi;
 
 	// Pass 1: render without anti-aliasing
 	std::atomic<int> cursor(0);
-	threadPool->run([displayProgress, &cursor, foveated_thresh] (int threadIdx, int threadCount) {
+	threadPool->run([displayProgress, &cursor, foveated_thresh, usePackets] (int threadIdx, int threadCount) {
 		for (int i = cursor++; i < int(buckets.size()); i = cursor++) {
 			auto& r = buckets[i];
-			if (scene.settings.foveatedRadius <= 0) {
+			if (scene.settings.foveatedRadius <= 0 && usePackets) {
+				// shoot one ray per pixel, in 2x2 packets
+				renderRectWithPackets(r);
+			} else if (scene.settings.foveatedRadius <= 0) {
 				// plain old rendering. Raytrace through every single pixel; shoot one ray only
 				for (int y = r.y0; y < r.y1; y++) {
 					if (checkForUserExit()) return;
@@ -344,28 +514,249 @@ bool renderWithoutMonteCarlo(bool displayProgress) // returns true if the comple
 	return !checkForUserExit();
 }
 
+/// which of the 8 octants the direction points to (the sign bits of its components)
+static inline int rayOctant(const Vector& dir)
+{
+	return (dir.x < 0 ? 1 : 0) | (dir.y < 0 ? 2 : 0) | (dir.z < 0 ? 4 : 0);
+}
+
+/**
+ * The wavefront ("stream") version of pathtrace(): it computes the same estimate, but instead of following
+ * one path to its end before starting the next one, it keeps a large queue of paths, and extends all of them
+ * by one bounce at a time, in separate stages: intersection, shading (which also picks the next ray and the
+ * light sample), and shadow rays. Before each stage the queue is sorted (by ray direction octant, or by shader),
+ * so that consecutive paths tend to touch the same geometry and run the same shader code.
+ */
+class WavefrontIntegrator {
+	static const int QUEUE_SIZE = 16384;
+	struct PathState {
+		Ray ray;
+		Color throughput;   //!< the `pathMultiplier' in pathtrace()
+		int pixelIdx;       //!< where to accumulate the result (an index in `sums')
+		float lodDither;    //!< of the path's sample (see lodDither)
+		TraceContext tc;    //!< the closest hit of the ray, after intersectStage()
+	};
+	struct ShadowRay {
+		Vector A, B;        //!< the segment to check, as in visible(A, B)
+		Color contribution; //!< to add to the pixel, if the segment is unobstructed
+		int pixelIdx;
+		float lodDither;
+	};
+	std::vector<PathState> paths, nextPaths;
+	std::vector<ShadowRay> shadowRays;
+	std::vector<std::pair<uint64_t, int>> order; // (sort key, index) pairs
+	std::vector<Color> sums;
+
+	void sortOrder();
+	void intersectStage();
+	void shadeStage();
+	void shadowStage();
+public:
+	void renderRect(const Rect& r, int samplesPerPixel);
+};
+
+void WavefrontIntegrator::sortOrder()
+{
+	std::sort(order.begin(), order.end(), [] (const std::pair<uint64_t, int>& a, const std::pair<uint64_t, int>& b) {
+		return a.first < b.first;
+	});
+}
+
+/// finds the closest hits of all the paths' rays (in packets, if enabled), and retires the paths, which
+/// didn't hit a surface to shade (i.e. escaped to the environment or hit a light)
+void WavefrontIntegrator::intersectStage()
+{
+	order.clear();
+	// (the rays of a packet must select the same LODs, so the LOD class is a part of the key, too):
+	for (int i = 0; i < int(paths.size()); i++)
+		order.push_back({ (uint64_t(scene.getLODClass(paths[i].lodDither)) << 3) | rayOctant(paths[i].ray.dir), i });
+	sortOrder();
+	nextPaths.clear();
+	auto finishHit = [this] (PathState& path) {
+		auto earlyResult = path.tc.processHit(path.ray);
+		if (earlyResult) sums[path.pixelIdx] += (*earlyResult) * path.throughput;
+		else nextPaths.push_back(path);
+	};
+	int n = int(order.size());
+	for (int start = 0; start < n; ) {
+		// a packet of up to 4 consecutive rays in the same octant and LOD class:
+		int end = start + 1;
+		if (scene.settings.rayPackets)
+			while (end < n && end - start < RayPacket::SIZE && order[end].first == order[start].first) end++;
+		if (end - start == 1) {
+			PathState& path = paths[order[start].second];
+			lodDither = path.lodDither;
+			path.tc.closestIntersection.dist = INF;
+			path.tc.closestNode = scene.findClosestIntersection(path.ray, path.tc.closestIntersection);
+			finishHit(path);
+		} else {
+			RayPacket packet;
+			IntersectionInfo infos[RayPacket::SIZE];
+			Node* closestNodes[RayPacket::SIZE];
+			lodDither = paths[order[start].second].lodDither; // (any of the packet's will do, see getLODClass())
+			for (int i = 0; i < end - start; i++) {
+				packet.rays[i] = paths[order[start + i].second].ray;
+				packet.maxDist[i] = INF;
+				packet.activeMask |= 1 << i;
+			}
+			scene.findClosestIntersections(packet, infos, closestNodes);
+			for (int i = 0; i < end - start; i++) {
+				PathState& path = paths[order[start + i].second];
+				path.tc.closestIntersection = infos[i];
+				path.tc.closestNode = closestNodes[i];
+				finishHit(path);
+			}
+		}
+		start = end;
+	}
+	std::swap(paths, nextPaths);
+}
+
+/// runs the shaders on all the hits (grouped by shader): spawns the next ray of each path, and picks a
+/// light sample for the explicit light sampling, which is checked later, in shadowStage()
+void WavefrontIntegrator::shadeStage()
+{
+	order.clear();
+	for (int i = 0; i < int(paths.size()); i++)
+		order.push_back({ (uint64_t(uintptr_t(paths[i].tc.closestNode->shader)) << 3) | rayOctant(paths[i].ray.dir), i });
+	sortOrder();
+	nextPaths.clear();
+	shadowRays.clear();
+	for (auto& item: order) {
+		PathState& path = paths[item.second];
+		const IntersectionInfo& info = path.tc.closestIntersection;
+		Shader* shader = path.tc.closestNode->shader;
+		// Option A: continue randomly
+		Ray newRay = path.ray;
+		Color brdfColor;
+		float brdfPDF;
+		newRay.depth++;
+		shader->spawnRay(info, path.ray.dir, newRay, brdfColor, brdfPDF);
+		if (brdfPDF <= 0) continue; // (pathtrace() drops the light sample in this case, too)
+		Color newThroughput = path.throughput * brdfColor / brdfPDF;
+		// (these are the early exits of pathtrace() and raycast() for the new ray):
+		if (newThroughput.intensity() >= 0.001f && newRay.depth <= scene.settings.maxTraceDepth)
+			nextPaths.push_back({ newRay, newThroughput, path.pixelIdx, path.lodDither, TraceContext() });
+		// Option B: explicit light sampling (see pathtrace() for details)
+		if (scene.lights.empty()) continue;
+		Light* light = scene.lights[randInt(0, scene.lights.size() - 1)];
+		const Vector& x = info.ip;
+		double solidAngle = light->getSolidAngle(x);
+		if (solidAngle <= 0) continue;
+		int sampleIdx = randInt(0, light->getNumSamples() - 1);
+		Color unused;
+		Vector pointOnLight;
+		light->getNthSample(sampleIdx, x, pointOnLight, unused);
+		Vector w_out = pointOnLight - x;
+		w_out.normalize();
+		Color fromLight = light->getColor() * light->getScaleFactor() * shader->eval(info, path.ray.dir, w_out);
+		if (fromLight.intensity() <= 0) continue;
+		float pChooseLight = 1.0f / scene.lights.size();
+		float pHitLight = 1.0f / solidAngle;
+		float pThisPath = pChooseLight * pHitLight;
+		shadowRays.push_back({ x + info.norm * 1e-6, pointOnLight, fromLight * path.throughput / pThisPath, path.pixelIdx,
+			path.lodDither });
+	}
+	std::swap(paths, nextPaths);
+}
+
+/// traces the shadow rays of the light samples (sorted by direction, in packets if enabled), and adds
+/// the contributions of the unobstructed ones
+void WavefrontIntegrator::shadowStage()
+{
+	order.clear();
+	for (int i = 0; i < int(shadowRays.size()); i++)
+		order.push_back({ (uint64_t(scene.getLODClass(shadowRays[i].lodDither)) << 3)
+			| rayOctant(shadowRays[i].B - shadowRays[i].A), i });
+	sortOrder();
+	int n = int(order.size());
+	for (int start = 0; start < n; ) {
+		int end = start + 1;
+		if (scene.settings.rayPackets)
+			while (end < n && end - start < RayPacket::SIZE && order[end].first == order[start].first) end++;
+		if (end - start == 1) {
+			const ShadowRay& sr = shadowRays[order[start].second];
+			lodDither = sr.lodDither;
+			if (visible(sr.A, sr.B)) sums[sr.pixelIdx] += sr.contribution;
+		} else {
+			RayPacket packet;
+			lodDither = shadowRays[order[start].second].lodDither; // (the same for the packet, as above)
+			for (int i = 0; i < end - start; i++) {
+				const ShadowRay& sr = shadowRays[order[start + i].second];
+				Ray& ray = packet.rays[i];
+				ray.start = sr.A;
+				ray.dir = sr.B - sr.A;
+				ray.dir.normalize();
+				packet.maxDist[i] = distance(sr.A, sr.B);
+				packet.activeMask |= 1 << i;
+			}
+			int occludedMask = findOccludedRays(packet);
+			for (int i = 0; i < end - start; i++) if (!(occludedMask & (1 << i))) {
+				const ShadowRay& sr = shadowRays[order[start + i].second];
+				sums[sr.pixelIdx] += sr.contribution;
+			}
+		}
+		start = end;
+	}
+}
+
+/// renders the pixels of a rectangle with `samplesPerPixel' paths each. The samples of a pixel are next to
+/// each other in the queue, so the primary rays of a queue are very coherent
+void WavefrontIntegrator::renderRect(const Rect& r, int samplesPerPixel)
+{
+	int numPixels = r.w * r.h;
+	sums.assign(numPixels, Color(0, 0, 0));
+	long long numSamples = (long long) numPixels * samplesPerPixel;
+	for (long long first = 0; first < numSamples; first += QUEUE_SIZE) {
+		long long last = std::min(numSamples, first + QUEUE_SIZE);
+		paths.clear();
+		for (long long sample = first; sample < last; sample++) {
+			int pixelIdx = int(sample / samplesPerPixel);
+			int x = r.x0 + pixelIdx % r.w, y = r.y0 + pixelIdx / r.w;
+			double u, v;
+			if (scene.camera->dof) unitDiskSample(u, v);
+			double sx = x + randDouble(), sy = y + randDouble();
+			Ray ray = rayGenerator(sx, sy, u, v, 0);
+			paths.push_back({ ray, Color(1, 1, 1), pixelIdx, sampleDither(sx, sy), TraceContext() });
+		}
+		while (!paths.empty()) {
+			if (checkForUserExit()) return;
+			intersectStage();
+			shadeStage();
+			shadowStage();
+		}
+	}
+	float mul = 1.0f / samplesPerPixel;
+	for (int i = 0; i < numPixels; i++)
+		vfb[r.y0 + i / r.w][r.x0 + i % r.w] = sums[i] * mul;
+}
+
 bool renderWithMonteCarlo(bool displayProgress, int raysPerPixel) // returns true if the complete frame is rendered
 {
 	// compute the auto-focus, if required:
 	if (scene.camera->dof && scene.camera->autoFocus) {
 		Ray midRay = scene.camera->getScreenRay(frameWidth() * 0.5, frameHeight() * 0.5);
-		double closestIntersectionDist = INF;
-		//
-		for (auto& node: scene.nodes) {
-			IntersectionInfo info;
-			if (node->intersect(midRay, info) && info.dist < closestIntersectionDist)
-				closestIntersectionDist = info.dist;
-		}
+		IntersectionInfo info;
 		//
-		if (closestIntersectionDist < INF)
-			scene.camera->focalPlaneDist = closestIntersectionDist;
+		if (scene.findClosestIntersection(midRay, info))
+			scene.camera->focalPlaneDist = info.dist;
 	}
 	// render the image (only one pass with many rays per pixel)
+	// the wavefront integrator replaces pathtrace() (it can't do the stereo mixing in traceSingleRay(), though):
+	bool useWavefront = scene.settings.gi && scene.settings.wavefront && scene.camera->stereoSeparation == 0.0;
 	std::atomic<int> cursor(0);
-	threadPool->run([displayProgress, raysPerPixel, &cursor] (int threadIdx, int threadCount) {
+	threadPool->run([displayProgress, raysPerPixel, useWavefront, &cursor] (int threadIdx, int threadCount) {
 		float mul = 1.0f / raysPerPixel;
+		std::unique_ptr<WavefrontIntegrator> wavefront;
+		if (useWavefront) wavefront = std::make_unique<WavefrontIntegrator>();
 		for (int i = cursor++; i < int(buckets.size()); i = cursor++) {
 			auto& r = buckets[i];
+			if (useWavefront) {
+				wavefront->renderRect(r, raysPerPixel);
+				if (checkForUserExit()) return;
+				if (displayProgress) displayVFBRect(r, vfb);
+				continue;
+			}
 			for (int y = r.y0; y < r.y1; y++) {
 				if (checkForUserExit()) return;
 				for (int x = r.x0; x < r.x1; x++) {
@@ -514,6 +905,8 @@ void renderThreadEntry() {
 	// split the screen into regions:
 	buckets = getBucketsList(scene.settings.interactive ? 16 : 64);
 	// render:
+	ProcessMemoryStats memBefore, memAfter;
+	bool haveMemStats = getProcessMemoryStats(memBefore);
 	Uint32 start = SDL_GetTicks();
 	if (scene.settings.interactive) {
 		isInteractive = true;
@@ -523,6 +916,15 @@ void renderThreadEntry() {
 		displayVFB(vfb);
 		printf("Elapsed time: %.2f seconds.\n", (end - start) / 1000.0);
 	}
+	scene.endRender();
+	// the memory footprint (e.g. to see how much of the out-of-core meshes had to be paged in):
+	if (haveMemStats && getProcessMemoryStats(memAfter)) {
+		printf("Peak resident memory: %.1f MB; page faults during the render: %lld",
+			memAfter.peakResident / 1048576.0, memAfter.pageFaults - memBefore.pageFaults);
+		if (memAfter.majorPageFaults >= 0)
+			printf(" (%lld major)", memAfter.majorPageFaults - memBefore.majorPageFaults);
+		printf("\n");
+	}
 }
 
 const char* DEFAULT_SCENE = "data/simple.hexray";
@@ -535,6 +937,8 @@ int main(int argc, char** argv)
 	// parse the scene:
 	const char* sceneFile = DEFAULT_SCENE;
 	if (argc > 1 && strlen(argv[1]) && argv[1][0] != '-') sceneFile = argv[1];
+	// (the meshes are parsed and prepared on the thread pool while loading, so it's needed already):
+	threadPool = std::make_unique<ThreadPool>(std::thread::hardware_concurrency());
 	if (!scene.parseScene(sceneFile)) {
 		printf("Could not parse the scene file (%s)!\n", sceneFile);
 		return 1;
@@ -542,7 +946,8 @@ int main(int argc, char** argv)
 	// configure the thread pool:
 	if (scene.settings.numThreads <= 0) scene.settings.numThreads = std::thread::hardware_concurrency();
 	printf("Rendering on %d threads\n", scene.settings.numThreads);
-	threadPool = std::make_unique<ThreadPool>(scene.settings.numThreads);
+	if (threadPool->getThreadCount() != scene.settings.numThreads)
+		threadPool = std::make_unique<ThreadPool>(scene.settings.numThreads);
 	// configure the functions for ray generation and ray tracing:
 	traceFunction = raytrace;
 	if (scene.settings.gi) traceFunction = [] (Ray ray) { return pathtrace(ray); };
@@ -122,6 +122,8 @@ void Transform::loadIdentity()
 	m.loadIdentity();
 	invM.loadIdentity();
 	transposedInverse.loadIdentity();
+	kind = TRANSFORM_IDENTITY;
+	uniformScale = 1;
 }
 
 void Transform::scale(double x, double y, double z)
@@ -135,6 +137,7 @@ void Transform::scale(double x, double y, double z)
 	this->m = this->m * tmp;
 	this->invM = inverseMatrix(m);
 	transposedInverse = transpose(invM);
+	kind = TRANSFORM_GENERAL;
 }
 
 void Transform::rotate(double yaw, double pitch, double roll)
@@ -144,11 +147,42 @@ void Transform::rotate(double yaw, double pitch, double roll)
 	                    rotationAroundY(toRadians(yaw));
 	this->invM = inverseMatrix(m);
 	transposedInverse = transpose(invM);
+	kind = TRANSFORM_GENERAL;
 }
 
 void Transform::translate(const Vector& t)
 {
 	offset += t;
+	kind = TRANSFORM_GENERAL;
+}
+
+void Transform::classify()
+{
+	kind = TRANSFORM_GENERAL;
+	uniformScale = 1;
+	bool isIdentity = true;
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 3; j++)
+			if (m.m[i][j] != (i == j ? 1.0 : 0.0)) isIdentity = false;
+	if (isIdentity) {
+		kind = (offset == Vector(0, 0, 0)) ? TRANSFORM_IDENTITY : TRANSFORM_TRANSLATE;
+		return;
+	}
+	// a rotation times a uniform scale has orthogonal rows of the same length. The tolerance is tight, so that
+	// invRotation keeps the directions normalized as well as normalize() does:
+	Vector rows[3];
+	for (int i = 0; i < 3; i++) rows[i] = Vector(m.m[i][0], m.m[i][1], m.m[i][2]);
+	double scale2 = rows[0].lengthSqr();
+	if (!(scale2 > 0)) return;
+	for (int i = 0; i < 3; i++) {
+		if (fabs(rows[i].lengthSqr() - scale2) > 1e-12 * scale2) return;
+		if (fabs(dot(rows[i], rows[(i + 1) % 3])) > 1e-12 * scale2) return;
+	}
+	kind = TRANSFORM_UNIFORM;
+	uniformScale = sqrt(scale2);
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 3; j++)
+			invRotation.m[i][j] = invM.m[i][j] * uniformScale;
 }
 
 
@@ -69,11 +69,22 @@ Matrix rotationAroundX(double angle); //!< returns a rotation matrix around the
 Matrix rotationAroundY(double angle); //!< same as above, but rotate around Y
 Matrix rotationAroundZ(double angle); //!< same as above, but rotate around Z
 
+/// what a Transform does, from the most specific to the most general (see Transform::classify())
+enum TransformKind {
+	TRANSFORM_IDENTITY,
+	TRANSFORM_TRANSLATE, //!< only a translation
+	TRANSFORM_UNIFORM,   //!< a rotation and a uniform scale, plus a translation
+	TRANSFORM_GENERAL,   //!< any affine transform
+};
+
 struct Transform {
 	Vector offset;
 	Matrix m;
 	Matrix invM;
 	Matrix transposedInverse;
+	TransformKind kind;   //!< set by classify(); any of the setup functions below resets it to TRANSFORM_GENERAL (or IDENTITY)
+	double uniformScale;  //!< for TRANSFORM_UNIFORM: the scale
+	Matrix invRotation;   //!< for TRANSFORM_UNIFORM: invM without the scale, i.e. it keeps the lengths
 
 	Transform()
 	{
@@ -87,6 +98,8 @@ struct Transform {
 	void scale(double x, double y, double z);
 	void rotate(double yaw, double pitch, double roll);
 	void translate(const Vector& t);
+	/// finds the most specific kind of the transform, so that its users may pick a faster way to apply it
+	void classify();
 
 	// use the transform:
 	Vector transformPoint(const Vector& t) const;
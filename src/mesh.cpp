@@ -27,14 +27,33 @@
 #include <string.h>
 #include <algorithm>
 #include <numeric>
+#include <atomic>
+#include <unordered_map>
+#include <charconv>
 #include <SDL.h>
 #include "mesh.h"
 #include "constants.h"
 #include "color.h"
+#include "threading.h"
+#include "simplify.h"
 using std::max;
 using std::vector;
 using std::string;
 
+// k-d tree SAH constants. The costs are relative, only their ratio matters. KD_INTERSECT_COST was picked by
+// timing random rays against the meshes of data/kdtree_bench.hexray, and against a 500k-triangle heightfield:
+// the small meshes favor cheaper triangle tests (bigger leaves), the big one dearer ones, and 0.3 is within
+// ~7% of the fastest value for both. (Keep it at that, unless it's re-measured the same way.)
+static const double KD_TRAVERSAL_COST = 1.0;  //!< cost of traversing an inner node
+static const double KD_INTERSECT_COST = 0.3;  //!< cost of a single ray-triangle test
+static const double KD_EMPTY_BONUS    = 0.2;  //!< cost reduction for splits which cut off empty space
+static const double KD_EMPTY_PAD      = 1e-5; //!< gap between an empty-space cutoff and the geometry (of the node's size)
+static const int    KD_SAH_BINS       = 32;   //!< number of candidate split planes per axis
+static const int    KD_MAX_DEPTH      = 64;
+static const int    KD_PARALLEL_PARTITION_MIN = 4096; //!< nodes with that many triangles are partitioned on all threads
+static const int    KD_LAZY_DEPTH     = 8;    //!< the levels of the k-d tree, which are built up front with lazyKD
+static const int    LOD_MIN_TRIANGLES = 64;   //!< the meshes aren't simplified below that
+
 
 void KDTreeStats::printStats()
 {
@@ -44,88 +63,535 @@ void KDTreeStats::printStats()
 	printf("   max depth        : %d\n", maxDepth);
 	printf("   avg depth        : %.1f\n", double(sumDepth) / numLeafNodes);
 	printf("   avg tris per leaf: %.1f\n", double(sumTriLeaf) / numLeafNodes);
+	printf("   SAH cost         : %.2f\n", sahCost);
+	printf("   memory           : %.1f KB\n", memoryUsed / 1024.0);
+	printf("   bytes per node   : %.1f (%d for the node itself, the rest are triangle blocks)\n",
+		double(memoryUsed) / numNodes, int(sizeof(KDTreeNode)));
 }
 
-void Mesh::beginRender()
+void KDTreeStats::add(const KDTreeStats& other)
 {
-	if (recenter) {
-		Vector center(0, 0, 0);
-		for (int i = 1; i < (int) vertices.size(); i++)
-			center += vertices[i];
-		center /= (vertices.size() - 1);
-		for (int i = 1; i < (int) vertices.size(); i++)
-			vertices[i] += -center;
-	}
+	numNodes += other.numNodes;
+	numLeafNodes += other.numLeafNodes;
+	maxDepth = max(maxDepth, other.maxDepth);
+	sumDepth += other.sumDepth;
+	sumTriLeaf += other.sumTriLeaf;
+	sahCost += other.sahCost;
+}
 
+void Mesh::beginRender()
+{
+	statRays = 0;
+	statNodesVisited = 0;
+	statTestsAvoided = 0;
+	if (!clusters.empty()) return; // (out-of-core meshes are all prepared while loading, see loadOutOfCore())
+	applyVertexOptions();
 	computeBoundingGeometry();
-	if (useKDTree) {
+	if (useBVH) {
+		buildBVH();
+	} else if (useKDTree) {
 		memset(&kdstats, 0, sizeof(kdstats));
 		unsigned startBuild = SDL_GetTicks();
-		kdroot = new KDTreeNode;
-		std::vector<int> t_list(triangles.size());
+		kdNodes.clear();
+		kdTriangles.clear();
+		kdNodes.emplace_back();
+		kdLazySubtrees.clear();
+		std::vector<int> t_list(getNumTriangles());
 		std::iota(t_list.begin(), t_list.end(), 0);
-		buildKD(kdroot, this->bbox, t_list, 0);
+		if (lazyKD)
+			buildKDLazy(t_list);
+		else if (threadPool && threadPool->getThreadCount() > 1)
+			buildKDParallel(t_list);
+		else
+			buildKD(kdNodes, kdTriangles, 0, this->bbox, t_list, 0, kdstats);
+		packKDLeaves(kdNodes, kdTriangles, kdBlocks);
+		kdNodes.shrink_to_fit();
+		double rootArea = this->bbox.surfaceArea();
+		kdstats.sahCost = rootArea > 0 ? kdstats.sahCost / rootArea : 0;
+		kdstats.memoryUsed = kdNodes.size() * sizeof(KDTreeNode) + kdBlocks.size() * sizeof(TriangleBlock4);
 		unsigned endBuild = SDL_GetTicks();
-		printf("K-d tree built in %.2fs\n", (endBuild - startBuild) / 1000.0);
-		kdstats.printStats();
+		if (lazyKD) {
+			printf("K-d tree: top levels built in %.2fs (%d nodes, %.1f KB), %d subtrees left for the rays to build\n",
+				(endBuild - startBuild) / 1000.0, kdstats.numNodes, kdstats.memoryUsed / 1024.0, int(kdLazySubtrees.size()));
+		} else {
+			printf("K-d tree built in %.2fs\n", (endBuild - startBuild) / 1000.0);
+			kdstats.printStats();
+		}
+	}
+	// if the object is set to be smooth-shaded, but it lacks normals, we have to revert it to "faceted":
+	if (getNumNormals() <= 1) faceted = true;
+	printf("Mesh loaded, %d triangles, %.1f MB of geometry data, %.1f MB in the acceleration structures\n",
+		getNumTriangles(), getGeometryMemory() / 1048576.0, getAccelerationMemory() / 1048576.0);
+	buildLODs();
+}
+
+/// applies the `recenter' and `autoSmooth' options to the loaded geometry
+void Mesh::applyVertexOptions()
+{
+	if (recenter) {
+		Vector center(0, 0, 0);
+		for (int i = 1; i < getNumVertices(); i++)
+			center += getVertex(i);
+		center /= (getNumVertices() - 1);
+		for (int i = 1; i < (int) vertices.size(); i++)
+			vertices[i] += -center;
+		for (int i = 1; i < (int) cVertices.size(); i++)
+			cVertices[i] = Float3(cVertices[i].toVector() - center);
 	}
-	printf("Mesh loaded, %d triangles\n", int(triangles.size()));
 	// handle auto-smoothing:
-	if (normals.size() <= 1 && autoSmooth) {
-		normals.resize(vertices.size(), Vector(0, 0, 0)); // extend the normals[] array, and fill with zeros
-		for (int i = 0; i < (int) triangles.size(); i++)
-			for (int j = 0; j < 3; j++) {
-				triangles[i].n[j] = triangles[i].v[j];
-				normals[triangles[i].n[j]] += triangles[i].gnormal;
+	if (getNumNormals() <= 1 && autoSmooth) {
+		int numTriangles = getNumTriangles(), numVertices = getNumVertices();
+		std::vector<Vector> faceNormals(numTriangles);
+		parallelFor(numTriangles, 16384, [&] (int begin, int end) {
+			for (int i = begin; i < end; i++) {
+				TriangleIndices& t = compactStorage ? cTriangles[i] : triangles[i];
+				Vector gnormal = (getVertex(t.v[1]) - getVertex(t.v[0])) ^ (getVertex(t.v[2]) - getVertex(t.v[0]));
+				gnormal.normalize();
+				faceNormals[i] = gnormal;
+				for (int j = 0; j < 3; j++) t.n[j] = t.v[j];
 			}
-		for (int i = 1; i < (int) normals.size(); i++)
-			if (normals[i].lengthSqr() > 1e-9) normals[i].normalize();
+		});
+		// gather the triangles around each vertex (in triangle order, so the sums below are exactly the
+		// same as if the face normals were added to the vertices one by one):
+		std::vector<int> firstCorner(numVertices + 1, 0), cornerTriangles(3 * numTriangles);
+		for (int i = 0; i < numTriangles; i++)
+			for (int j = 0; j < 3; j++) firstCorner[getTriangle(i).v[j] + 1]++;
+		for (int i = 0; i < numVertices; i++) firstCorner[i + 1] += firstCorner[i];
+		std::vector<int> cursor(firstCorner.begin(), firstCorner.end() - 1);
+		for (int i = 0; i < numTriangles; i++)
+			for (int j = 0; j < 3; j++) cornerTriangles[cursor[getTriangle(i).v[j]]++] = i;
+		std::vector<Vector> smoothNormals(numVertices, Vector(0, 0, 0));
+		parallelFor(numVertices, 16384, [&] (int begin, int end) {
+			for (int i = begin; i < end; i++) {
+				for (int k = firstCorner[i]; k < firstCorner[i + 1]; k++) smoothNormals[i] += faceNormals[cornerTriangles[k]];
+				if (i > 0 && smoothNormals[i].lengthSqr() > 1e-9) smoothNormals[i].normalize();
+			}
+		});
+		resizeArrays(numVertices, numVertices, getNumUVs(), numTriangles);
+		parallelFor(numVertices, 16384, [&] (int begin, int end) {
+			for (int i = begin; i < end; i++) storeNormal(i, smoothNormals[i]);
+		});
 		faceted = false;
 	}
-	// if the object is set to be smooth-shaded, but it lacks normals, we have to revert it to "faceted":
-	if (normals.size() <= 1) faceted = true;
 }
 
-Mesh::~Mesh()
+/**
+ * Builds the simplified versions of the mesh (see lodLevels). Each one is a Mesh of its own, with the same
+ * options, and its own acceleration structure. They are made in succession by a single MeshSimplifier, so
+ * the error of every level includes the errors of the previous ones.
+ */
+void Mesh::buildLODs()
+{
+	lods.clear();
+	lodErrors.clear();
+	if (lodLevels <= 0 || getNumTriangles() < 2 * LOD_MIN_TRIANGLES) return;
+	unsigned startBuild = SDL_GetTicks();
+	vector<Vector> positions(getNumVertices());
+	for (int i = 0; i < getNumVertices(); i++) positions[i] = getVertex(i);
+	vector<TriangleIndices> simplified(getNumTriangles());
+	for (int i = 0; i < getNumTriangles(); i++) simplified[i] = getTriangle(i);
+	MeshSimplifier simplifier(positions, simplified, bbox);
+	int prevTriangles = getNumTriangles();
+	for (int level = 1; level <= lodLevels; level++) {
+		int target = int(prevTriangles * lodRatio);
+		if (target < LOD_MIN_TRIANGLES) break;
+		double error = simplifier.simplify(target);
+		// stop if the simplifier ran out of valid collapses early:
+		if (simplifier.getNumTriangles() > prevTriangles * (1 + lodRatio) / 2) break;
+		prevTriangles = simplifier.getNumTriangles();
+		simplifier.getTriangles(simplified);
+
+		std::unique_ptr<Mesh> lod = std::make_unique<Mesh>();
+		snprintf(lod->name, sizeof(lod->name), "%.48s/lod%d", name, level);
+		lod->faceted = faceted;
+		lod->backfaceCulling = backfaceCulling;
+		lod->useKDTree = useKDTree;
+		lod->useBVH = useBVH;
+		lod->collectStats = collectStats;
+		lod->compactStorage = compactStorage;
+		lod->lazyKD = lazyKD;
+		lod->kdBuilder = kdBuilder;
+		// copy only the vertices, normals and uvs, which are still used (the sentinels at 0 map to themselves):
+		vector<int> vertexMap(getNumVertices(), -1), normalMap(getNumNormals(), -1), uvMap(getNumUVs(), -1);
+		vertexMap[0] = normalMap[0] = uvMap[0] = 0;
+		Vector sentinel(0, 0, 0);
+		lod->addVertex(sentinel);
+		lod->addNormal(sentinel);
+		lod->addUV(sentinel);
+		for (auto& t: simplified) {
+			TriangleIndices mapped;
+			for (int j = 0; j < 3; j++) {
+				if (vertexMap[t.v[j]] < 0) {
+					vertexMap[t.v[j]] = lod->getNumVertices();
+					lod->addVertex(simplifier.getPosition(t.v[j]));
+				}
+				if (normalMap[t.n[j]] < 0) {
+					normalMap[t.n[j]] = lod->getNumNormals();
+					lod->addNormal(getNormal(t.n[j]));
+				}
+				if (uvMap[t.t[j]] < 0) {
+					uvMap[t.t[j]] = lod->getNumUVs();
+					lod->addUV(getUV(t.t[j]));
+				}
+				mapped.v[j] = vertexMap[t.v[j]];
+				mapped.n[j] = normalMap[t.n[j]];
+				mapped.t[j] = uvMap[t.t[j]];
+			}
+			lod->addTriangle(mapped);
+		}
+		lod->shrinkArrays();
+		lod->prepareTriangles();
+		lod->beginRender();
+		lods.push_back(std::move(lod));
+		lodErrors.push_back(error);
+	}
+	if (lods.empty()) return;
+	printf("Mesh `%s': %d LODs built in %.2fs (", name, int(lods.size()), (SDL_GetTicks() - startBuild) / 1000.0);
+	for (int i = 0; i < int(lods.size()); i++)
+		printf("%s%d triangles, error %.4g", i ? "; " : "", lods[i]->getNumTriangles(), lodErrors[i]);
+	printf(")\n");
+}
+
+void Mesh::endRender()
 {
-	if (kdroot) delete kdroot;
-	kdroot = nullptr;
+	for (auto& lod: lods) lod->endRender();
+	if (!clusters.empty()) {
+		printf("Mesh `%s' (out-of-core): %d clusters, %.1f MB mapped", name, int(clusters.size()),
+			clusterFile.getSize() / 1048576.0);
+		long long resident = clusterFile.getResidentSize();
+		if (resident >= 0) printf(", %.1f MB of it resident", resident / 1048576.0);
+		printf("\n");
+	}
+	if (!kdLazySubtrees.empty()) {
+		int numBuilt = 0;
+		long long memoryUsed = 0;
+		unsigned buildTime = 0;
+		for (auto& subtree: kdLazySubtrees) if (subtree->ready) {
+			numBuilt++;
+			memoryUsed += subtree->nodes.size() * sizeof(KDTreeNode) + subtree->blocks.size() * sizeof(TriangleBlock4);
+			buildTime += subtree->buildTime;
+		}
+		printf("Mesh `%s' (lazy K-d tree): %d of %d subtrees built during the render (%.1f KB, %.2fs)\n", name,
+			numBuilt, int(kdLazySubtrees.size()), memoryUsed / 1024.0, buildTime / 1000.0);
+	}
+	if (!collectStats || statRays == 0) return;
+	const char* structure = !clusters.empty() ? "clustered BVH" :
+		(useBVH ? "BVH" : (useKDTree ? "K-d tree" : "no acceleration structure"));
+	printf("Mesh `%s' (%s): %lld rays, %.1f nodes visited per ray", name, structure,
+		statRays.load(), double(statNodesVisited) / statRays);
+	if (!kdNodes.empty())
+		printf(", %lld repeated triangle tests avoided (%.2f per ray)", statTestsAvoided.load(),
+			double(statTestsAvoided) / statRays);
+	printf("\n");
 }
 
-void Mesh::buildKD(KDTreeNode* node, BBox bbox, const std::vector<int>& t_list, int depth)
+void Mesh::buildBVH()
+{
+	unsigned startBuild = SDL_GetTicks();
+	std::vector<BBox> triBoxes(getNumTriangles());
+	for (int i = 0; i < getNumTriangles(); i++) {
+		triBoxes[i].makeEmpty();
+		for (int j = 0; j < 3; j++) triBoxes[i].add(getTriangleVertex(i, j));
+	}
+	bvh.build(triBoxes, 8);
+	bvhBlocks.clear();
+	bvhLeafBlocks.assign(getNumTriangles(), 0);
+	const std::vector<int>& triList = bvh.getPrimIndices();
+	bvh.forEachLeaf([&] (int first, int count) {
+		bvhLeafBlocks[first] = int(bvhBlocks.size());
+		packTriangleBlocks(&triList[first], count, bvhBlocks);
+	});
+	unsigned endBuild = SDL_GetTicks();
+	printf("BVH built in %.2fs\n", (endBuild - startBuild) / 1000.0);
+	printf("BVH statistics:\n");
+	printf("   nodes            : %d\n", bvh.getNumNodes());
+	printf("   memory           : %.1f KB\n",
+		(bvh.getMemoryUsage() + bvhBlocks.size() * sizeof(TriangleBlock4) + bvhLeafBlocks.size() * sizeof(int)) / 1024.0);
+}
+
+/**
+ * Builds the k-d tree on all threads of the global pool. The top levels are built on this thread
+ * (partitioning the big triangle lists in parallel), and the subtrees below are deferred and then
+ * built concurrently. Every node is still built by the same deterministic buildKD(), so the resulting
+ * tree is identical to the serial one.
+ */
+void Mesh::buildKDParallel(const std::vector<int>& t_list)
+{
+	int threadCount = threadPool->getThreadCount();
+	// aim for ~8 subtrees per thread, so that the uneven ones get balanced out:
+	int deferDepth = int(ceil(log2(threadCount * 8)));
+	std::vector<KDBuildTask> tasks;
+	buildKD(kdNodes, kdTriangles, 0, this->bbox, t_list, 0, kdstats, &tasks, deferDepth);
+	// the biggest subtrees go first:
+	std::vector<int> order(tasks.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(), [&tasks] (int a, int b) {
+		return tasks[a].t_list.size() > tasks[b].t_list.size();
+	});
+	std::atomic<int> cursor = 0;
+	threadPool->run([this, &tasks, &order, &cursor] (int threadIdx, int threadCount) {
+		for (int i = cursor++; i < int(order.size()); i = cursor++) {
+			KDBuildTask& task = tasks[order[i]];
+			task.nodes.emplace_back();
+			buildKD(task.nodes, task.triIndices, 0, task.bbox, task.t_list, task.depth, task.stats);
+		}
+	});
+	for (auto& task: tasks) {
+		spliceKDSubtree(task);
+		kdstats.add(task.stats);
+	}
+}
+
+/**
+ * Builds only the top KD_LAZY_DEPTH levels of the k-d tree. The nodes at that depth become placeholders for
+ * their subtrees, which getLazySubtree() builds on demand. Every subtree is built by the same buildKD(), so
+ * the complete tree is the same as with the eager build.
+ */
+void Mesh::buildKDLazy(const std::vector<int>& t_list)
 {
-	kdstats.numNodes++;
-	if (t_list.size() < 20 || depth > 64) {
-		node->initLeaf(t_list);
-		kdstats.sumTriLeaf += int(t_list.size());
-		kdstats.maxDepth = max(kdstats.maxDepth, depth);
-		kdstats.sumDepth += depth;
-		kdstats.numLeafNodes++;
+	std::vector<KDBuildTask> tasks;
+	buildKD(kdNodes, kdTriangles, 0, this->bbox, t_list, 0, kdstats, &tasks, KD_LAZY_DEPTH);
+	for (auto& task: tasks) {
+		kdNodes[task.node].initLazySubtree(int(kdLazySubtrees.size()));
+		kdLazySubtrees.push_back(std::make_unique<KDLazySubtree>());
+		kdLazySubtrees.back()->task = std::move(task);
+	}
+}
+
+/// returns the subtree, which a lazy placeholder node stands for, building it first if no ray has been
+/// there yet. This is called by the render threads concurrently: the first one to arrive builds the subtree,
+/// and any others wait for it in call_once()
+const KDLazySubtree& Mesh::getLazySubtree(const KDTreeNode& node)
+{
+	KDLazySubtree& subtree = *kdLazySubtrees[node.firstTri];
+	if (subtree.ready.load(std::memory_order_acquire)) return subtree;
+	std::call_once(subtree.buildFlag, [this, &subtree] {
+		unsigned startBuild = SDL_GetTicks();
+		KDBuildTask& task = subtree.task;
+		std::vector<int> triIndices;
+		subtree.nodes.emplace_back();
+		buildKD(subtree.nodes, triIndices, 0, task.bbox, task.t_list, task.depth, task.stats);
+		packKDLeaves(subtree.nodes, triIndices, subtree.blocks);
+		subtree.nodes.shrink_to_fit();
+		std::vector<int>().swap(task.t_list);
+		subtree.buildTime = SDL_GetTicks() - startBuild;
+		subtree.ready.store(true, std::memory_order_release);
+	});
+	return subtree;
+}
+
+/// moves a subtree, built by a KDBuildTask, into the main arrays. The subtree root replaces the
+/// placeholder node in kdNodes, and the rest of the nodes are appended (their relative order, and
+/// so the sibling adjacency, is preserved)
+void Mesh::spliceKDSubtree(const KDBuildTask& task)
+{
+	int nodeBase = int(kdNodes.size()) - 1; // local index 1 goes to kdNodes.size()
+	int triBase = int(kdTriangles.size());
+	auto relocate = [nodeBase, triBase] (KDTreeNode node) {
+		if (node.isLeaf())
+			node.initLeaf(int(node.firstTri) + triBase, node.numTriangles());
+		else
+			node.initBinaryNode(node.axis(), node.splitPos, node.leftChild() + nodeBase);
+		return node;
+	};
+	kdNodes[task.node] = relocate(task.nodes[0]);
+	for (int i = 1; i < int(task.nodes.size()); i++)
+		kdNodes.push_back(relocate(task.nodes[i]));
+	kdTriangles.insert(kdTriangles.end(), task.triIndices.begin(), task.triIndices.end());
+}
+
+/// replaces the triangle index lists of the k-d tree leaves with runs of TriangleBlock4-s in `blocks'
+void Mesh::packKDLeaves(std::vector<KDTreeNode>& nodes, std::vector<int>& triIndices, std::vector<TriangleBlock4>& blocks)
+{
+	blocks.clear();
+	for (auto& node: nodes) {
+		if (!node.isLeaf() || node.isLazySubtree()) continue;
+		int firstBlock = int(blocks.size());
+		packTriangleBlocks(triIndices.data() + node.firstTri, node.numTriangles(), blocks);
+		node.initLeaf(firstBlock, node.numTriangles());
+	}
+	blocks.shrink_to_fit();
+	std::vector<int>().swap(triIndices);
+}
+
+/**
+ * Builds the k-d (sub)tree at the given node.
+ * @param nodes      - the node array; nodes[nodeIdx] is already allocated, and the children are appended
+ * @param triIndices - the triangle lists of the leaves are appended here
+ * @param stats      - the statistics of the built nodes are accumulated here
+ * @param deferred   - if given, the nodes at depth `deferDepth' aren't built, but are appended to this
+ *                     list instead (see buildKDParallel())
+ */
+void Mesh::buildKD(std::vector<KDTreeNode>& nodes, std::vector<int>& triIndices, int nodeIdx,
+                   const BBox& bbox, const std::vector<int>& t_list, int depth,
+                   KDTreeStats& stats, std::vector<KDBuildTask>* deferred, int deferDepth)
+{
+	if (deferred && depth == deferDepth) {
+		KDBuildTask task;
+		task.node = nodeIdx;
+		task.bbox = bbox;
+		task.t_list = t_list;
+		task.depth = depth;
+		memset(&task.stats, 0, sizeof(task.stats));
+		deferred->push_back(std::move(task));
+		return;
+	}
+	stats.numNodes++;
+	Axis axis;
+	double sp;
+	bool doSplit = (kdBuilder == KD_BUILDER_SAH) ?
+		findSAHSplit(bbox, t_list, depth, axis, sp) :
+		findMidpointSplit(bbox, t_list, depth, axis, sp);
+	if (!doSplit) {
+		nodes[nodeIdx].initLeaf(int(triIndices.size()), int(t_list.size()));
+		triIndices.insert(triIndices.end(), t_list.begin(), t_list.end());
+		stats.sumTriLeaf += int(t_list.size());
+		stats.maxDepth = max(stats.maxDepth, depth);
+		stats.sumDepth += depth;
+		stats.numLeafNodes++;
+		stats.sahCost += KD_INTERSECT_COST * t_list.size() * bbox.surfaceArea();
 	} else {
-		Axis axis = Axis(depth % 3);											 // * THIS COULD BE IMPROVED!
-		double sp = bbox.vmin[axis] + (bbox.vmax[axis] - bbox.vmin[axis]) * 0.5; // * THIS COULD BE IMPROVED!
+		stats.sahCost += KD_TRAVERSAL_COST * bbox.surfaceArea();
+		// the node stores the split as a float, so build with exactly the same value the traversal will see:
+		sp = float(sp);
 		BBox L, R;
 		bbox.split(axis, sp, L, R);
 		std::vector<int> leftTris, rightTris;
-		for (auto tIdx: t_list) {
-			const Triangle& T = triangles[tIdx];
-			const Vector& a = vertices[T.v[0]];
-			const Vector& b = vertices[T.v[1]];
-			const Vector& c = vertices[T.v[2]];
-			if (L.intersectTriangle(a, b, c)) leftTris.push_back(tIdx);
-			if (R.intersectTriangle(a, b, c)) rightTris.push_back(tIdx);
+		// (while the subtrees are deferred, the pool is free, so we can use it here):
+		partitionKD(L, R, t_list, leftTris, rightTris,
+			deferred && threadPool && int(t_list.size()) >= KD_PARALLEL_PARTITION_MIN);
+		int left = int(nodes.size());
+		nodes.emplace_back();
+		nodes.emplace_back();
+		nodes[nodeIdx].initBinaryNode(axis, float(sp), left);
+		buildKD(nodes, triIndices, left, L, leftTris, depth + 1, stats, deferred, deferDepth);
+		buildKD(nodes, triIndices, left + 1, R, rightTris, depth + 1, stats, deferred, deferDepth);
+	}
+}
+
+/// sorts the triangles of a node into the lists of its children (a triangle may go into both).
+/// The parallel version splits t_list in equal chunks, one per thread, and concatenates the results,
+/// so the order of the lists is the same in both cases
+void Mesh::partitionKD(const BBox& L, const BBox& R, const std::vector<int>& t_list,
+                       std::vector<int>& leftTris, std::vector<int>& rightTris, bool parallel)
+{
+	auto partitionRange = [&] (int begin, int end, std::vector<int>& left, std::vector<int>& right) {
+		for (int i = begin; i < end; i++) {
+			int tIdx = t_list[i];
+			Vector a = getTriangleVertex(tIdx, 0);
+			Vector b = getTriangleVertex(tIdx, 1);
+			Vector c = getTriangleVertex(tIdx, 2);
+			if (L.intersectTriangle(a, b, c)) left.push_back(tIdx);
+			if (R.intersectTriangle(a, b, c)) right.push_back(tIdx);
 		}
-		node->initBinaryNode(axis, sp);
-		buildKD(&node->children[0], L, leftTris, depth + 1);
-		buildKD(&node->children[1], R, rightTris, depth + 1);
+	};
+	int n = int(t_list.size());
+	if (!parallel) {
+		partitionRange(0, n, leftTris, rightTris);
+		return;
+	}
+	int numChunks = threadPool->getThreadCount();
+	std::vector<std::vector<int>> left(numChunks), right(numChunks);
+	threadPool->run([&] (int threadIdx, int threadCount) {
+		int begin = int((long long) n * threadIdx / threadCount);
+		int end = int((long long) n * (threadIdx + 1) / threadCount);
+		partitionRange(begin, end, left[threadIdx], right[threadIdx]);
+	});
+	for (int i = 0; i < numChunks; i++) {
+		leftTris.insert(leftTris.end(), left[i].begin(), left[i].end());
+		rightTris.insert(rightTris.end(), right[i].begin(), right[i].end());
 	}
 }
 
+bool Mesh::findMidpointSplit(const BBox& bbox, const std::vector<int>& t_list, int depth, Axis& axis, double& splitPos)
+{
+	if (t_list.size() < 20 || depth > KD_MAX_DEPTH) return false;
+	axis = Axis(depth % 3);
+	splitPos = bbox.vmin[axis] + (bbox.vmax[axis] - bbox.vmin[axis]) * 0.5;
+	return true;
+}
+
+/**
+ * Finds the best split plane for a k-d tree node, according to the Surface Area Heuristic.
+ *
+ * The candidate planes are the KD_SAH_BINS - 1 bin boundaries along each axis, plus the planes
+ * which tightly cut off any empty space around the triangles. The triangle counts on each side
+ * are estimated from the triangles' bounding boxes (clipped to the node), so the whole evaluation
+ * is O(triangles + bins) per axis.
+ *
+ * @returns false if no split is cheaper than just making a leaf.
+ */
+bool Mesh::findSAHSplit(const BBox& bbox, const std::vector<int>& t_list, int depth, Axis& axis, double& splitPos)
+{
+	int n = int(t_list.size());
+	// the usual depth limit for SAH k-d trees; it stops the duplication of triangles from exploding:
+	int maxDepth = min(KD_MAX_DEPTH, int(8 + 1.3 * log2(max(1, getNumTriangles()))));
+	if (n <= 1 || depth >= maxDepth) return false;
+	double area = bbox.surfaceArea();
+	if (area <= 0) return false;
+
+	// the bounding boxes of the triangles, clipped to the node:
+	std::vector<BBox> triBoxes(n);
+	BBox geomBox;
+	geomBox.makeEmpty();
+	for (int i = 0; i < n; i++) {
+		BBox& tb = triBoxes[i];
+		tb.makeEmpty();
+		for (int j = 0; j < 3; j++) tb.add(getTriangleVertex(t_list[i], j));
+		for (int dim = 0; dim < 3; dim++) {
+			tb.vmin[dim] = max(tb.vmin[dim], bbox.vmin[dim]);
+			tb.vmax[dim] = min(tb.vmax[dim], bbox.vmax[dim]);
+		}
+		geomBox.extend(tb);
+	}
+
+	double bestCost = KD_INTERSECT_COST * n; // the cost of making a leaf
+	bool found = false;
+	auto evaluate = [&] (int dim, double pos, int nLeft, int nRight) {
+		BBox L, R;
+		bbox.split(Axis(dim), pos, L, R);
+		double cost = KD_TRAVERSAL_COST +
+			KD_INTERSECT_COST * (L.surfaceArea() * nLeft + R.surfaceArea() * nRight) / area;
+		if (nLeft == 0 || nRight == 0) cost *= 1 - KD_EMPTY_BONUS;
+		if (cost < bestCost) {
+			bestCost = cost;
+			axis = Axis(dim);
+			splitPos = pos;
+			found = true;
+		}
+	};
+
+	for (int dim = 0; dim < 3; dim++) {
+		double lo = bbox.vmin[dim], hi = bbox.vmax[dim];
+		if (hi - lo < 1e-9) continue;
+		// empty-space cutoffs (kept slightly away from the geometry, as BBox::intersectTriangle() has some tolerance).
+		// The gap is relative to the node's size, but not smaller than the absolute tolerance of BBox::inside():
+		double pad = max((hi - lo) * KD_EMPTY_PAD, 2e-6);
+		if (geomBox.vmin[dim] - lo > 10 * pad) evaluate(dim, geomBox.vmin[dim] - pad, 0, n);
+		if (hi - geomBox.vmax[dim] > 10 * pad) evaluate(dim, geomBox.vmax[dim] + pad, n, 0);
+		// binned planes; a triangle is on the left of the boundary before bin `b' if it starts in an
+		// earlier bin, and on the right if it ends in bin `b' or later:
+		int minBins[KD_SAH_BINS] = { 0 }, maxBins[KD_SAH_BINS] = { 0 };
+		double binScale = KD_SAH_BINS / (hi - lo);
+		for (auto& tb: triBoxes) {
+			minBins[std::min(KD_SAH_BINS - 1, max(0, int((tb.vmin[dim] - lo) * binScale)))]++;
+			maxBins[std::min(KD_SAH_BINS - 1, max(0, int((tb.vmax[dim] - lo) * binScale)))]++;
+		}
+		int nLeft = 0, nRight = n;
+		for (int b = 1; b < KD_SAH_BINS; b++) {
+			nLeft += minBins[b - 1];
+			nRight -= maxBins[b - 1];
+			evaluate(dim, lo + (hi - lo) * b / KD_SAH_BINS, nLeft, nRight);
+		}
+	}
+	return found;
+}
+
 void Mesh::computeBoundingGeometry()
 {
 	bbox.makeEmpty();
-	for (int i = 1; i < int(vertices.size()); i++)
-		bbox.add(vertices[i]);
+	for (int i = 1; i < getNumVertices(); i++)
+		bbox.add(getVertex(i));
 }
 
 bool intersectTriangleFast(const Ray& ray, const Vector& A, const Vector& B, const Vector& C, double& dist)
@@ -175,222 +641,1573 @@ inline double det(const Vector& a, const Vector& b, const Vector& c)
 	return (a^b) * c;
 }
 
-bool Mesh::intersectTriangle(const Ray& ray, const Triangle& t, IntersectionInfo& info)
+/// the exact (double precision) ray-triangle test: on a hit closer than `dist', updates dist and the
+/// barycentric coordinates of the hit
+static inline bool testTriangleExact(const Ray& ray, const Vector& A, const Vector& AB, const Vector& AC,
+                                     const Vector& ABcrossAC, double& dist, double& lambda2, double& lambda3)
 {
-	if (backfaceCulling && dot(ray.dir, t.gnormal) > 0) return false;
-	const Vector& A = vertices[t.v[0]];
-	const Vector& AB = t.AB;
-	const Vector& AC = t.AC;
 	Vector H = ray.start - A;
-	double Dcr = dot(t.ABcrossAC, -ray.dir);
+	double Dcr = dot(ABcrossAC, -ray.dir);
 	if (fabs(Dcr) < 1e-12) return false;
 	double rDcr = 1/Dcr;
-	double gamma = dot(t.ABcrossAC, H) * rDcr;
-	if (gamma < 0 || gamma > info.dist) return false;
-	double lambda2 = det(H, AC, -ray.dir) * rDcr;
-	if (lambda2 < 0 || lambda2 > 1) return false;
-	double lambda3 = det(AB, H, -ray.dir) * rDcr;
-	if (lambda3 < 0 || lambda3 > 1) return false;
-	double lambda1 = 1 - (lambda2 + lambda3);
+	double gamma = dot(ABcrossAC, H) * rDcr;
+	if (gamma < 0 || gamma > dist) return false;
+	double l2 = det(H, AC, -ray.dir) * rDcr;
+	if (l2 < 0 || l2 > 1) return false;
+	double l3 = det(AB, H, -ray.dir) * rDcr;
+	if (l3 < 0 || l3 > 1) return false;
+	double lambda1 = 1 - (l2 + l3);
 	if (lambda1 < 0 || lambda1 > 1) return false;
-	//
-	info.dist = gamma;
-	info.ip = ray.start + gamma * ray.dir;
+	dist = gamma;
+	lambda2 = l2;
+	lambda3 = l3;
+	return true;
+}
+
+bool Mesh::testTriangle(const Ray& ray, int triIdx, double& dist, double& lambda2, double& lambda3)
+{
+	if (!compactStorage) {
+		const Triangle& t = triangles[triIdx];
+		if (backfaceCulling && dot(ray.dir, t.gnormal) > 0) return false;
+		return testTriangleExact(ray, vertices[t.v[0]], t.AB, t.AC, t.ABcrossAC, dist, lambda2, lambda3);
+	}
+	const TriangleIndices& t = cTriangles[triIdx];
+	Vector A = cVertices[t.v[0]].toVector();
+	Vector AB = cVertices[t.v[1]].toVector() - A;
+	Vector AC = cVertices[t.v[2]].toVector() - A;
+	Vector ABcrossAC = AB ^ AC;
+	if (backfaceCulling && dot(ray.dir, ABcrossAC) > 0) return false;
+	return testTriangleExact(ray, A, AB, AC, ABcrossAC, dist, lambda2, lambda3);
+}
+
+bool Mesh::testTriangle(const Ray& ray, const MeshCluster& cluster, int triIdx, double& dist, double& lambda2, double& lambda3)
+{
+	const TriangleIndices& t = cluster.triangles[triIdx];
+	const Vector& A = cluster.vertices[t.v[0]];
+	Vector AB = cluster.vertices[t.v[1]] - A;
+	Vector AC = cluster.vertices[t.v[2]] - A;
+	Vector ABcrossAC = AB ^ AC;
+	if (backfaceCulling && dot(ray.dir, ABcrossAC) > 0) return false;
+	return testTriangleExact(ray, A, AB, AC, ABcrossAC, dist, lambda2, lambda3);
+}
+
+/// solves x * A + y * B = C, in the XY plane
+static void solve2D(Vector A, Vector B, Vector C, double& x, double& y)
+{
+	double mat[2][2] = { { A.x, B.x }, { A.y, B.y }};
+	double h[2] = { C.x, C.y };
+	double Dcr =  mat[0][0] * mat[1][1] - mat[1][0] * mat[0][1];
+	x          = (h[0]      * mat[1][1] - h[1]      * mat[0][1]) / Dcr;
+	y          = (mat[0][0] * h[1]      - mat[1][0] * h[0]     ) / Dcr;
+}
+
+/// finds the directions along the triangle, in which the texture coordinates u and v grow
+/// (used for bump mapping)
+static void computeTriangleTangents(const Vector& AB, const Vector& AC, const Vector& texAB, const Vector& texAC,
+                                    Vector& dNdx, Vector& dNdy)
+{
+	double px, py, qx, qy;
+	solve2D(texAB, texAC, Vector(1, 0, 0), px, qx);
+	solve2D(texAB, texAC, Vector(0, 1, 0), py, qy);
+	dNdx = px * AB + qx * AC;
+	dNdy = py * AB + qy * AC;
+	dNdx.normalize();
+	dNdy.normalize();
+}
+
+/// records the closest triangle hit in the IntersectionInfo; the rest is computed by computeSurface()
+void Mesh::storeTriangleHit(const TriangleHit& hit, double dist, IntersectionInfo& info)
+{
+	info.dist = dist;
+	info.geom = this;
+	info.primIdx = hit.triIdx;
+	info.primGroup = hit.cluster;
+	info.baryU = hit.lambda2;
+	info.baryV = hit.lambda3;
+}
+
+/// computes the intersection point, normal and texture coordinates of a hit, found by testTriangle()
+void Mesh::computeSurface(const Ray& ray, IntersectionInfo& info)
+{
+	int triIdx = info.primIdx;
+	const MeshCluster* cluster = info.primGroup >= 0 ? &clusters[info.primGroup] : nullptr;
+	const TriangleIndices& t = cluster ? cluster->triangles[triIdx] : getTriangle(triIdx);
+	auto vertex = [&] (int j) { return cluster ? cluster->vertices[t.v[j]] : getVertex(t.v[j]); };
+	auto normal = [&] (int j) { return cluster ? cluster->normals[t.n[j]] : getNormal(t.n[j]); };
+	auto uv = [&] (int j) { return cluster ? cluster->uvs[t.t[j]] : getUV(t.t[j]); };
+	double lambda2 = info.baryU, lambda3 = info.baryV;
+	info.ip = ray.start + info.dist * ray.dir;
 	// compute texture coords:
-	const Vector& texA = uvs[t.t[0]];
-	const Vector& texB = uvs[t.t[1]];
-	const Vector& texC = uvs[t.t[2]];
+	Vector texA = uv(0);
+	Vector texB = uv(1);
+	Vector texC = uv(2);
 	Vector texCoords = texA + (texB - texA) * lambda2 + (texC - texA) * lambda3;
 	info.u = texCoords[0];
 	info.v = texCoords[1];
+	// the compact and out-of-core storage don't keep the geometric normal and the tangents; compute them now:
+	Vector gnormal;
+	if (compactStorage || cluster) {
+		Vector A = vertex(0);
+		Vector AB = vertex(1) - A;
+		Vector AC = vertex(2) - A;
+		gnormal = AB ^ AC;
+		gnormal.normalize();
+		computeTriangleTangents(AB, AC, texB - texA, texC - texA, info.dNdx, info.dNdy);
+	} else {
+		gnormal = triangles[triIdx].gnormal;
+		info.dNdx = triangles[triIdx].dNdx;
+		info.dNdy = triangles[triIdx].dNdy;
+	}
 	// compute normals:
 	if (faceted) {
-		info.norm = t.gnormal;
+		info.norm = gnormal;
 	} else {
-		const Vector& nA = normals[t.n[0]];
-		const Vector& nB = normals[t.n[1]];
-		const Vector& nC = normals[t.n[2]];
+		Vector nA = normal(0);
+		Vector nB = normal(1);
+		Vector nC = normal(2);
 		info.norm = nA + (nB - nA) * lambda2 + (nC - nA) * lambda3;
 		info.norm.normalize();
 	}
-	info.dNdx = t.dNdx;
-	info.dNdy = t.dNdy;
-	return true;
 }
 
-bool Mesh::intersectKD(KDTreeNode* node, const BBox& bbox, const Ray& ray, IntersectionInfo& info)
+/// appends the given triangles to `blocks', four per block (the unused lanes of the last one are degenerate)
+void Mesh::packTriangleBlocks(const int* triList, int count, std::vector<TriangleBlock4>& blocks)
 {
-	if (node->axis == AXIS_NONE) {
-		bool found = false;
-		// in a leaf:
-		for (auto tIdx: *node->triangles) {
-			const Triangle& T = triangles[tIdx];
-			if (intersectTriangle(ray, T, info) && bbox.inside(info.ip)) {
+	for (int i = 0; i < count; i += 4) {
+		TriangleBlock4 block;
+		memset(&block, 0, sizeof(block));
+		for (int lane = 0; lane < 4; lane++) {
+			block.triIdx[lane] = -1;
+			if (i + lane >= count) continue;
+			int triIdx = triList[i + lane];
+			Vector A = getTriangleVertex(triIdx, 0);
+			Vector AB = getTriangleVertex(triIdx, 1) - A;
+			Vector AC = getTriangleVertex(triIdx, 2) - A;
+			for (int dim = 0; dim < 3; dim++) {
+				block.A[dim][lane] = float(A[dim]);
+				block.AB[dim][lane] = float(AB[dim]);
+				block.AC[dim][lane] = float(AC[dim]);
+			}
+			block.triIdx[lane] = triList[i + lane];
+		}
+		blocks.push_back(block);
+	}
+}
+
+// tolerances of the float test in filterTriangleBlock(), relative to the barycentric coordinates and
+// to the distance from the ray origin to the triangle. They keep it conservative:
+static const float TRI_BLOCK_EPS = 1e-3f;
+static const float TRI_BLOCK_DIST_EPS = 1e-3f;
+// ...plus the float rounding, which grows with the size of the coordinates: that of the ray origin, and
+// its distance to the triangle (a few ulps, with a safe margin):
+static const float TRI_BLOCK_FAR_EPS = 4e-6f;
+
+/**
+ * The SIMD part of the leaf intersection: a float Möller-Trumbore test of a ray against the four triangles
+ * of a block. It is only used as a filter, with some tolerance, so it never rejects a triangle that the
+ * exact test would accept (but may let through a few that it rejects).
+ * @returns a bitmask of the lanes, which are (possibly) hit before maxDist
+ */
+static int filterTriangleBlock(const TriangleBlockRay& ray, const TriangleBlock4& b, float maxDist)
+{
+#ifdef BVH_USE_SSE
+	__m128 dx = _mm_set1_ps(ray.dir[0]), dy = _mm_set1_ps(ray.dir[1]), dz = _mm_set1_ps(ray.dir[2]);
+	__m128 abx = _mm_load_ps(b.AB[0]), aby = _mm_load_ps(b.AB[1]), abz = _mm_load_ps(b.AB[2]);
+	__m128 acx = _mm_load_ps(b.AC[0]), acy = _mm_load_ps(b.AC[1]), acz = _mm_load_ps(b.AC[2]);
+	// P = dir ^ AC; det = AB * P:
+	__m128 px = _mm_sub_ps(_mm_mul_ps(dy, acz), _mm_mul_ps(dz, acy));
+	__m128 py = _mm_sub_ps(_mm_mul_ps(dz, acx), _mm_mul_ps(dx, acz));
+	__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, acy), _mm_mul_ps(dy, acx));
+	__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(abx, px), _mm_mul_ps(aby, py)), _mm_mul_ps(abz, pz));
+	// T = org - A; Q = T ^ AB:
+	__m128 tx = _mm_sub_ps(_mm_set1_ps(ray.org[0]), _mm_load_ps(b.A[0]));
+	__m128 ty = _mm_sub_ps(_mm_set1_ps(ray.org[1]), _mm_load_ps(b.A[1]));
+	__m128 tz = _mm_sub_ps(_mm_set1_ps(ray.org[2]), _mm_load_ps(b.A[2]));
+	__m128 qx = _mm_sub_ps(_mm_mul_ps(ty, abz), _mm_mul_ps(tz, aby));
+	__m128 qy = _mm_sub_ps(_mm_mul_ps(tz, abx), _mm_mul_ps(tx, abz));
+	__m128 qz = _mm_sub_ps(_mm_mul_ps(tx, aby), _mm_mul_ps(ty, abx));
+	// the barycentrics and the distance, all still multiplied by det (so there's no division):
+	__m128 u = _mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz));
+	__m128 v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz));
+	__m128 t = _mm_add_ps(_mm_add_ps(_mm_mul_ps(acx, qx), _mm_mul_ps(acy, qy)), _mm_mul_ps(acz, qz));
+	// make det positive, flipping the signs of the rest accordingly:
+	__m128 signMask = _mm_set1_ps(-0.0f);
+	__m128 detSign = _mm_and_ps(det, signMask);
+	det = _mm_xor_ps(det, detSign);
+	u = _mm_xor_ps(u, detSign);
+	v = _mm_xor_ps(v, detSign);
+	t = _mm_xor_ps(t, detSign);
+	// the rounding errors of u and v grow with |T| * |P| and |T| * |AB|, and that of t with |T| * |AB| * |AC|
+	// (|T| also standing for the rounding of org and A). These terms matter for distant and grazing rays:
+	__m128 tScale = _mm_add_ps(_mm_add_ps(_mm_andnot_ps(signMask, tx), _mm_andnot_ps(signMask, ty)), _mm_andnot_ps(signMask, tz));
+	__m128 pScale = _mm_add_ps(_mm_add_ps(_mm_andnot_ps(signMask, px), _mm_andnot_ps(signMask, py)), _mm_andnot_ps(signMask, pz));
+	__m128 abScale = _mm_add_ps(_mm_add_ps(_mm_andnot_ps(signMask, abx), _mm_andnot_ps(signMask, aby)), _mm_andnot_ps(signMask, abz));
+	__m128 acScale = _mm_add_ps(_mm_add_ps(_mm_andnot_ps(signMask, acx), _mm_andnot_ps(signMask, acy)), _mm_andnot_ps(signMask, acz));
+	__m128 farTol = _mm_mul_ps(_mm_add_ps(tScale, _mm_set1_ps(ray.orgScale)), _mm_set1_ps(TRI_BLOCK_FAR_EPS));
+	__m128 tol = _mm_add_ps(_mm_mul_ps(det, _mm_set1_ps(TRI_BLOCK_EPS)), _mm_mul_ps(farTol, _mm_add_ps(pScale, abScale)));
+	__m128 tTol = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(tScale, _mm_set1_ps(TRI_BLOCK_DIST_EPS)), det),
+	                         _mm_mul_ps(farTol, _mm_mul_ps(abScale, acScale)));
+	__m128 mask = _mm_cmpgt_ps(det, _mm_setzero_ps()); // (also rules out the unused lanes)
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(u, _mm_sub_ps(_mm_setzero_ps(), tol)));
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(v, _mm_sub_ps(_mm_setzero_ps(), tol)));
+	mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), _mm_add_ps(det, tol)));
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(t, _mm_sub_ps(_mm_setzero_ps(), tTol)));
+	mask = _mm_and_ps(mask, _mm_cmple_ps(t, _mm_add_ps(_mm_mul_ps(det, _mm_set1_ps(maxDist)), tTol)));
+	return _mm_movemask_ps(mask);
+#else
+	int mask = 0;
+	for (int i = 0; i < 4; i++) {
+		float px = ray.dir[1] * b.AC[2][i] - ray.dir[2] * b.AC[1][i];
+		float py = ray.dir[2] * b.AC[0][i] - ray.dir[0] * b.AC[2][i];
+		float pz = ray.dir[0] * b.AC[1][i] - ray.dir[1] * b.AC[0][i];
+		float det = b.AB[0][i] * px + b.AB[1][i] * py + b.AB[2][i] * pz;
+		float tx = ray.org[0] - b.A[0][i], ty = ray.org[1] - b.A[1][i], tz = ray.org[2] - b.A[2][i];
+		float qx = ty * b.AB[2][i] - tz * b.AB[1][i];
+		float qy = tz * b.AB[0][i] - tx * b.AB[2][i];
+		float qz = tx * b.AB[1][i] - ty * b.AB[0][i];
+		float u = tx * px + ty * py + tz * pz;
+		float v = ray.dir[0] * qx + ray.dir[1] * qy + ray.dir[2] * qz;
+		float t = b.AC[0][i] * qx + b.AC[1][i] * qy + b.AC[2][i] * qz;
+		if (det < 0) {
+			det = -det;
+			u = -u;
+			v = -v;
+			t = -t;
+		}
+		float tScale = fabsf(tx) + fabsf(ty) + fabsf(tz);
+		float pScale = fabsf(px) + fabsf(py) + fabsf(pz);
+		float abScale = fabsf(b.AB[0][i]) + fabsf(b.AB[1][i]) + fabsf(b.AB[2][i]);
+		float acScale = fabsf(b.AC[0][i]) + fabsf(b.AC[1][i]) + fabsf(b.AC[2][i]);
+		float farTol = (tScale + ray.orgScale) * TRI_BLOCK_FAR_EPS;
+		float tol = det * TRI_BLOCK_EPS + farTol * (pScale + abScale);
+		float tTol = tScale * TRI_BLOCK_DIST_EPS * det + farTol * abScale * acScale;
+		if (det > 0 && u >= -tol && v >= -tol && u + v <= det + tol && t >= -tTol && t <= det * maxDist + tTol)
+			mask |= 1 << i;
+	}
+	return mask;
+#endif
+}
+
+/**
+ * Intersects a ray with `count' triangles, packed in consecutive blocks. The SIMD filter picks the candidate
+ * lanes, and only these get the exact test. Lanes are checked in order, so the result is the same as
+ * testing the triangles one by one.
+ * @param mailbox - if given, the triangles which this ray has already tested are skipped
+ * @param anyHit  - return on the first hit closer than `dist', instead of looking for the closest one
+ * @param cluster - for out-of-core meshes, the cluster where the blocks are (their triIdx-s are local to it)
+ * @returns true if a hit closer than `dist' was found (dist and hit are updated then)
+ */
+bool Mesh::intersectTriangleBlocks(const Ray& ray, const TriangleBlockRay& blockRay, const TriangleBlock4* blocks,
+                                   int count, double& dist, TriangleHit& hit, TriangleMailbox* mailbox, bool anyHit,
+                                   int cluster)
+{
+	bool found = false;
+	for (int i = 0; i < count; i += 4) {
+		const TriangleBlock4& block = blocks[i / 4];
+		int mask = filterTriangleBlock(blockRay, block, float(min(dist, 1e20)));
+		for (int lane = 0; mask; lane++, mask >>= 1) {
+			if (!(mask & 1)) continue;
+			int triIdx = block.triIdx[lane];
+			if (mailbox && mailbox->checkAndMark(triIdx)) continue;
+			if (hit.allHits) {
+				// (without shortening the ray, or reporting the hit, so that the traversal doesn't stop early)
+				collectTriangleHit(ray, cluster, triIdx, dist, *hit.allHits);
+				continue;
+			}
+			bool triangleHit = cluster >= 0 ?
+				testTriangle(ray, clusters[cluster], triIdx, dist, hit.lambda2, hit.lambda3) :
+				testTriangle(ray, triIdx, dist, hit.lambda2, hit.lambda3);
+			if (triangleHit) {
+				hit.triIdx = triIdx;
+				hit.cluster = cluster;
+				if (anyHit) return true;
 				found = true;
 			}
 		}
+	}
+	return found;
+}
+
+/// adds the hit of the ray with a triangle (if any, before maxDist) to a list (see TriangleHit::allHits)
+void Mesh::collectTriangleHit(const Ray& ray, int cluster, int triIdx, double maxDist, HitList& hits)
+{
+	TriangleHit hit;
+	bool triangleHit = cluster >= 0 ?
+		testTriangle(ray, clusters[cluster], triIdx, maxDist, hit.lambda2, hit.lambda3) :
+		testTriangle(ray, triIdx, maxDist, hit.lambda2, hit.lambda3);
+	if (!triangleHit) return;
+	hit.triIdx = triIdx;
+	hit.cluster = cluster;
+	IntersectionInfo info;
+	storeTriangleHit(hit, maxDist, info);
+	hits.add(info);
+}
+
+/**
+ * Walks the k-d tree along the ray, front to back, without recursion.
+ *
+ * Instead of splitting boxes, the traversal keeps the [tmin, tmax] interval of the ray inside the current
+ * node. At an inner node, the distance to the split plane decides whether the ray visits only the near
+ * child, only the far one, or both (in which case the far child is pushed on the stack with its part
+ * of the interval). As the nodes are visited in order, we can stop as soon as the closest hit found
+ * so far lies before the interval of the next node (or, with anyHit, as soon as there's any hit).
+ */
+bool Mesh::intersectKD(const Ray& ray, double& dist, TriangleHit& hit, int& nodesVisited,
+                       TriangleMailbox& mailbox, bool anyHit)
+{
+	Vector invDir = inverseDirection(ray.dir);
+	double tmin = 0, tmax = dist;
+	if (!bbox.clipRay(ray, invDir, tmin, tmax)) return false;
+	return traverseKD(ray, invDir, kdNodes.data(), kdBlocks.data(), 0, tmin, tmax, dist, hit, nodesVisited, mailbox, anyHit);
+}
+
+/// the traversal behind intersectKD(), of the subtree at nodes[root], which the ray crosses in [tmin, tmax].
+/// The traversal switches to the arrays of the lazy subtrees (see lazyKD) as it enters them
+bool Mesh::traverseKD(const Ray& ray, const Vector& invDir, const KDTreeNode* nodes, const TriangleBlock4* blocks,
+                      int root, double tmin, double tmax, double& dist, TriangleHit& hit, int& nodesVisited,
+                      TriangleMailbox& mailbox, bool anyHit)
+{
+	struct StackEntry {
+		const KDTreeNode* nodes;
+		const TriangleBlock4* blocks;
+		int node;
+		double tmin, tmax;
+	} stack[KD_MAX_DEPTH + 2];
+	int sp = 0;
+	int current = root;
+	bool found = false;
+	TriangleBlockRay blockRay(ray);
+	while (true) {
+		const KDTreeNode& node = nodes[current];
+		nodesVisited++;
+		if (!node.isLeaf()) {
+			Axis axis = node.axis();
+			double splitPos = node.splitPos;
+			double tSplit = (splitPos - ray.start[axis]) * invDir[axis];
+			int nearChild = node.leftChild(), farChild = nearChild + 1;
+			if (ray.start[axis] > splitPos || (ray.start[axis] == splitPos && ray.dir[axis] > 0))
+				std::swap(nearChild, farChild);
+			if (tSplit > tmax || tSplit <= 0) {
+				current = nearChild;
+			} else if (tSplit < tmin) {
+				current = farChild;
+			} else {
+				stack[sp++] = { nodes, blocks, farChild, tSplit, tmax };
+				current = nearChild;
+				tmax = tSplit;
+			}
+			continue;
+		}
+		if (node.isLazySubtree()) {
+			// continue in the subtree's own arrays, with the same interval:
+			const KDLazySubtree& subtree = getLazySubtree(node);
+			nodes = subtree.nodes.data();
+			blocks = subtree.blocks.data();
+			current = 0;
+			continue;
+		}
+		// in a leaf:
+		if (intersectTriangleBlocks(ray, blockRay, &blocks[node.firstTri], node.numTriangles(), dist, hit, &mailbox, anyHit)) {
+			if (anyHit) return true;
+			found = true;
+		}
+		// a hit inside this node can't be beaten by the nodes further along the ray:
+		if (found && dist <= tmax) return true;
+		if (sp == 0) return found;
+		--sp;
+		nodes = stack[sp].nodes;
+		blocks = stack[sp].blocks;
+		current = stack[sp].node;
+		tmin = stack[sp].tmin;
+		tmax = stack[sp].tmax;
+		if (found && dist < tmin) return true;
+	}
+}
+
+/**
+ * The packet version of intersectKD(): the rays walk the tree together, each with its own [tmin, tmax]
+ * interval, and a node is visited if it's in the interval of any of the rays. This needs the rays to
+ * agree on the direction signs, so that they all see the children of a node in the same order; if they
+ * don't, or when a subtree is only reached by a single ray, it falls back to the single-ray traversal.
+ * @returns the mask of the rays, which found a hit (dist[] and hits[] are updated for them)
+ */
+int Mesh::intersectKDPacket(const RayPacket& packet, double dist[], TriangleHit hits[], int& nodesVisited,
+                            TriangleMailbox mailboxes[], bool anyHit)
+{
+	const int N = RayPacket::SIZE;
+	double tmin[N], tmax[N];
+	Vector invDir[N];
+	TriangleBlockRay blockRays[N];
+	int activeMask = 0; // the rays, which may still find a (closer) hit
+	for (int i = 0; i < N; i++) if (packet.activeMask & (1 << i)) {
+		invDir[i] = inverseDirection(packet.rays[i].dir);
+		blockRays[i] = TriangleBlockRay(packet.rays[i]);
+		tmin[i] = 0;
+		tmax[i] = dist[i];
+		if (bbox.clipRay(packet.rays[i], invDir[i], tmin[i], tmax[i])) activeMask |= 1 << i;
+	}
+	int found = 0;
+	auto singleRay = [&] (int i, const KDTreeNode* nodes, const TriangleBlock4* blocks, int root) {
+		if (traverseKD(packet.rays[i], invDir[i], nodes, blocks, root, tmin[i], tmax[i], dist[i], hits[i], nodesVisited,
+		               mailboxes[i], anyHit))
+			found |= 1 << i;
+	};
+	int first = 0;
+	while (first < N && !(activeMask & (1 << first))) first++;
+	bool coherent = true;
+	for (int i = first + 1; i < N; i++) if (activeMask & (1 << i))
+		for (int dim = 0; dim < 3; dim++)
+			if ((invDir[i][dim] > 0) != (invDir[first][dim] > 0)) coherent = false;
+	if (!coherent || (activeMask & (activeMask - 1)) == 0) {
+		for (int i = 0; i < N; i++) if (activeMask & (1 << i)) singleRay(i, kdNodes.data(), kdBlocks.data(), 0);
 		return found;
+	}
+	struct StackEntry {
+		const KDTreeNode* nodes;
+		const TriangleBlock4* blocks;
+		int node;
+		double tmin[N], tmax[N];
+	} stack[KD_MAX_DEPTH + 2];
+	int sp = 0;
+	const KDTreeNode* nodes = kdNodes.data();
+	const TriangleBlock4* blocks = kdBlocks.data();
+	int current = 0;
+	while (activeMask) {
+		// the rays, which pass through this node:
+		int nodeMask = 0;
+		for (int i = 0; i < N; i++)
+			if ((activeMask & (1 << i)) && tmin[i] <= tmax[i]) nodeMask |= 1 << i;
+		const KDTreeNode& node = nodes[current];
+		if (nodeMask && (nodeMask & (nodeMask - 1)) == 0) {
+			// the packet has diverged; finish this subtree with the single ray:
+			int i = 0;
+			while (!(nodeMask & (1 << i))) i++;
+			singleRay(i, nodes, blocks, current);
+			if ((found & (1 << i)) && (anyHit || dist[i] <= tmax[i])) activeMask &= ~(1 << i);
+		} else if (nodeMask && !node.isLeaf()) {
+			nodesVisited++;
+			Axis axis = node.axis();
+			double splitPos = node.splitPos;
+			int nearChild = node.leftChild(), farChild = nearChild + 1;
+			if (invDir[first][axis] < 0) std::swap(nearChild, farChild);
+			double tSplit[N] = {};
+			bool needNear = false, needFar = false;
+			for (int i = 0; i < N; i++) if (nodeMask & (1 << i)) {
+				tSplit[i] = (splitPos - packet.rays[i].start[axis]) * invDir[i][axis];
+				if (tSplit[i] >= tmin[i]) needNear = true;
+				if (tSplit[i] <= tmax[i]) needFar = true;
+			}
+			if (needNear && needFar) {
+				StackEntry& e = stack[sp++];
+				e.nodes = nodes;
+				e.blocks = blocks;
+				e.node = farChild;
+				for (int i = 0; i < N; i++) {
+					bool inNode = nodeMask & (1 << i);
+					e.tmin[i] = inNode ? std::max(tmin[i], tSplit[i]) : 1;
+					e.tmax[i] = inNode ? tmax[i] : 0;
+					if (inNode) tmax[i] = std::min(tmax[i], tSplit[i]);
+				}
+			}
+			current = needNear ? nearChild : farChild;
+			continue;
+		} else if (nodeMask && node.isLazySubtree()) {
+			// continue in the subtree's own arrays (see traverseKD()):
+			nodesVisited++;
+			const KDLazySubtree& subtree = getLazySubtree(node);
+			nodes = subtree.nodes.data();
+			blocks = subtree.blocks.data();
+			current = 0;
+			continue;
+		} else if (nodeMask) {
+			nodesVisited++;
+			for (int i = 0; i < N; i++) if (nodeMask & (1 << i)) {
+				if (intersectTriangleBlocks(packet.rays[i], blockRays[i], &blocks[node.firstTri], node.numTriangles(),
+				                            dist[i], hits[i], &mailboxes[i], anyHit))
+					found |= 1 << i;
+				// a hit inside this node can't be beaten by the nodes further along the ray:
+				if ((found & (1 << i)) && (anyHit || dist[i] <= tmax[i])) activeMask &= ~(1 << i);
+			}
+		}
+		if (sp == 0) break;
+		--sp;
+		nodes = stack[sp].nodes;
+		blocks = stack[sp].blocks;
+		current = stack[sp].node;
+		for (int i = 0; i < N; i++) {
+			tmin[i] = stack[sp].tmin[i];
+			tmax[i] = stack[sp].tmax[i];
+			// (the rays, which don't enter that node, have an empty interval there, whose tmin means nothing):
+			if ((found & (1 << i)) && tmin[i] <= tmax[i] && dist[i] < tmin[i]) activeMask &= ~(1 << i);
+		}
+	}
+	return found;
+}
+
+bool Mesh::intersectBVH(const Ray& ray, double& dist, TriangleHit& hit, int& nodesVisited, bool anyHit)
+{
+	bool found = false;
+	TriangleBlockRay blockRay(ray);
+	nodesVisited = bvh.traverseLeaves(ray, dist, [&] (int first, int count, double& maxDist) {
+		if (intersectTriangleBlocks(ray, blockRay, &bvhBlocks[bvhLeafBlocks[first]], count, maxDist, hit, nullptr, anyHit))
+			found = true;
+		return found && anyHit;
+	});
+	return found;
+}
+
+/**
+ * The out-of-core traversal: walks the top-level BVH over the clusters, nearest first, and the BVH
+ * of each cluster, whose box the ray enters before the closest hit so far. Only the nodes and
+ * triangles of the latter are touched, so only their pages need to be loaded.
+ */
+bool Mesh::intersectClusters(const Ray& ray, double& dist, TriangleHit& hit, int& nodesVisited, bool anyHit)
+{
+	bool found = false;
+	int clusterNodesVisited = 0;
+	TriangleBlockRay blockRay(ray);
+	nodesVisited = clusterBVH.traverse(ray, dist, [&] (int clusterIdx, double& maxDist) {
+		const MeshCluster& cluster = clusters[clusterIdx];
+		clusterNodesVisited += BVH::traverseNodes(cluster.nodes, ray, maxDist, [&] (int firstBlock, int count, double& maxDist) {
+			if (intersectTriangleBlocks(ray, blockRay, cluster.blocks + firstBlock, count, maxDist, hit, nullptr, anyHit, clusterIdx))
+				found = true;
+			return found && anyHit;
+		});
+		return found && anyHit;
+	});
+	nodesVisited += clusterNodesVisited;
+	return found;
+}
+
+/// finds the closest hit before `dist' (or any such hit, if anyHit is set), without computing its attributes
+bool Mesh::findHit(const Ray& ray, double& dist, TriangleHit& hit, bool anyHit)
+{
+	bool found = false;
+	int nodesVisited = 0;
+	TriangleMailbox mailbox;
+	if (!clusters.empty()) {
+		found = intersectClusters(ray, dist, hit, nodesVisited, anyHit);
+	} else if (!bvh.empty()) {
+		found = intersectBVH(ray, dist, hit, nodesVisited, anyHit);
+	} else if (!kdNodes.empty()) {
+		found = intersectKD(ray, dist, hit, nodesVisited, mailbox, anyHit); // (clips the ray against the bbox itself)
 	} else {
-		BBox childBB[2];
-		bbox.split(node->axis, node->splitPos, childBB[0], childBB[1]);
-		int childOrder[2] = { 0, 1 };
-		if (ray.start[node->axis] > node->splitPos) std::swap(childOrder[0], childOrder[1]);
-		for (int i = 0; i < 2; i++) {
-			if (childBB[childOrder[i]].testIntersect(ray))
-				if (intersectKD(&node->children[childOrder[i]], childBB[childOrder[i]], ray, info))
-					return true;
+		if (!bbox.testIntersect(ray)) return false;
+		for (int i = 0; i < getNumTriangles(); i++) {
+			if (hit.allHits) {
+				collectTriangleHit(ray, -1, i, dist, *hit.allHits);
+				continue;
+			}
+			if (testTriangle(ray, i, dist, hit.lambda2, hit.lambda3)) {
+				hit.triIdx = i;
+				found = true;
+				if (anyHit) break;
+			}
 		}
-		return false;
 	}
+	if (collectStats) {
+		statRays++;
+		statNodesVisited += nodesVisited;
+		statTestsAvoided += mailbox.testsAvoided;
+	}
+	return found;
 }
 
 bool Mesh::intersect(const Ray& ray, IntersectionInfo& info)
 {
-	if (!bbox.testIntersect(ray)) return false;
-	info.dist = INF;
-	if (kdroot) {
-		return intersectKD(kdroot, bbox, ray, info);
-	} else {
-		for (Triangle& T: triangles) {
-			intersectTriangle(ray, T,info);
+	double dist = INF;
+	TriangleHit hit;
+	if (!findHit(ray, dist, hit, false)) return false;
+	// the normal, texture coordinates, etc. are left for computeSurface():
+	storeTriangleHit(hit, dist, info);
+	return true;
+}
+
+void Mesh::intersectAll(const Ray& ray, HitList& hits)
+{
+	// the usual traversal, but the triangle tests collect all the hits (see TriangleHit::allHits):
+	double dist = INF;
+	TriangleHit hit;
+	hit.allHits = &hits;
+	findHit(ray, dist, hit, false);
+	// the k-d tree's mailbox only remembers the last few triangles, so a triangle in several leaves may
+	// still be hit more than once. The repeated hits have the exact same distance, so they end up together:
+	hits.sort();
+	int count = 0;
+	for (int i = 0; i < hits.count; i++) {
+		const IntersectionInfo& info = hits.hits[i];
+		bool repeated = false;
+		for (int j = count - 1; j >= 0 && hits.hits[j].dist == info.dist && !repeated; j--)
+			repeated = (hits.hits[j].geom == info.geom && hits.hits[j].primIdx == info.primIdx
+			            && hits.hits[j].primGroup == info.primGroup);
+		if (!repeated) hits.hits[count++] = info;
+	}
+	hits.count = count;
+}
+
+bool Mesh::occluded(const Ray& ray, double maxDist)
+{
+	double dist = maxDist;
+	TriangleHit hit;
+	return findHit(ray, dist, hit, true);
+}
+
+/// the packet version of findHit(). Only the k-d tree has a packet traversal; otherwise the rays are traced one by one
+int Mesh::findHitPacket(const RayPacket& packet, double dist[], TriangleHit hits[], bool anyHit)
+{
+	int found = 0;
+	if (kdNodes.empty()) {
+		for (int i = 0; i < RayPacket::SIZE; i++)
+			if ((packet.activeMask & (1 << i)) && findHit(packet.rays[i], dist[i], hits[i], anyHit)) found |= 1 << i;
+		return found;
+	}
+	int nodesVisited = 0;
+	TriangleMailbox mailboxes[RayPacket::SIZE];
+	found = intersectKDPacket(packet, dist, hits, nodesVisited, mailboxes, anyHit);
+	if (collectStats) {
+		for (int i = 0; i < RayPacket::SIZE; i++) if (packet.activeMask & (1 << i)) {
+			statRays++;
+			statTestsAvoided += mailboxes[i].testsAvoided;
 		}
-		if (info.dist < INF) {
-			info.geom = this;
-			return true;
+		statNodesVisited += nodesVisited;
+	}
+	return found;
+}
+
+int Mesh::intersectPacket(const RayPacket& packet, IntersectionInfo infos[])
+{
+	double dist[RayPacket::SIZE];
+	TriangleHit hits[RayPacket::SIZE];
+	for (int i = 0; i < RayPacket::SIZE; i++) dist[i] = packet.maxDist[i];
+	int hitMask = findHitPacket(packet, dist, hits, false);
+	for (int i = 0; i < RayPacket::SIZE; i++) if (hitMask & (1 << i)) {
+		if (dist[i] >= packet.maxDist[i]) {
+			hitMask &= ~(1 << i);
+			continue;
 		}
-		return false;
+		storeTriangleHit(hits[i], dist[i], infos[i]);
 	}
+	return hitMask;
 }
 
-static int toInt(const string& s)
+int Mesh::occludedPacket(const RayPacket& packet)
 {
-	if (s.empty()) return 0;
-	int x;
-	if (1 == sscanf(s.c_str(), "%d", &x)) return x;
-	return 0;
+	double dist[RayPacket::SIZE];
+	TriangleHit hits[RayPacket::SIZE];
+	for (int i = 0; i < RayPacket::SIZE; i++) dist[i] = packet.maxDist[i];
+	return findHitPacket(packet, dist, hits, true);
 }
 
-static double toDouble(const string& s)
+static const int OBJ_CHUNK_SIZE = 1 << 20; //!< the .obj files are parsed in parallel, in chunks of about that many bytes
+
+/// a part of an .obj file. The parts are first counted, and then parsed in parallel, straight into the mesh arrays
+struct OBJChunk {
+	const char* begin;
+	const char* end;
+	int numVertices = 0, numNormals = 0, numUVs = 0, numTriangles = 0;
+	int firstVertex, firstNormal, firstUV, firstTriangle; //!< where the chunk goes in the mesh arrays
+};
+
+/// the lines of an .obj file, which we use
+enum OBJLineType {
+	OBJ_OTHER,
+	OBJ_VERTEX,
+	OBJ_NORMAL,
+	OBJ_UV,
+	OBJ_FACE,
+};
+
+static inline bool isOBJSpace(char c)
 {
-	if (s.empty()) return 0;
-	double x;
-	if (1 == sscanf(s.c_str(), "%lf", &x)) return x;
-	return 0;
+	return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
 }
 
-static void parseTrio(string s, int& vertex, int& uv, int& normal)
+/// finds the type of the line [p, eol). @returns the pointer after its keyword
+static const char* parseOBJKeyword(const char* p, const char* eol, OBJLineType& type)
 {
-	vector<string> items = split(s, '/');
-	// "4" -> {"4"} , "4//5" -> {"4", "", "5" }
+	while (p < eol && isOBJSpace(*p)) p++;
+	const char* keyword = p;
+	while (p < eol && !isOBJSpace(*p)) p++;
+	int keywordLength = int(p - keyword);
+	type = OBJ_OTHER;
+	if (keywordLength == 1 && keyword[0] == 'v') type = OBJ_VERTEX;
+	if (keywordLength == 1 && keyword[0] == 'f') type = OBJ_FACE;
+	if (keywordLength == 2 && keyword[0] == 'v' && keyword[1] == 'n') type = OBJ_NORMAL;
+	if (keywordLength == 2 && keyword[0] == 'v' && keyword[1] == 't') type = OBJ_UV;
+	return p;
+}
 
-	vertex = toInt(items[0]);
-	uv = items.size() >= 2 ? toInt(items[1]) : 0;
-	normal = items.size() >= 3 ? toInt(items[2]) : 0;
+/// finds the next space-delimited token at p (a face corner). @returns its start, or eol if there are no more
+static inline const char* findOBJToken(const char* p, const char* eol, const char*& tokenEnd)
+{
+	while (p < eol && isOBJSpace(*p)) p++;
+	tokenEnd = p;
+	while (tokenEnd < eol && !isOBJSpace(*tokenEnd)) tokenEnd++;
+	return p;
 }
 
-static Triangle parseTriangle(string s0, string s1, string s2)
+/// parses a number at p (skipping any spaces before it), without allocations. An invalid number gives 0
+/// (as sscanf() would), and its characters are skipped.
+/// @returns the pointer after the number
+template <typename T>
+static const char* parseOBJNumber(const char* p, const char* end, T& x)
 {
-	// "3", "3/4", "3//5", "3/4/5"  (v/uv/normal)
-	Triangle T;
-	parseTrio(s0, T.v[0], T.t[0], T.n[0]);
-	parseTrio(s1, T.v[1], T.t[1], T.n[1]);
-	parseTrio(s2, T.v[2], T.t[2], T.n[2]);
-	return T;
+	while (p < end && isOBJSpace(*p)) p++;
+	if (p < end && *p == '+') p++; // (from_chars doesn't accept a leading plus)
+	std::from_chars_result result = std::from_chars(p, end, x);
+	if (result.ec == std::errc()) return result.ptr;
+	x = 0;
+	while (p < end && !isOBJSpace(*p) && *p != '/') p++;
+	return p;
 }
 
-bool Mesh::loadFromOBJ(const char* filename)
+/// parses a face corner token, like "3", "3/4", "3//5" or "3/4/5" (vertex/uv/normal). The missing indices are 0
+static void parseOBJCorner(const char* p, const char* end, int& vertex, int& uv, int& normal)
+{
+	uv = normal = 0;
+	p = parseOBJNumber(p, end, vertex);
+	if (p < end && *p == '/') {
+		p++;
+		if (p < end && *p != '/') p = parseOBJNumber(p, end, uv);
+		if (p < end && *p == '/') parseOBJNumber(p + 1, end, normal);
+	}
+}
+
+static inline const char* findOBJLineEnd(const char* line, const char* end)
 {
-	FILE* f = fopen(filename, "rt");
+	const char* eol = (const char*) memchr(line, '\n', end - line);
+	return eol ? eol : end;
+}
 
-	if (!f) return false;
+/// counts the vertices, normals, uvs and triangles of a chunk, without parsing any numbers
+static void countOBJChunk(OBJChunk& chunk)
+{
+	for (const char* line = chunk.begin; line < chunk.end; ) {
+		const char* eol = findOBJLineEnd(line, chunk.end);
+		OBJLineType type;
+		const char* p = parseOBJKeyword(line, eol, type);
+		line = eol + 1;
+		switch (type) {
+			case OBJ_VERTEX: chunk.numVertices++; break;
+			case OBJ_NORMAL: chunk.numNormals++; break;
+			case OBJ_UV: chunk.numUVs++; break;
+			case OBJ_FACE:
+			{
+				int corners = 0;
+				const char* tokenEnd;
+				for (; (p = findOBJToken(p, eol, tokenEnd)) < eol; p = tokenEnd) corners++;
+				chunk.numTriangles += std::max(0, corners - 2);
+				break;
+			}
+			default: break;
+		}
+	}
+}
 
+/// parses a chunk; calls onVector(type, v) for each vertex, normal and uv, and onTriangle(t) for each triangle.
+/// It gives exactly the counts of countOBJChunk() (the faces are split into triangle fans)
+template <typename VectorCallback, typename TriangleCallback>
+static void parseOBJChunk(const OBJChunk& chunk, VectorCallback onVector, TriangleCallback onTriangle)
+{
+	for (const char* line = chunk.begin; line < chunk.end; ) {
+		const char* eol = findOBJLineEnd(line, chunk.end);
+		OBJLineType type;
+		const char* p = parseOBJKeyword(line, eol, type);
+		line = eol + 1;
+		if (type == OBJ_VERTEX || type == OBJ_NORMAL) {
+			Vector v;
+			for (int i = 0; i < 3; i++) p = parseOBJNumber(p, eol, v[i]);
+			onVector(type, v);
+		} else if (type == OBJ_UV) {
+			Vector uv(0, 0, 0);
+			for (int i = 0; i < 2; i++) p = parseOBJNumber(p, eol, uv[i]);
+			onVector(type, uv);
+		} else if (type == OBJ_FACE) {
+			// the triangle fan: the first corner goes into .v[0], .t[0], .n[0], the last one - into [2]:
+			TriangleIndices T;
+			int corners = 0;
+			const char* tokenEnd;
+			for (; (p = findOBJToken(p, eol, tokenEnd)) < eol; p = tokenEnd, corners++) {
+				int k = std::min(corners, 2);
+				if (corners > 2) {
+					T.v[1] = T.v[2];
+					T.t[1] = T.t[2];
+					T.n[1] = T.n[2];
+				}
+				parseOBJCorner(p, tokenEnd, T.v[k], T.t[k], T.n[k]);
+				if (corners >= 2) onTriangle(T);
+			}
+		}
+	}
+}
+
+/**
+ * Loads a Wavefront .obj file. The file is memory-mapped and split into chunks at line boundaries. The chunks
+ * are counted in parallel, so that the mesh arrays can be sized, and then parsed in parallel, each one directly
+ * into its place in the arrays; the result is the same as parsing the file front to back, and nothing but the
+ * arrays themselves is allocated.
+ */
+bool Mesh::loadFromOBJ(const char* filename)
+{
+	MappedFile file;
+	if (!file.open(filename)) return false;
+	const char* data = file.getData();
+	size_t size = file.getSize();
+	int numChunks = int(std::max<size_t>(1, size / OBJ_CHUNK_SIZE));
+	vector<OBJChunk> chunks(numChunks);
+	for (int i = 0; i < numChunks; i++) {
+		chunks[i].begin = (i == 0) ? data : chunks[i - 1].end;
+		const char* end = data + size * (i + 1) / numChunks;
+		const char* eol = (i + 1 < numChunks) ? (const char*) memchr(end, '\n', data + size - end) : nullptr;
+		chunks[i].end = eol ? eol + 1 : data + size;
+		chunks[i].end = std::max(chunks[i].begin, chunks[i].end);
+	}
+	parallelFor(numChunks, 2, [&chunks] (int begin, int end) {
+		for (int i = begin; i < end; i++) countOBJChunk(chunks[i]);
+	});
+	// place the chunks after the sentinels:
+	int numVertices = 1, numNormals = 1, numUVs = 1, numTriangles = 0;
+	for (OBJChunk& chunk: chunks) {
+		chunk.firstVertex = numVertices;
+		chunk.firstNormal = numNormals;
+		chunk.firstUV = numUVs;
+		chunk.firstTriangle = numTriangles;
+		numVertices += chunk.numVertices;
+		numNormals += chunk.numNormals;
+		numUVs += chunk.numUVs;
+		numTriangles += chunk.numTriangles;
+	}
+	resizeArrays(numVertices, numNormals, numUVs, numTriangles);
 	Vector sentinel(0, 0, 0);
-	vertices = {sentinel};
-	normals = {sentinel};
-	uvs = {sentinel};
-
-	char line[10000];
-	while (fgets(line, sizeof(line), f)) {
-		if (line[0] == '#') continue;
-		//
-		std::vector<std::string> tokens = tokenize(line);
-		if (tokens.empty()) continue;
-		//
-		if (tokens[0] == "v") {
-			vertices.push_back(Vector(
-				toDouble(tokens[1]),
-				toDouble(tokens[2]),
-				toDouble(tokens[3])
-			));
-			continue;
+	storeVertex(0, sentinel);
+	storeNormal(0, sentinel);
+	storeUV(0, sentinel);
+	parallelFor(numChunks, 2, [&] (int begin, int end) {
+		for (int i = begin; i < end; i++) {
+			const OBJChunk& chunk = chunks[i];
+			int vertex = chunk.firstVertex, normal = chunk.firstNormal, uv = chunk.firstUV, triangle = chunk.firstTriangle;
+			parseOBJChunk(chunk,
+				[&] (OBJLineType type, const Vector& v) {
+					if (type == OBJ_VERTEX) storeVertex(vertex++, v);
+					else if (type == OBJ_NORMAL) storeNormal(normal++, v);
+					else storeUV(uv++, v);
+				},
+				[&] (const TriangleIndices& t) { storeTriangle(triangle++, t); });
 		}
-		//
-		if (tokens[0] == "vn") {
-			normals.push_back(Vector(
-				toDouble(tokens[1]),
-				toDouble(tokens[2]),
-				toDouble(tokens[3])
-			));
+	});
+	file.close();
+	prepareTriangles();
+	return true;
+}
+
+/// the scalar types of the PLY format
+enum PLYType {
+	PLY_NONE,
+	PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16, PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64,
+};
+
+static PLYType parsePLYType(const string& s)
+{
+	if (s == "char" || s == "int8") return PLY_INT8;
+	if (s == "uchar" || s == "uint8") return PLY_UINT8;
+	if (s == "short" || s == "int16") return PLY_INT16;
+	if (s == "ushort" || s == "uint16") return PLY_UINT16;
+	if (s == "int" || s == "int32") return PLY_INT32;
+	if (s == "uint" || s == "uint32") return PLY_UINT32;
+	if (s == "float" || s == "float32") return PLY_FLOAT32;
+	if (s == "double" || s == "float64") return PLY_FLOAT64;
+	return PLY_NONE;
+}
+
+static int getPLYTypeSize(PLYType type)
+{
+	static const int sizes[] = { 0, 1, 1, 2, 2, 4, 4, 4, 8 };
+	return sizes[type];
+}
+
+/// reads a little-endian PLY scalar (the hosts we build on are all little-endian, so it's a plain copy)
+static inline double readPLYScalar(const char* p, PLYType type)
+{
+	switch (type) {
+		case PLY_INT8: return *(const signed char*) p;
+		case PLY_UINT8: return *(const unsigned char*) p;
+		case PLY_INT16: { short x; memcpy(&x, p, 2); return x; }
+		case PLY_UINT16: { unsigned short x; memcpy(&x, p, 2); return x; }
+		case PLY_INT32: { int x; memcpy(&x, p, 4); return x; }
+		case PLY_UINT32: { unsigned x; memcpy(&x, p, 4); return x; }
+		case PLY_FLOAT32: { float x; memcpy(&x, p, 4); return x; }
+		case PLY_FLOAT64: { double x; memcpy(&x, p, 8); return x; }
+		default: return 0;
+	}
+}
+
+struct PLYProperty {
+	string name;
+	PLYType type;
+	PLYType countType; //!< for list properties, the type of the item count (PLY_NONE for scalars)
+	int offset;        //!< from the start of the element (only for elements without lists)
+};
+
+struct PLYElement {
+	string name;
+	long long count;
+	vector<PLYProperty> properties;
+	int size = 0;      //!< in bytes, or -1 if the element has list properties (so its size varies)
+
+	int findProperty(std::initializer_list<const char*> names) const
+	{
+		for (const char* name: names)
+			for (int i = 0; i < int(properties.size()); i++)
+				if (properties[i].name == name && properties[i].countType == PLY_NONE) return i;
+		return -1;
+	}
+};
+
+/// walks over a single instance of an element with list properties; calls onList(propertyIdx, count, data)
+/// for each list. @returns the pointer after the element, or nullptr if it doesn't fit before `end'
+template <typename ListCallback>
+static const char* walkPLYElement(const PLYElement& element, const char* p, const char* end, ListCallback onList)
+{
+	for (int i = 0; i < int(element.properties.size()); i++) {
+		const PLYProperty& prop = element.properties[i];
+		if (prop.countType == PLY_NONE) {
+			p += getPLYTypeSize(prop.type);
 			continue;
 		}
-		//
-		if (tokens[0] == "vt") {
-			uvs.push_back(Vector(
-				toDouble(tokens[1]),
-				toDouble(tokens[2]),
-				0
-			));
+		if (getPLYTypeSize(prop.countType) > end - p) return nullptr;
+		// the count may be any type, up to uint32 (exact in a double); negative ones and ones that the rest of
+		// the data can't hold are rejected before they are converted, so nothing below can overflow:
+		double rawCount = readPLYScalar(p, prop.countType);
+		p += getPLYTypeSize(prop.countType);
+		size_t itemSize = getPLYTypeSize(prop.type);
+		if (!(rawCount >= 0) || rawCount > double(size_t(end - p) / itemSize)) return nullptr;
+		size_t count = size_t(rawCount);
+		onList(i, count, p);
+		p += count * itemSize;
+	}
+	return p <= end ? p : nullptr;
+}
+
+/**
+ * Loads a binary (little-endian) PLY file. The file is memory-mapped, and its vertex and face arrays are
+ * converted directly into ours, so there's nearly no parsing. The vertices may have normals (nx, ny, nz)
+ * and texture coordinates (u, v or s, t); faces with more than three vertices are split into triangle fans.
+ */
+bool Mesh::loadFromPLY(const char* filename)
+{
+	MappedFile file;
+	if (!file.open(filename)) return false;
+	const char* data = file.getData();
+	const char* end = data + file.getSize();
+	// parse the (text) header:
+	vector<PLYElement> elements;
+	const char* p = data;
+	bool formatOK = false, headerOK = false;
+	int lineNo = 0;
+	while (p < end && !headerOK) {
+		const char* eol = (const char*) memchr(p, '\n', end - p);
+		if (!eol) break;
+		vector<string> tokens = tokenize(string(p, eol));
+		p = eol + 1;
+		if (lineNo++ == 0) {
+			if (tokens.size() != 1 || tokens[0] != "ply") break;
 			continue;
 		}
-		//
-		if (tokens[0] == "f") {
-			for (int i = 0; i < int(tokens.size() - 3); i++)
-				triangles.push_back(
-					parseTriangle(tokens[1], tokens[2 + i], tokens[3 + i])
-				);
-			continue;
+		if (tokens.empty() || tokens[0] == "comment" || tokens[0] == "obj_info") continue;
+		if (tokens[0] == "format") {
+			formatOK = (tokens.size() >= 2 && tokens[1] == "binary_little_endian");
+		} else if (tokens[0] == "element" && tokens.size() == 3) {
+			elements.emplace_back();
+			elements.back().name = tokens[1];
+			elements.back().count = atoll(tokens[2].c_str());
+		} else if (tokens[0] == "property" && !elements.empty()) {
+			PLYProperty prop;
+			if (tokens.size() == 5 && tokens[1] == "list") {
+				prop.countType = parsePLYType(tokens[2]);
+				prop.type = parsePLYType(tokens[3]);
+				if (prop.countType == PLY_NONE) break;
+			} else if (tokens.size() == 3) {
+				prop.countType = PLY_NONE;
+				prop.type = parsePLYType(tokens[1]);
+			} else {
+				break;
+			}
+			if (prop.type == PLY_NONE) break;
+			prop.name = tokens.back();
+			PLYElement& element = elements.back();
+			prop.offset = element.size;
+			if (prop.countType != PLY_NONE) element.size = -1;
+			else if (element.size >= 0) element.size += getPLYTypeSize(prop.type);
+			element.properties.push_back(prop);
+		} else if (tokens[0] == "end_header") {
+			headerOK = true;
 		}
 	}
+	if (!headerOK || !formatOK) {
+		printf("PLY file `%s': bad header, or not a binary little-endian file\n", filename);
+		return false;
+	}
 
-	fclose(f);
+	Vector sentinel(0, 0, 0);
+	addVertex(sentinel);
+	addNormal(sentinel);
+	addUV(sentinel);
+	int numVertices = 0;
+	bool hasNormals = false, hasUVs = false;
+	for (auto& element: elements) {
+		if (element.count < 0) return false;
+		if (element.name == "vertex") {
+			int x = element.findProperty({ "x" }), y = element.findProperty({ "y" }), z = element.findProperty({ "z" });
+			int nx = element.findProperty({ "nx" }), ny = element.findProperty({ "ny" }), nz = element.findProperty({ "nz" });
+			int u = element.findProperty({ "u", "s", "texture_u" }), v = element.findProperty({ "v", "t", "texture_v" });
+			if (element.size < 0 || x < 0 || y < 0 || z < 0 || element.count >= INT_MAX) return false;
+			if ((long long) element.size * element.count > end - p) return false;
+			numVertices = int(element.count);
+			hasNormals = (nx >= 0 && ny >= 0 && nz >= 0);
+			hasUVs = (u >= 0 && v >= 0);
+			if (compactStorage) {
+				cVertices.reserve(numVertices + 1);
+				if (hasNormals) cNormals.reserve(numVertices + 1);
+				if (hasUVs) cUVs.reserve(numVertices + 1);
+			} else {
+				vertices.reserve(numVertices + 1);
+				if (hasNormals) normals.reserve(numVertices + 1);
+				if (hasUVs) uvs.reserve(numVertices + 1);
+			}
+			auto read = [&element] (const char* vertex, int prop) {
+				return readPLYScalar(vertex + element.properties[prop].offset, element.properties[prop].type);
+			};
+			for (int i = 0; i < numVertices; i++, p += element.size) {
+				addVertex(Vector(read(p, x), read(p, y), read(p, z)));
+				if (hasNormals) addNormal(Vector(read(p, nx), read(p, ny), read(p, nz)));
+				if (hasUVs) addUV(Vector(read(p, u), read(p, v), 0));
+			}
+		} else if (element.name == "face") {
+			int indices = -1;
+			for (int i = 0; i < int(element.properties.size()); i++) {
+				const string& name = element.properties[i].name;
+				if (element.properties[i].countType != PLY_NONE && (name == "vertex_indices" || name == "vertex_index"))
+					indices = i;
+			}
+			if (indices < 0) return false;
+			PLYType indexType = element.properties[indices].type;
+			int indexSize = getPLYTypeSize(indexType);
+			// the count comes from the header, so the reserve is capped by what the data can hold (a triangle takes
+			// at least a list count and three indices); a truncated file then fails below, rather than here:
+			if (element.count >= INT_MAX) return false;
+			size_t maxTriangles = std::min<long long>(element.count, (end - p) / (1 + 3 * indexSize));
+			if (compactStorage) cTriangles.reserve(maxTriangles);
+			else triangles.reserve(maxTriangles);
+			bool indicesOK = true;
+			for (long long i = 0; i < element.count && p; i++) {
+				p = walkPLYElement(element, p, end, [&] (int prop, size_t count, const char* list) {
+					if (prop != indices) return;
+					auto vertexAt = [&] (size_t j) {
+						long long idx = (long long) readPLYScalar(list + j * indexSize, indexType);
+						if (idx < 0 || idx >= numVertices) indicesOK = false;
+						return indicesOK ? int(idx) + 1 : 0; // (+1 for the sentinel)
+					};
+					// split the polygon into a triangle fan:
+					for (size_t j = 1; j + 1 < count; j++) {
+						TriangleIndices t;
+						t.v[0] = vertexAt(0);
+						t.v[1] = vertexAt(j);
+						t.v[2] = vertexAt(j + 1);
+						for (int k = 0; k < 3; k++) {
+							t.n[k] = hasNormals ? t.v[k] : 0;
+							t.t[k] = hasUVs ? t.v[k] : 0;
+						}
+						addTriangle(t);
+					}
+				});
+			}
+			if (!p || !indicesOK) {
+				printf("PLY file `%s': truncated file, or bad vertex indices in the faces\n", filename);
+				return false;
+			}
+		} else if (element.size >= 0) {
+			// some other element we don't need, e.g. "edge" or "material":
+			if ((long long) element.size * element.count > end - p) return false;
+			p += element.size * element.count;
+		} else {
+			for (long long i = 0; i < element.count && p; i++)
+				p = walkPLYElement(element, p, end, [] (int, size_t, const char*) {});
+			if (!p) return false;
+		}
+	}
+	shrinkArrays();
 	prepareTriangles();
 	return true;
 }
 
-static void solve2D(Vector A, Vector B, Vector C, double& x, double& y)
+bool Mesh::loadFromFile(const char* filename)
 {
-	// solve: x * A + y * B = C
-	double mat[2][2] = { { A.x, B.x }, { A.y, B.y }};
-	double h[2] = { C.x, C.y };
-	double Dcr =  mat[0][0] * mat[1][1] - mat[1][0] * mat[0][1];
-	x          = (h[0]      * mat[1][1] - h[1]      * mat[0][1]) / Dcr;
-	y          = (mat[0][0] * h[1]      - mat[1][0] * h[0]     ) / Dcr;
+	unsigned startLoad = SDL_GetTicks();
+	bool loaded = (extensionUpper(filename) == "PLY") ? loadFromPLY(filename) : loadFromOBJ(filename);
+	if (loaded)
+		printf("Mesh file `%s' loaded in %.3fs (%d triangles)\n", filename, (SDL_GetTicks() - startLoad) / 1000.0, getNumTriangles());
+	return loaded;
+}
+
+/// frees the spare capacity of the geometry arrays, after they are filled (the vectors grow in steps, which
+/// could waste up to half of the memory)
+void Mesh::shrinkArrays()
+{
+	vertices.shrink_to_fit();
+	normals.shrink_to_fit();
+	uvs.shrink_to_fit();
+	triangles.shrink_to_fit();
+	cVertices.shrink_to_fit();
+	cNormals.shrink_to_fit();
+	cUVs.shrink_to_fit();
+	cTriangles.shrink_to_fit();
 }
 
 void Mesh::prepareTriangles()
 {
-	if (normals.size() <= 1) faceted = true;
-	for (auto& t: triangles) {
-		const Vector& A = vertices[t.v[0]];
-		const Vector& B = vertices[t.v[1]];
-		const Vector& C = vertices[t.v[2]];
-		t.AB = B - A;
-		t.AC = C - A;
-		t.ABcrossAC = t.gnormal = t.AB ^ t.AC;
-		t.gnormal.normalize();
-
-		const Vector& tA = uvs[t.t[0]];
-		const Vector& tB = uvs[t.t[1]];
-		const Vector& tC = uvs[t.t[2]];
-		Vector texAB = tB - tA;
-		Vector texAC = tC - tA;
-
-		double px, py, qx, qy;
-		solve2D(texAB, texAC, Vector(1, 0, 0), px, qx);
-		solve2D(texAB, texAC, Vector(0, 1, 0), py, qy);
-		t.dNdx = px * t.AB + qx * t.AC;
-		t.dNdy = py * t.AB + qy * t.AC;
-		t.dNdx.normalize();
-		t.dNdy.normalize();
+	if (getNumNormals() <= 1) faceted = true;
+	parallelFor(int(triangles.size()), 16384, [this] (int begin, int end) {
+		for (int i = begin; i < end; i++) {
+			Triangle& t = triangles[i];
+			const Vector& A = vertices[t.v[0]];
+			const Vector& B = vertices[t.v[1]];
+			const Vector& C = vertices[t.v[2]];
+			t.AB = B - A;
+			t.AC = C - A;
+			t.ABcrossAC = t.gnormal = t.AB ^ t.AC;
+			t.gnormal.normalize();
+
+			const Vector& tA = uvs[t.t[0]];
+			const Vector& tB = uvs[t.t[1]];
+			const Vector& tC = uvs[t.t[2]];
+			computeTriangleTangents(t.AB, t.AC, tB - tA, tC - tA, t.dNdx, t.dNdy);
+		}
+	});
+}
+
+/// packs a unit vector in 32 bits: it's projected on the octahedron |x| + |y| + |z| = 1, whose lower
+/// half is folded over the upper one, and the resulting (x, y) are stored as 16-bit fixed point numbers
+static unsigned encodeOctahedral(const Vector& n)
+{
+	double l1 = fabs(n.x) + fabs(n.y) + fabs(n.z);
+	if (l1 <= 0) return 0;
+	double x = n.x / l1, y = n.y / l1;
+	if (n.z < 0) {
+		double fx = (1 - fabs(y)) * (x >= 0 ? 1 : -1);
+		double fy = (1 - fabs(x)) * (y >= 0 ? 1 : -1);
+		x = fx;
+		y = fy;
+	}
+	auto quantize = [] (double f) { return unsigned(int(floor(f * 32767 + 0.5)) & 0xffff); };
+	return quantize(x) | (quantize(y) << 16);
+}
+
+static Vector decodeOctahedral(unsigned packed)
+{
+	double x = short(packed & 0xffff) / 32767.0, y = short(packed >> 16) / 32767.0;
+	double z = 1 - fabs(x) - fabs(y);
+	if (z < 0) {
+		double ux = (1 - fabs(y)) * (x >= 0 ? 1 : -1);
+		double uy = (1 - fabs(x)) * (y >= 0 ? 1 : -1);
+		x = ux;
+		y = uy;
+	}
+	Vector n(x, y, z);
+	n.normalize();
+	return n;
+}
+
+/// converts a float to IEEE 754 half precision (rounding to nearest, flushing the denormals to zero)
+static unsigned short floatToHalf(float f)
+{
+	unsigned bits;
+	memcpy(&bits, &f, 4);
+	unsigned sign = (bits >> 16) & 0x8000;
+	int exponent = int((bits >> 23) & 0xff) - 127 + 15;
+	unsigned mantissa = bits & 0x7fffff;
+	if (exponent <= 0) return (unsigned short) sign;
+	if (exponent >= 31) return (unsigned short) (sign | 0x7bff); // (clamp to the largest half)
+	unsigned half = sign | (unsigned(exponent) << 10) | (mantissa >> 13);
+	if (mantissa & 0x1000) half++; // (a carry into the exponent is still the correctly rounded result)
+	return (unsigned short) half;
+}
+
+static float halfToFloat(unsigned short h)
+{
+	unsigned sign = unsigned(h & 0x8000) << 16;
+	unsigned exponent = (h >> 10) & 0x1f;
+	unsigned mantissa = h & 0x3ff;
+	unsigned bits = exponent ? (sign | ((exponent - 15 + 127) << 23) | (mantissa << 13)) : sign;
+	float f;
+	memcpy(&f, &bits, 4);
+	return f;
+}
+
+Vector Mesh::getNormal(int idx) const
+{
+	return compactStorage ? decodeOctahedral(cNormals[idx]) : normals[idx];
+}
+
+Vector Mesh::getUV(int idx) const
+{
+	if (!compactStorage) return uvs[idx];
+	unsigned packed = cUVs[idx];
+	return Vector(halfToFloat(packed & 0xffff), halfToFloat(packed >> 16), 0);
+}
+
+void Mesh::addVertex(const Vector& v)
+{
+	if (compactStorage) cVertices.push_back(Float3(v));
+	else vertices.push_back(v);
+}
+
+void Mesh::addNormal(const Vector& n)
+{
+	if (compactStorage) cNormals.push_back(encodeOctahedral(n));
+	else normals.push_back(n);
+}
+
+static unsigned encodeUV(const Vector& uv)
+{
+	return floatToHalf(float(uv.x)) | (unsigned(floatToHalf(float(uv.y))) << 16);
+}
+
+void Mesh::addUV(const Vector& uv)
+{
+	if (compactStorage) cUVs.push_back(encodeUV(uv));
+	else uvs.push_back(uv);
+}
+
+void Mesh::addTriangle(const TriangleIndices& t)
+{
+	if (compactStorage) {
+		cTriangles.push_back(t);
+	} else {
+		Triangle T;
+		static_cast<TriangleIndices&>(T) = t;
+		triangles.push_back(T); // (the rest is filled by prepareTriangles())
+	}
+}
+
+/// sizes the arrays for the given counts, so that they can be filled in parallel, with the store...() methods
+void Mesh::resizeArrays(int numVertices, int numNormals, int numUVs, int numTriangles)
+{
+	if (compactStorage) {
+		cVertices.resize(numVertices);
+		cNormals.resize(numNormals);
+		cUVs.resize(numUVs);
+		cTriangles.resize(numTriangles);
+	} else {
+		vertices.resize(numVertices);
+		normals.resize(numNormals);
+		uvs.resize(numUVs);
+		triangles.resize(numTriangles);
+	}
+}
+
+void Mesh::storeVertex(int idx, const Vector& v)
+{
+	if (compactStorage) cVertices[idx] = Float3(v);
+	else vertices[idx] = v;
+}
+
+void Mesh::storeNormal(int idx, const Vector& n)
+{
+	if (compactStorage) cNormals[idx] = encodeOctahedral(n);
+	else normals[idx] = n;
+}
+
+void Mesh::storeUV(int idx, const Vector& uv)
+{
+	if (compactStorage) cUVs[idx] = encodeUV(uv);
+	else uvs[idx] = uv;
+}
+
+void Mesh::storeTriangle(int idx, const TriangleIndices& t)
+{
+	if (compactStorage) cTriangles[idx] = t;
+	else static_cast<TriangleIndices&>(triangles[idx]) = t; // (the rest is filled by prepareTriangles())
+}
+
+/// the memory, taken by the vertex and triangle arrays (without the acceleration structures)
+size_t Mesh::getGeometryMemory() const
+{
+	return vertices.capacity() * sizeof(Vector) + normals.capacity() * sizeof(Vector) + uvs.capacity() * sizeof(Vector)
+		+ triangles.capacity() * sizeof(Triangle)
+		+ cVertices.capacity() * sizeof(Float3) + cNormals.capacity() * sizeof(unsigned) + cUVs.capacity() * sizeof(unsigned)
+		+ cTriangles.capacity() * sizeof(TriangleIndices);
+}
+
+/// the memory, taken by the k-d tree or the BVH, including the packed triangle blocks of their leaves
+size_t Mesh::getAccelerationMemory() const
+{
+	return kdNodes.capacity() * sizeof(KDTreeNode) + kdBlocks.capacity() * sizeof(TriangleBlock4)
+		+ bvh.getMemoryUsage() + bvhBlocks.capacity() * sizeof(TriangleBlock4) + bvhLeafBlocks.capacity() * sizeof(int);
+}
+
+static const char CLUSTER_FILE_MAGIC[8] = { 'H', 'X', 'C', 'L', 'U', 'S', 'T', 0 };
+static const int CLUSTER_FILE_VERSION = 1;
+
+int Mesh::getClusterFileFlags() const
+{
+	return (recenter ? CLUSTER_FILE_RECENTERED : 0) | (autoSmooth ? CLUSTER_FILE_AUTOSMOOTHED : 0);
+}
+
+/**
+ * Loads an out-of-core mesh: maps its .clusters file, if it's up to date, or else loads the .obj,
+ * splits it into clusters and writes them to the file first.
+ */
+bool Mesh::loadOutOfCore(const char* objFileName)
+{
+	string clusterFileName = string(objFileName) + ".clusters";
+	long long objTime = getFileModificationTime(objFileName);
+	long long clusterTime = getFileModificationTime(clusterFileName.c_str());
+	if (clusterTime >= objTime && loadClusters(clusterFileName.c_str())) return true;
+	// (re)build the clusters. This is the only time, when the whole mesh needs to be in memory:
+	if (!loadFromFile(objFileName)) return false;
+	applyVertexOptions();
+	bool written = writeClusters(clusterFileName.c_str());
+	vector<Vector>().swap(vertices);
+	vector<Vector>().swap(normals);
+	vector<Vector>().swap(uvs);
+	vector<Triangle>().swap(triangles);
+	vector<Float3>().swap(cVertices);
+	vector<unsigned>().swap(cNormals);
+	vector<unsigned>().swap(cUVs);
+	vector<TriangleIndices>().swap(cTriangles);
+	if (!written) {
+		printf("Could not write the out-of-core mesh file `%s'\n", clusterFileName.c_str());
+		return false;
 	}
+	return loadClusters(clusterFileName.c_str());
+}
+
+/// returns the index of a vertex (or normal, or uv) in the cluster's own array, adding it there if needed.
+/// Index 0 (the "no normal"/"no uv" sentinel) stays 0
+static int remapClusterIndex(int idx, std::unordered_map<int, int>& indexMap, vector<Vector>& local, const Vector& value)
+{
+	if (idx == 0) return 0;
+	auto it = indexMap.find(idx);
+	if (it != indexMap.end()) return it->second;
+	int localIdx = int(local.size());
+	local.push_back(value);
+	indexMap[idx] = localIdx;
+	return localIdx;
+}
+
+/**
+ * Splits the (in-memory) mesh into clusters of at most clusterSize triangles, builds a BVH for each of them,
+ * and writes everything to the given file. The clusters are made by recursive median splits of the
+ * triangle centroids along the longest axis, and are written in that (depth-first) order, so that
+ * clusters, which are close in space, are also close in the file.
+ */
+bool Mesh::writeClusters(const char* fileName)
+{
+	unsigned startBuild = SDL_GetTicks();
+	int numTriangles = getNumTriangles();
+	vector<int> triList(numTriangles);
+	std::iota(triList.begin(), triList.end(), 0);
+	vector<Vector> centroids(numTriangles);
+	for (int i = 0; i < numTriangles; i++)
+		centroids[i] = (getTriangleVertex(i, 0) + getTriangleVertex(i, 1) + getTriangleVertex(i, 2)) / 3;
+	vector<std::pair<int, int>> ranges, stack;
+	if (numTriangles > 0) stack.push_back({ 0, numTriangles });
+	while (!stack.empty()) {
+		auto range = stack.back();
+		stack.pop_back();
+		int begin = range.first, end = range.second;
+		if (end - begin <= clusterSize) {
+			ranges.push_back(range);
+			continue;
+		}
+		BBox centroidBox;
+		centroidBox.makeEmpty();
+		for (int i = begin; i < end; i++) centroidBox.add(centroids[triList[i]]);
+		Vector size = centroidBox.vmax - centroidBox.vmin;
+		int axis = size.x > size.y ? (size.x > size.z ? 0 : 2) : (size.y > size.z ? 1 : 2);
+		int mid = (begin + end) / 2;
+		std::nth_element(&triList[begin], &triList[mid], &triList[0] + end, [&centroids, axis] (int a, int b) {
+			return centroids[a][axis] < centroids[b][axis];
+		});
+		stack.push_back({ mid, end });
+		stack.push_back({ begin, mid }); // (the left half goes first)
+	}
+
+	// the file is written under a temporary name, and then moved in place: it may be mapped by another
+	// mesh (of the same .obj), and overwriting a mapped file under it would crash that mesh's renders:
+	string tempFileName = string(fileName) + ".tmp";
+	FILE* f = fopen(tempFileName.c_str(), "wb");
+	if (!f) return false;
+	long long pos = 0;
+	bool ok = true;
+	auto write = [&] (const void* data, size_t size) {
+		if (size && fwrite(data, 1, size, f) != size) ok = false;
+		pos += (long long) size;
+	};
+	auto align = [&] (int alignment) {
+		static const char zeros[64] = { 0 };
+		write(zeros, size_t((alignment - pos % alignment) % alignment));
+	};
+	MeshClusterFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CLUSTER_FILE_MAGIC, sizeof(header.magic));
+	header.version = CLUSTER_FILE_VERSION;
+	header.numClusters = int(ranges.size());
+	header.numTriangles = numTriangles;
+	header.clusterSize = clusterSize;
+	header.flags = getClusterFileFlags() | (getNumNormals() > 1 ? CLUSTER_FILE_HAS_NORMALS : 0);
+	vector<MeshClusterInfo> infos(ranges.size());
+	// the header and the table are written twice: now, to reserve their space, and at the end, with the actual values:
+	write(&header, sizeof(header));
+	write(infos.data(), infos.size() * sizeof(MeshClusterInfo));
+	BBox meshBox;
+	meshBox.makeEmpty();
+	for (int c = 0; c < int(ranges.size()); c++) {
+		int begin = ranges[c].first, count = ranges[c].second - ranges[c].first;
+		// build the cluster's BVH, and order its triangles as in the BVH leaves:
+		vector<BBox> triBoxes(count);
+		BBox clusterBox;
+		clusterBox.makeEmpty();
+		for (int i = 0; i < count; i++) {
+			triBoxes[i].makeEmpty();
+			for (int j = 0; j < 3; j++) triBoxes[i].add(getTriangleVertex(triList[begin + i], j));
+			clusterBox.extend(triBoxes[i]);
+		}
+		meshBox.extend(clusterBox);
+		BVH bvh;
+		bvh.build(triBoxes, 8);
+		const vector<int>& primIndices = bvh.getPrimIndices();
+		vector<int> globalTris(count);
+		for (int i = 0; i < count; i++) globalTris[i] = triList[begin + primIndices[i]];
+		// pack the leaves; the triangle blocks get the local (BVH leaf order) indices:
+		vector<BVHNode4> nodes = bvh.getNodes();
+		vector<TriangleBlock4> blocks;
+		for (auto& node: nodes)
+			for (int i = 0; i < 4; i++) if (node.count[i] > 0) {
+				int firstBlock = int(blocks.size());
+				packTriangleBlocks(&globalTris[node.child[i]], node.count[i], blocks);
+				for (int b = firstBlock; b < int(blocks.size()); b++)
+					for (int lane = 0; lane < 4; lane++)
+						if (blocks[b].triIdx[lane] >= 0) blocks[b].triIdx[lane] = node.child[i] + (b - firstBlock) * 4 + lane;
+				node.child[i] = firstBlock;
+			}
+		// the local vertex, normal and uv arrays:
+		vector<Vector> localVertices(1, Vector(0, 0, 0)), localNormals(1, Vector(0, 0, 0)), localUVs(1, Vector(0, 0, 0));
+		std::unordered_map<int, int> vertexMap, normalMap, uvMap;
+		vector<TriangleIndices> localTriangles(count);
+		for (int i = 0; i < count; i++) {
+			const TriangleIndices& t = getTriangle(globalTris[i]);
+			for (int j = 0; j < 3; j++) {
+				localTriangles[i].v[j] = remapClusterIndex(t.v[j], vertexMap, localVertices, getVertex(t.v[j]));
+				localTriangles[i].n[j] = remapClusterIndex(t.n[j], normalMap, localNormals, getNormal(t.n[j]));
+				localTriangles[i].t[j] = remapClusterIndex(t.t[j], uvMap, localUVs, getUV(t.t[j]));
+			}
+		}
+		MeshClusterInfo& info = infos[c];
+		for (int dim = 0; dim < 3; dim++) {
+			info.bbox[0][dim] = clusterBox.vmin[dim];
+			info.bbox[1][dim] = clusterBox.vmax[dim];
+		}
+		info.numNodes = int(nodes.size());
+		info.numBlocks = int(blocks.size());
+		info.numTriangles = count;
+		info.numVertices = int(localVertices.size());
+		info.numNormals = int(localNormals.size());
+		info.numUVs = int(localUVs.size());
+		align(64);
+		info.nodesOffset = pos;
+		write(nodes.data(), nodes.size() * sizeof(BVHNode4));
+		info.blocksOffset = pos;
+		write(blocks.data(), blocks.size() * sizeof(TriangleBlock4));
+		info.trianglesOffset = pos;
+		write(localTriangles.data(), localTriangles.size() * sizeof(TriangleIndices));
+		align(8);
+		info.verticesOffset = pos;
+		write(localVertices.data(), localVertices.size() * sizeof(Vector));
+		info.normalsOffset = pos;
+		write(localNormals.data(), localNormals.size() * sizeof(Vector));
+		info.uvsOffset = pos;
+		write(localUVs.data(), localUVs.size() * sizeof(Vector));
+	}
+	for (int dim = 0; dim < 3; dim++) {
+		header.bbox[0][dim] = meshBox.vmin[dim];
+		header.bbox[1][dim] = meshBox.vmax[dim];
+	}
+	rewind(f);
+	if (fwrite(&header, sizeof(header), 1, f) != 1) ok = false;
+	if (!infos.empty() && fwrite(infos.data(), sizeof(MeshClusterInfo), infos.size(), f) != infos.size()) ok = false;
+	if (fclose(f) != 0) ok = false;
+	if (!ok || !replaceFile(tempFileName.c_str(), fileName)) {
+		remove(tempFileName.c_str());
+		return false;
+	}
+	unsigned endBuild = SDL_GetTicks();
+	printf("Out-of-core mesh: %d triangles split into %d clusters in %.2fs, %.1f MB written\n",
+		numTriangles, int(ranges.size()), (endBuild - startBuild) / 1000.0, pos / 1048576.0);
+	return true;
+}
+
+/// maps an out-of-core mesh file, and builds the top-level BVH over its clusters. Returns false if the
+/// file is missing, invalid, or was built with different options
+bool Mesh::loadClusters(const char* fileName)
+{
+	clusters.clear();
+	clusterBVH.clear();
+	if (!clusterFile.open(fileName)) return false;
+	const char* data = clusterFile.getData();
+	size_t size = clusterFile.getSize();
+	const MeshClusterFileHeader* header = (const MeshClusterFileHeader*) data;
+	auto invalid = [this] {
+		clusters.clear();
+		clusterFile.close();
+		return false;
+	};
+	if (size < sizeof(MeshClusterFileHeader)
+		|| memcmp(header->magic, CLUSTER_FILE_MAGIC, sizeof(header->magic))
+		|| header->version != CLUSTER_FILE_VERSION
+		|| header->clusterSize != clusterSize
+		|| (header->flags & ~CLUSTER_FILE_HAS_NORMALS) != getClusterFileFlags()
+		|| header->numClusters < 0
+		|| size < sizeof(MeshClusterFileHeader) + size_t(header->numClusters) * sizeof(MeshClusterInfo))
+		return invalid();
+	const MeshClusterInfo* infos = (const MeshClusterInfo*) (data + sizeof(MeshClusterFileHeader));
+	size_t tableEnd = sizeof(MeshClusterFileHeader) + size_t(header->numClusters) * sizeof(MeshClusterInfo);
+	// checks that an array lies within the file, after the cluster table, and is aligned for its elements
+	// (the mapping starts at a page boundary, so the alignment in the file is the one in memory):
+	auto validArray = [size, tableEnd] (long long offset, int count, size_t elementSize, size_t alignment) {
+		return offset >= (long long) tableEnd && size_t(offset) <= size && size_t(offset) % alignment == 0
+			&& count >= 0 && size_t(count) <= (size - size_t(offset)) / elementSize;
+	};
+	vector<BBox> clusterBoxes(header->numClusters);
+	for (int c = 0; c < header->numClusters; c++) {
+		const MeshClusterInfo& info = infos[c];
+		// (only the layout is checked; the indices inside the arrays are trusted, as checking them would
+		// page in the whole file):
+		if (!validArray(info.nodesOffset, info.numNodes, sizeof(BVHNode4), alignof(BVHNode4))
+			|| !validArray(info.blocksOffset, info.numBlocks, sizeof(TriangleBlock4), alignof(TriangleBlock4))
+			|| !validArray(info.trianglesOffset, info.numTriangles, sizeof(TriangleIndices), alignof(TriangleIndices))
+			|| !validArray(info.verticesOffset, info.numVertices, sizeof(Vector), alignof(Vector))
+			|| !validArray(info.normalsOffset, info.numNormals, sizeof(Vector), alignof(Vector))
+			|| !validArray(info.uvsOffset, info.numUVs, sizeof(Vector), alignof(Vector))
+			|| info.numNodes < 1 || info.numVertices < 1 || info.numNormals < 1 || info.numUVs < 1)
+			return invalid();
+		MeshCluster cluster;
+		cluster.bbox.vmin.set(info.bbox[0][0], info.bbox[0][1], info.bbox[0][2]);
+		cluster.bbox.vmax.set(info.bbox[1][0], info.bbox[1][1], info.bbox[1][2]);
+		cluster.nodes = (const BVHNode4*) (data + info.nodesOffset);
+		cluster.blocks = (const TriangleBlock4*) (data + info.blocksOffset);
+		cluster.triangles = (const TriangleIndices*) (data + info.trianglesOffset);
+		cluster.vertices = (const Vector*) (data + info.verticesOffset);
+		cluster.normals = (const Vector*) (data + info.normalsOffset);
+		cluster.uvs = (const Vector*) (data + info.uvsOffset);
+		clusters.push_back(cluster);
+		clusterBoxes[c] = cluster.bbox;
+	}
+	clusterBVH.build(clusterBoxes, 1);
+	bbox.vmin.set(header->bbox[0][0], header->bbox[0][1], header->bbox[0][2]);
+	bbox.vmax.set(header->bbox[1][0], header->bbox[1][1], header->bbox[1][2]);
+	if (!(header->flags & CLUSTER_FILE_HAS_NORMALS)) faceted = true;
+	printf("Out-of-core mesh mapped from `%s': %d triangles in %d clusters, %.1f MB\n", fileName,
+		header->numTriangles, header->numClusters, size / 1048576.0);
+	return true;
 }
@@ -25,48 +25,221 @@
 #pragma once
 
 #include <vector>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string.h>
 #include "geometry.h"
 #include "vector.h"
 #include "bbox.h"
+#include "bvh.h"
+#include "util.h"
 
+/**
+ * @Brief A single node of the k-d tree (8 bytes)
+ *
+ * All nodes of the tree live in one array (Mesh::kdNodes), and the two children of an inner node
+ * are stored next to each other. The leaves refer to a range in one shared triangle array
+ * (Mesh::kdBlocks). The lazily built subtrees have a pair of such arrays each (see KDLazySubtree).
+ */
 struct KDTreeNode {
-	Axis axis;
-	double splitPos;
 	union {
-		KDTreeNode* children;
-		std::vector<int>* triangles;
+		float splitPos;    //!< inner nodes: the position of the split plane along axis()
+		unsigned firstTri; //!< leaves: index of the first TriangleBlock4 in Mesh::kdBlocks (of the first
+		                   //!< triangle index in Mesh::kdTriangles, while the tree is being built)
 	};
+	unsigned flags;        //!< lower 2 bits: the axis (AXIS_NONE for leaves); upper 30 bits:
+	                       //!< index of the left child (inner nodes) or number of triangles (leaves)
+
+	/// the triangle count of a leaf, which actually stands for a subtree that isn't built yet (see Mesh::lazyKD);
+	/// firstTri is then the index in Mesh::kdLazySubtrees
+	static const int LAZY_SUBTREE = 0x3fffffff;
+
+	Axis axis() const { return Axis(flags & 3); }
+	bool isLeaf() const { return axis() == AXIS_NONE; }
+	bool isLazySubtree() const { return flags == ((unsigned(LAZY_SUBTREE) << 2) | AXIS_NONE); }
+	int leftChild() const { return int(flags >> 2); }
+	int numTriangles() const { return int(flags >> 2); }
 
-	void initLeaf(const std::vector<int>& t_list)
+	void initLeaf(int firstTri, int count)
 	{
-		axis = AXIS_NONE;
-		this->triangles = new std::vector<int>(t_list);
+		this->firstTri = unsigned(firstTri);
+		flags = (unsigned(count) << 2) | AXIS_NONE;
 	}
 
-	void initBinaryNode(Axis axis, double sp)
+	void initLazySubtree(int subtreeIdx) { initLeaf(subtreeIdx, LAZY_SUBTREE); }
+
+	void initBinaryNode(Axis axis, float sp, int leftChild)
 	{
-		this->axis = axis;
 		splitPos = sp;
-		children = new KDTreeNode[2];
+		flags = (unsigned(leftChild) << 2) | axis;
+	}
+};
+
+/**
+ * @Brief Four triangles in SoA layout, as floats, for the SIMD leaf intersection kernel
+ *
+ * The leaves of the acceleration structures refer to runs of such blocks (see Mesh::packTriangleBlocks()),
+ * so the triangles of a leaf are tested four at a time, without going through the index arrays.
+ */
+struct alignas(16) TriangleBlock4 {
+	float A[3][4];  //!< A[axis][lane]: the first vertex of each triangle
+	float AB[3][4]; //!< the edge B - A
+	float AC[3][4]; //!< the edge C - A
+	int triIdx[4];  //!< index in Mesh::triangles; -1 for unused lanes (these hold a degenerate triangle)
+};
+
+/// a ray, converted for the tests against TriangleBlock4-s
+struct TriangleBlockRay {
+	float org[3], dir[3];
+	float orgScale; //!< |org| (L1 norm); the rounding of org and of the vertices to float grows with it
+
+	TriangleBlockRay() {}
+	TriangleBlockRay(const Ray& ray)
+	{
+		for (int dim = 0; dim < 3; dim++) {
+			org[dim] = float(ray.start[dim]);
+			dir[dim] = float(ray.dir[dim]);
+		}
+		orgScale = fabsf(org[0]) + fabsf(org[1]) + fabsf(org[2]);
+	}
+};
+
+/// the closest triangle hit found so far. The IntersectionInfo is only completed for the final one
+/// (see Mesh::computeSurface())
+struct TriangleHit {
+	int triIdx = -1;
+	int cluster = -1;        //!< for out-of-core meshes: the cluster, where triIdx belongs
+	double lambda2, lambda3; //!< the barycentric coordinates of the hit, with respect to B and C
+	HitList* allHits = nullptr; //!< if set, every hit before the end of the ray is added there instead (see Mesh::intersectAll())
+};
+
+/**
+ * @Brief Remembers the last few triangles, tested by a ray
+ *
+ * The k-d tree puts a triangle in every leaf that it overlaps, so a ray may meet the same triangle in
+ * several leaves. The test would give the same result each time, so it's only done once. This is a small
+ * direct-mapped cache, which lives on the stack for the duration of a single ray, so it needs no locking.
+ */
+struct TriangleMailbox {
+	static const int SIZE = 16; // (a power of two)
+	int tri[SIZE];
+	int testsAvoided = 0;
+
+	TriangleMailbox()
+	{
+		for (int i = 0; i < SIZE; i++) tri[i] = -1;
 	}
 
-	~KDTreeNode()
+	/// returns true if this ray already tested the triangle; otherwise, records it
+	bool checkAndMark(int triIdx)
 	{
-		if (axis == AXIS_NONE)
-			delete triangles;
-		else
-			delete[] children;
+		int& slot = tri[triIdx & (SIZE - 1)];
+		if (slot == triIdx) {
+			testsAvoided++;
+			return true;
+		}
+		slot = triIdx;
+		return false;
 	}
 };
 
+/// a vertex position in single precision (see Mesh::compactStorage)
+struct Float3 {
+	float x, y, z;
+
+	Float3() {}
+	Float3(const Vector& v): x(float(v.x)), y(float(v.y)), z(float(v.z)) {}
+	Vector toVector() const { return Vector(x, y, z); }
+};
+
+/// the header of an out-of-core mesh file (see Mesh::outOfCore). It is followed by the table of
+/// MeshClusterInfo-s, and then by the data of the clusters themselves
+struct MeshClusterFileHeader {
+	char magic[8];
+	int version;
+	int numClusters;
+	int numTriangles;
+	int clusterSize; //!< the maximum number of triangles per cluster, which the file was built with
+	int flags;       //!< CLUSTER_FILE_* flags
+	int reserved;
+	double bbox[2][3];
+};
+
+enum {
+	CLUSTER_FILE_HAS_NORMALS = 1,
+	CLUSTER_FILE_RECENTERED  = 2,
+	CLUSTER_FILE_AUTOSMOOTHED = 4,
+};
+
+/// where the arrays of a single cluster are in the out-of-core file (the offsets are from the start of the file)
+struct MeshClusterInfo {
+	double bbox[2][3];
+	long long nodesOffset, blocksOffset, trianglesOffset, verticesOffset, normalsOffset, uvsOffset;
+	int numNodes, numBlocks, numTriangles, numVertices, numNormals, numUVs;
+};
+
+/**
+ * @Brief A spatially coherent part of an out-of-core mesh
+ *
+ * Every cluster is self-contained: it has its own vertex, normal and uv arrays, and its own small BVH,
+ * whose leaves refer directly to runs of triangle blocks. The arrays live in the memory-mapped
+ * file; this is only a view into it.
+ */
+struct MeshCluster {
+	BBox bbox;
+	const BVHNode4* nodes;            //!< the BVH; in its leaves, child[] is the index of the first block
+	const TriangleBlock4* blocks;     //!< TriangleBlock4::triIdx are indices in `triangles'
+	const TriangleIndices* triangles; //!< the indices are in the cluster's own arrays, below
+	const Vector* vertices;
+	const Vector* normals;
+	const Vector* uvs;
+};
+
+/// selects the algorithm, which Mesh uses to build its k-d tree
+enum KDBuilder {
+	KD_BUILDER_MIDPOINT, //!< cycle the axes, split in the middle of the box (the simple, old builder)
+	KD_BUILDER_SAH,      //!< binned Surface Area Heuristic, with empty-space cutoff and cost-based leaf decision
+};
+
 struct KDTreeStats {
 	int numNodes;
 	int numLeafNodes;
 	int maxDepth;
 	long long sumDepth;
 	long long sumTriLeaf;
+	double sahCost; //!< expected cost of a random ray through the tree, as estimated by the SAH
+	long long memoryUsed; //!< size of the node and triangle block arrays, in bytes
 
 	void printStats();
+	void add(const KDTreeStats& other); //!< merges the stats of a subtree
+};
+
+/// a subtree, whose construction is deferred, so that it can be built on another thread
+struct KDBuildTask {
+	int node; //!< index of the subtree root in Mesh::kdNodes
+	BBox bbox;
+	std::vector<int> t_list;
+	int depth;
+	KDTreeStats stats;
+	std::vector<KDTreeNode> nodes; //!< the subtree is built here first, and then spliced into Mesh::kdNodes
+	std::vector<int> triIndices;
+};
+
+/**
+ * @Brief A k-d subtree, which is only built when the first ray reaches it (see Mesh::lazyKD)
+ *
+ * The subtree keeps its own node and block arrays, as the main ones can't grow while other threads
+ * traverse them. The build runs once (under buildFlag), and `ready' publishes the result, so that the
+ * later rays only pay for an atomic load.
+ */
+struct KDLazySubtree {
+	KDBuildTask task;                      //!< what to build; its triangle list is freed afterwards
+	std::once_flag buildFlag;
+	std::atomic<bool> ready { false };
+	std::vector<KDTreeNode> nodes;         //!< nodes[0] is the root of the subtree
+	std::vector<TriangleBlock4> blocks;
+	unsigned buildTime = 0;                //!< in milliseconds
 };
 
 class Mesh: public Geometry {
@@ -75,34 +248,150 @@ protected:
 	std::vector<Vector> normals;
 	std::vector<Vector> uvs;
 	std::vector<Triangle> triangles;
+	// the same, in compact form (only one of the two sets of arrays is used, see compactStorage):
+	std::vector<Float3> cVertices;
+	std::vector<unsigned> cNormals;  //!< octahedral-encoded, as two 16-bit fixed point numbers
+	std::vector<unsigned> cUVs;      //!< two half floats
+	std::vector<TriangleIndices> cTriangles; //!< the edges, normals etc. of the triangles are computed when needed
 	BBox bbox;
-	KDTreeNode* kdroot = nullptr;
+	std::vector<KDTreeNode> kdNodes; //!< the k-d tree; kdNodes[0] is the root (empty if there's no tree)
+	std::vector<int> kdTriangles;    //!< the triangle lists of all leaves in the k-d tree (only during the build)
+	std::vector<TriangleBlock4> kdBlocks; //!< the triangles of all leaves in the k-d tree, packed by packKDLeaves()
+	std::vector<std::unique_ptr<KDLazySubtree>> kdLazySubtrees; //!< the deferred subtrees (see lazyKD)
 	KDTreeStats kdstats;
+	BVH bvh;                         //!< the BVH over the triangles (only built if useBVH is on)
+	std::vector<TriangleBlock4> bvhBlocks; //!< the triangles of all leaves in the BVH
+	std::vector<int> bvhLeafBlocks;  //!< index of the first block in bvhBlocks of the BVH leaf, which starts at a given primitive
+	std::atomic<long long> statRays { 0 }, statNodesVisited { 0 }; //!< traversal statistics (see collectStats)
+	std::atomic<long long> statTestsAvoided { 0 }; //!< repeated triangle tests, skipped thanks to the mailbox
+	// the out-of-core geometry (see outOfCore):
+	MappedFile clusterFile;
+	std::vector<MeshCluster> clusters;
+	BVH clusterBVH;                  //!< the top-level BVH over the clusters, which stays in memory
+	std::vector<std::unique_ptr<Mesh>> lods; //!< the simplified versions of the mesh (see lodLevels)
+	std::vector<double> lodErrors;   //!< the geometric error of each of them, in object space
+
+	// access to the geometry, regardless of the storage mode:
+	int getNumVertices() const { return int(compactStorage ? cVertices.size() : vertices.size()); }
+	int getNumNormals() const { return int(compactStorage ? cNormals.size() : normals.size()); }
+	int getNumUVs() const { return int(compactStorage ? cUVs.size() : uvs.size()); }
+	int getNumTriangles() const { return int(compactStorage ? cTriangles.size() : triangles.size()); }
+	Vector getVertex(int idx) const { return compactStorage ? cVertices[idx].toVector() : vertices[idx]; }
+	Vector getNormal(int idx) const;
+	Vector getUV(int idx) const;
+	const TriangleIndices& getTriangle(int triIdx) const
+	{
+		return compactStorage ? cTriangles[triIdx] : triangles[triIdx];
+	}
+	Vector getTriangleVertex(int triIdx, int j) const { return getVertex(getTriangle(triIdx).v[j]); }
+	void addVertex(const Vector& v);
+	void addNormal(const Vector& n);
+	void addUV(const Vector& uv);
+	void addTriangle(const TriangleIndices& t);
+	void resizeArrays(int numVertices, int numNormals, int numUVs, int numTriangles);
+	void storeVertex(int idx, const Vector& v);
+	void storeNormal(int idx, const Vector& n);
+	void storeUV(int idx, const Vector& uv);
+	void storeTriangle(int idx, const TriangleIndices& t);
+	size_t getGeometryMemory() const;
+	size_t getAccelerationMemory() const;
 
 	void computeBoundingGeometry();
-	bool intersectTriangle(const Ray& ray, const Triangle& t, IntersectionInfo& info);
+	bool testTriangle(const Ray& ray, int triIdx, double& dist, double& lambda2, double& lambda3);
+	bool testTriangle(const Ray& ray, const MeshCluster& cluster, int triIdx, double& dist, double& lambda2, double& lambda3);
+	void storeTriangleHit(const TriangleHit& hit, double dist, IntersectionInfo& info);
+	void packTriangleBlocks(const int* triList, int count, std::vector<TriangleBlock4>& blocks);
+	void collectTriangleHit(const Ray& ray, int cluster, int triIdx, double maxDist, HitList& hits);
+	bool intersectTriangleBlocks(const Ray& ray, const TriangleBlockRay& blockRay, const TriangleBlock4* blocks,
+	                             int count, double& dist, TriangleHit& hit, TriangleMailbox* mailbox, bool anyHit,
+	                             int cluster = -1);
+	void shrinkArrays();
     void prepareTriangles();
+	void applyVertexOptions();
 
-	void buildKD(KDTreeNode* node, BBox bbox, const std::vector<int>& t_list, int depth);
-	bool intersectKD(KDTreeNode* node, const BBox& bbox, const Ray& ray, IntersectionInfo& info);
+	void buildKDParallel(const std::vector<int>& t_list);
+	void buildKDLazy(const std::vector<int>& t_list);
+	void buildKD(std::vector<KDTreeNode>& nodes, std::vector<int>& triIndices, int nodeIdx,
+	             const BBox& bbox, const std::vector<int>& t_list, int depth,
+	             KDTreeStats& stats, std::vector<KDBuildTask>* deferred = nullptr, int deferDepth = 0);
+	void spliceKDSubtree(const KDBuildTask& task);
+	void packKDLeaves(std::vector<KDTreeNode>& nodes, std::vector<int>& triIndices, std::vector<TriangleBlock4>& blocks);
+	const KDLazySubtree& getLazySubtree(const KDTreeNode& node);
+	void partitionKD(const BBox& L, const BBox& R, const std::vector<int>& t_list,
+	                 std::vector<int>& leftTris, std::vector<int>& rightTris, bool parallel);
+	bool findMidpointSplit(const BBox& bbox, const std::vector<int>& t_list, int depth, Axis& axis, double& splitPos);
+	bool findSAHSplit(const BBox& bbox, const std::vector<int>& t_list, int depth, Axis& axis, double& splitPos);
+	bool intersectKD(const Ray& ray, double& dist, TriangleHit& hit, int& nodesVisited,
+	                 TriangleMailbox& mailbox, bool anyHit);
+	bool traverseKD(const Ray& ray, const Vector& invDir, const KDTreeNode* nodes, const TriangleBlock4* blocks,
+	                int root, double tmin, double tmax, double& dist, TriangleHit& hit, int& nodesVisited,
+	                TriangleMailbox& mailbox, bool anyHit);
+	int intersectKDPacket(const RayPacket& packet, double dist[], TriangleHit hits[], int& nodesVisited,
+	                      TriangleMailbox mailboxes[], bool anyHit);
+	int findHitPacket(const RayPacket& packet, double dist[], TriangleHit hits[], bool anyHit);
+	void buildBVH();
+	bool intersectBVH(const Ray& ray, double& dist, TriangleHit& hit, int& nodesVisited, bool anyHit);
+	int getClusterFileFlags() const;
+	bool loadOutOfCore(const char* objFileName);
+	bool writeClusters(const char* fileName);
+	bool loadClusters(const char* fileName);
+	bool intersectClusters(const Ray& ray, double& dist, TriangleHit& hit, int& nodesVisited, bool anyHit);
+	bool findHit(const Ray& ray, double& dist, TriangleHit& hit, bool anyHit);
+	void buildLODs();
 public:
 	bool faceted = false;
 	bool backfaceCulling = false;
 	bool useKDTree = true;
+	bool useBVH = false;       //!< use a BVH instead of the k-d tree
+	bool collectStats = false; //!< count the acceleration structure nodes visited per ray, and print the average after the render
 	bool autoSmooth = false;
 	bool recenter = false;
-
-	~Mesh();
+	/// keep the geometry in single precision: float positions, octahedral-encoded normals and half-float UVs,
+	/// and compute the triangle edges, normals, etc. when needed, instead of storing them. This takes ~5x less
+	/// memory per triangle, at the cost of some precision and speed. (The BVH is also leaner than the k-d
+	/// tree here, as it doesn't duplicate triangles in its leaves)
+	bool compactStorage = false;
+	/// keep the geometry out of core: on the first load, the mesh is split into spatially coherent clusters,
+	/// which are written, along with their own small BVHs, to a file next to the .obj (with a .clusters
+	/// extension). The file is then memory-mapped, and the OS pages in the clusters, which the rays reach.
+	/// Later loads map the file directly, without parsing the .obj (unless it's newer, or the options differ)
+	bool outOfCore = false;
+	int clusterSize = 4096; //!< maximum triangles per cluster, for outOfCore
+	/// build only the top levels of the k-d tree in beginRender(); each subtree below them is built by the
+	/// first ray that reaches it. Meshes which are hidden or off-screen then cost next to nothing
+	bool lazyKD = false;
+	KDBuilder kdBuilder = KD_BUILDER_SAH;
+	/// build that many simplified versions of the mesh in beginRender(), each with its own acceleration
+	/// structure. Every Node, which uses the mesh, picks the level for the frame from its distance to the
+	/// camera (see Node::updateLOD() and GlobalSettings::lodPixelError)
+	int lodLevels = 0;
+	double lodRatio = 0.25; //!< the triangle count of each LOD, relative to the previous one
 
 	bool loadFromOBJ(const char* filename);
+	bool loadFromPLY(const char* filename);
+	bool loadFromFile(const char* filename); //!< loads an .obj or a .ply file, depending on the extension
 
 	void baseProperties(ParsedBlock& pb)
 	{
 		pb.getBoolProp("faceted", &faceted);
 		pb.getBoolProp("backfaceCulling", &backfaceCulling);
 		pb.getBoolProp("useKDTree", &useKDTree);
+		pb.getBoolProp("useBVH", &useBVH);
+		pb.getBoolProp("collectStats", &collectStats);
 		pb.getBoolProp("autoSmooth", &autoSmooth);
 		pb.getBoolProp("recenter", &recenter);
+		pb.getBoolProp("compactStorage", &compactStorage);
+		pb.getBoolProp("outOfCore", &outOfCore);
+		pb.getIntProp("clusterSize", &clusterSize, 64);
+		pb.getBoolProp("lazyKD", &lazyKD);
+		pb.getIntProp("lodLevels", &lodLevels, 0, 8);
+		pb.getDoubleProp("lodRatio", &lodRatio, 0.01, 0.9);
+		char builder[256];
+		if (pb.getStringProp("kdBuilder", builder)) {
+			if (!strcmp(builder, "sah")) kdBuilder = KD_BUILDER_SAH;
+			else if (!strcmp(builder, "midpoint")) kdBuilder = KD_BUILDER_MIDPOINT;
+			else pb.signalError("kdBuilder must be either `sah' or `midpoint'");
+		}
 	}
 
 	void fillProperties(ParsedBlock& pb)
@@ -110,8 +399,10 @@ public:
 		char fn[256];
 		baseProperties(pb);
 		if (pb.getFilenameProp("file", fn)) {
-			if (!loadFromOBJ(fn)) {
-				pb.signalError("Could not parse OBJ file!");
+			if (outOfCore) {
+				if (!loadOutOfCore(fn)) pb.signalError("Could not prepare the out-of-core mesh!");
+			} else if (!loadFromFile(fn)) {
+				pb.signalError(extensionUpper(fn) == "PLY" ? "Could not parse PLY file!" : "Could not parse OBJ file!");
 			}
 		} else {
 			pb.requiredProp("file");
@@ -119,6 +410,20 @@ public:
 	}
 
 	void beginRender();
+	void endRender();
 
 	virtual bool intersect(const Ray& ray, IntersectionInfo& info) override;
+	virtual void computeSurface(const Ray& ray, IntersectionInfo& info) override;
+	virtual bool occluded(const Ray& ray, double maxDist) override;
+	virtual int intersectPacket(const RayPacket& packet, IntersectionInfo infos[]) override;
+	virtual int occludedPacket(const RayPacket& packet) override;
+	virtual void intersectAll(const Ray& ray, HitList& hits) override;
+	virtual bool getBBox(BBox& bbox) override
+	{
+		bbox = this->bbox;
+		return !bbox.isEmpty();
+	}
+	virtual int getNumLODs() override { return 1 + int(lods.size()); }
+	virtual Geometry* getLOD(int level) override { return level ? lods[level - 1].get() : this; }
+	virtual double getLODError(int level) override { return level ? lodErrors[level - 1] : 0; }
 };
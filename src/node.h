@@ -28,13 +28,38 @@
 #include "shading.h"
 #include "matrix.h"
 
+/// a per-sample random number in [0, 1), which decides between the two levels of detail, blended by
+/// Node::lodBlend. It's the same for all the rays of a sample (primary, shadow, secondary), so that
+/// they all see the same geometry. The renderer sets it (defined in geometry.cpp)
+extern thread_local float lodDither;
+
 struct Node: public Intersectable, public SceneElement {
 	Geometry* geom;
 	Shader* shader;
 	Transform T;
 	Texture* bump = nullptr;
+	int lodLevel = 0;     //!< the level of detail of the geometry for this frame (see updateLOD())
+	float lodBlend = 0;   //!< the fraction of the rays, which use the next (coarser) level instead
 
+	/// classifies the transform, so that the intersection uses the fastest path for it
+	virtual void beginFrame() override;
 	virtual bool intersect(const Ray& ray, IntersectionInfo& info) override;
+	virtual void computeSurface(const Ray& ray, IntersectionInfo& info) override;
+	virtual bool occluded(const Ray& ray, double maxDist) override;
+	virtual int intersectPacket(const RayPacket& packet, IntersectionInfo infos[]) override;
+	virtual int occludedPacket(const RayPacket& packet) override;
+	/// gets the bounding box of the node in world space (i.e., of the transformed geometry)
+	/// @returns false if the geometry is unbounded
+	bool getWorldBBox(BBox& bbox);
+	/// picks the level of detail for the frame: the coarsest one, whose error is below maxPixelError pixels,
+	/// as seen from the camera (pixelSize is the angular size of a pixel, see Camera::getPixelSize())
+	void updateLOD(const Vector& cameraPos, double pixelSize, double maxPixelError);
+	/// the geometry to intersect with the current ray (see lodDither)
+	Geometry* selectLOD() const
+	{
+		int level = lodLevel + (lodDither < lodBlend ? 1 : 0);
+		return level ? geom->getLOD(level) : geom;
+	}
 	//
 	virtual ElementType getElementType() const override { return ELEM_NODE; }
 	void fillProperties(ParsedBlock& pb)
@@ -0,0 +1,295 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2024 by Veselin Georgiev, Slavomir Kaslev,         *
+ *                              Deyan Hadzhiev et al                       *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File primgroups.cpp
+ * @Brief Implementation of the primitive groups and their SIMD filters
+ */
+
+#include <math.h>
+#include <typeinfo>
+#include <algorithm>
+#include "primgroups.h"
+#include "bvh.h"
+#include "node.h"
+#include "constants.h"
+
+// tolerance of the float test in filterSpheres(), relative to the distance from the ray origin to the
+// sphere center (and to the radius). It keeps the test conservative:
+static const float SPHERE_EPS = 1e-3f;
+
+/**
+ * The SIMD part of the leaf intersection: a float test of a ray against four consecutive spheres of the
+ * SoA arrays. Like filterTriangleBlock(), it's only a filter, which may let through a few spheres, that the
+ * exact test rejects. The distance from the center to the ray is computed as |H - (H.dir) dir|, rather than
+ * from H.H - (H.dir)^2, which would lose all precision in floats, for spheres far away from the ray origin.
+ * @returns a bitmask of the lanes, which are (possibly) hit before maxDist
+ */
+int filterSpheres(const FloatRay& ray, const float* x, const float* y, const float* z, const float* r, float maxDist)
+{
+#ifdef BVH_USE_SSE
+	__m128 dx = _mm_set1_ps(ray.dir[0]), dy = _mm_set1_ps(ray.dir[1]), dz = _mm_set1_ps(ray.dir[2]);
+	// H = center - org; the ray gets closest to the center at t = H.dir:
+	__m128 hx = _mm_sub_ps(_mm_loadu_ps(x), _mm_set1_ps(ray.org[0]));
+	__m128 hy = _mm_sub_ps(_mm_loadu_ps(y), _mm_set1_ps(ray.org[1]));
+	__m128 hz = _mm_sub_ps(_mm_loadu_ps(z), _mm_set1_ps(ray.org[2]));
+	__m128 t = _mm_add_ps(_mm_add_ps(_mm_mul_ps(hx, dx), _mm_mul_ps(hy, dy)), _mm_mul_ps(hz, dz));
+	__m128 qx = _mm_sub_ps(hx, _mm_mul_ps(t, dx));
+	__m128 qy = _mm_sub_ps(hy, _mm_mul_ps(t, dy));
+	__m128 qz = _mm_sub_ps(hz, _mm_mul_ps(t, dz));
+	__m128 dist2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(qx, qx), _mm_mul_ps(qy, qy)), _mm_mul_ps(qz, qz));
+	__m128 signMask = _mm_set1_ps(-0.0f);
+	__m128 radius = _mm_loadu_ps(r);
+	__m128 hScale = _mm_add_ps(_mm_add_ps(_mm_andnot_ps(signMask, hx), _mm_andnot_ps(signMask, hy)), _mm_andnot_ps(signMask, hz));
+	__m128 reach = _mm_add_ps(radius, _mm_mul_ps(_mm_add_ps(hScale, radius), _mm_set1_ps(SPHERE_EPS)));
+	__m128 mask = _mm_cmple_ps(dist2, _mm_mul_ps(reach, reach));
+	// the hits are within [t - radius, t + radius]:
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(_mm_add_ps(t, reach), _mm_setzero_ps()));
+	mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_sub_ps(t, reach), _mm_set1_ps(maxDist)));
+	return _mm_movemask_ps(mask);
+#else
+	int mask = 0;
+	for (int i = 0; i < 4; i++) {
+		float hx = x[i] - ray.org[0], hy = y[i] - ray.org[1], hz = z[i] - ray.org[2];
+		float t = hx * ray.dir[0] + hy * ray.dir[1] + hz * ray.dir[2];
+		float qx = hx - t * ray.dir[0], qy = hy - t * ray.dir[1], qz = hz - t * ray.dir[2];
+		float dist2 = qx * qx + qy * qy + qz * qz;
+		float reach = r[i] + (fabsf(hx) + fabsf(hy) + fabsf(hz) + r[i]) * SPHERE_EPS;
+		if (dist2 <= reach * reach && t + reach >= 0 && t - reach <= maxDist)
+			mask |= 1 << i;
+	}
+	return mask;
+#endif
+}
+
+
+// the float boxes are padded by that much, relative to their size and distance from the world origin, so that
+// the slab test in filterBoxes() doesn't miss the hits, which the exact one finds:
+static const double BOX_EPS = 1e-5;
+
+/**
+ * The slab test of a ray against four boxes, in floats: the same as BBox::intersect(), but for all lanes at once
+ * and without branches. The far distances are scaled up a bit (as in BVH::traverseNodes()), to stay conservative.
+ */
+int filterBoxes(const FloatRay& ray, const float* const vmin[3], const float* const vmax[3], float maxDist)
+{
+	const float FAR_SCALE = 1.0000004f;
+#ifdef BVH_USE_SSE
+	__m128 tNear = _mm_setzero_ps(), tFar = _mm_set1_ps(maxDist);
+	for (int dim = 0; dim < 3; dim++) {
+		__m128 org = _mm_set1_ps(ray.org[dim]), invDir = _mm_set1_ps(ray.invDir[dim]);
+		__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(vmin[dim]), org), invDir);
+		__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(vmax[dim]), org), invDir);
+		tNear = _mm_max_ps(tNear, _mm_min_ps(t0, t1));
+		tFar = _mm_min_ps(tFar, _mm_max_ps(t0, t1));
+	}
+	return _mm_movemask_ps(_mm_cmple_ps(tNear, _mm_mul_ps(tFar, _mm_set1_ps(FAR_SCALE))));
+#else
+	int mask = 0;
+	for (int i = 0; i < 4; i++) {
+		float tNear = 0, tFar = maxDist;
+		for (int dim = 0; dim < 3; dim++) {
+			float t0 = (vmin[dim][i] - ray.org[dim]) * ray.invDir[dim];
+			float t1 = (vmax[dim][i] - ray.org[dim]) * ray.invDir[dim];
+			tNear = std::max(tNear, std::min(t0, t1));
+			tFar = std::min(tFar, std::max(t0, t1));
+		}
+		if (tNear <= tFar * FAR_SCALE) mask |= 1 << i;
+	}
+	return mask;
+#endif
+}
+
+/// the blocks are the leaves of a BVH over the primitives, so the SAH decides how many go together (fewer where
+/// they are sparse). The tree itself is discarded, as the blocks go into the scene BVH
+void PrimitiveGroup::buildBlocks(const std::vector<BBox>& boxes, std::vector<int>& order)
+{
+	BVH bvh;
+	bvh.build(boxes, 4);
+	order = bvh.getPrimIndices();
+	blocks.clear();
+	blockBoxes.clear();
+	bvh.forEachLeaf([&] (int first, int count) {
+		BBox bbox;
+		bbox.makeEmpty();
+		for (int i = first; i < first + count; i++) bbox.extend(boxes[order[i]]);
+		blocks.push_back({ first, count });
+		blockBoxes.push_back(bbox);
+	});
+	sortPrims(nodes, order);
+}
+
+Node* PrimitiveGroup::intersectBlock(const Ray& ray, const FloatRay& floatRay, int block, double& maxDist,
+                                     IntersectionInfo& info) const
+{
+	int first = blocks[block].first, count = blocks[block].count;
+	int mask = filterBlock(floatRay, block, float(std::min(maxDist, 1e20)));
+	mask &= (1 << count) - 1; // (the lanes past the block belong to the next one)
+	Node* closestNode = nullptr;
+	for (int lane = 0; mask; lane++, mask >>= 1) {
+		if (!(mask & 1)) continue;
+		// the same test and comparison as in Scene::findClosestIntersection(), for an ungrouped node:
+		Node* node = nodes[first + lane];
+		IntersectionInfo nodeInfo;
+		if (node->intersect(ray, nodeInfo) && nodeInfo.dist < maxDist) {
+			info = nodeInfo;
+			maxDist = nodeInfo.dist;
+			closestNode = node;
+		}
+	}
+	return closestNode;
+}
+
+bool PrimitiveGroup::occludedBlock(const Ray& ray, const FloatRay& floatRay, int block, double maxDist) const
+{
+	int first = blocks[block].first, count = blocks[block].count;
+	int mask = filterBlock(floatRay, block, float(std::min(maxDist, 1e20)));
+	mask &= (1 << count) - 1;
+	for (int lane = 0; mask; lane++, mask >>= 1)
+		if ((mask & 1) && nodes[first + lane]->occluded(ray, maxDist)) return true;
+	return false;
+}
+
+//
+// SphereGroup:
+//
+bool SphereGroup::getWorldSphere(const Node* node, Vector& center, double& radius)
+{
+	// only plain nodes: the derived ones (e.g. InstanceArray) intersect their geometry in other ways
+	if (typeid(*node) != typeid(Node) || !node->geom || typeid(*node->geom) != typeid(Sphere)) return false;
+	const Sphere* sphere = static_cast<const Sphere*>(node->geom);
+	// the transform must keep the sphere a sphere, i.e. be a rotation and a uniform scale (plus translation):
+	const Matrix& m = node->T.m;
+	Vector rows[3];
+	for (int i = 0; i < 3; i++) rows[i] = Vector(m.m[i][0], m.m[i][1], m.m[i][2]);
+	double scale2 = rows[0].lengthSqr();
+	if (!(scale2 > 0)) return false;
+	for (int i = 0; i < 3; i++) {
+		if (fabs(rows[i].lengthSqr() - scale2) > 1e-9 * scale2) return false;
+		if (fabs(dot(rows[i], rows[(i + 1) % 3])) > 1e-9 * scale2) return false;
+	}
+	center = node->T.transformPoint(sphere->O);
+	radius = sphere->R * sqrt(scale2);
+	return true;
+}
+
+void SphereGroup::build(const std::vector<Node*>& groupNodes)
+{
+	nodes = groupNodes;
+	int n = int(nodes.size());
+	centers.resize(n);
+	radii.resize(n);
+	std::vector<BBox> boxes(n);
+	for (int i = 0; i < n; i++) {
+		getWorldSphere(nodes[i], centers[i], radii[i]);
+		double r = radii[i];
+		boxes[i].vmin = centers[i] - Vector(r, r, r);
+		boxes[i].vmax = centers[i] + Vector(r, r, r);
+	}
+	std::vector<int> order;
+	buildBlocks(boxes, order);
+	sortPrims(centers, order);
+	sortPrims(radii, order);
+	// the float copies for the filter. The last block may read up to 3 spheres past the end, so these get a
+	// radius, which no ray can hit (as in SphereCloud):
+	for (std::vector<float>* values: { &x, &y, &z, &r }) values->assign(n + 3, 0.0f);
+	for (int i = 0; i < n; i++) {
+		x[i] = float(centers[i].x);
+		y[i] = float(centers[i].y);
+		z[i] = float(centers[i].z);
+		r[i] = float(radii[i]);
+	}
+	for (int i = n; i < n + 3; i++) r[i] = -1;
+}
+
+int SphereGroup::filterBlock(const FloatRay& ray, int block, float maxDist) const
+{
+	int first = blocks[block].first;
+	return filterSpheres(ray, &x[first], &y[first], &z[first], &r[first], maxDist);
+}
+
+bool SphereGroup::isUpToDate() const
+{
+	for (int i = 0; i < int(nodes.size()); i++) {
+		Vector center;
+		double radius;
+		if (!getWorldSphere(nodes[i], center, radius) || center != centers[i] || radius != radii[i]) return false;
+	}
+	return true;
+}
+
+//
+// CubeGroup:
+//
+bool CubeGroup::getWorldBox(const Node* node, BBox& box)
+{
+	if (typeid(*node) != typeid(Node) || !node->geom || typeid(*node->geom) != typeid(Cube)) return false;
+	const Cube* cube = static_cast<const Cube*>(node->geom);
+	// the transform must keep the cube axis-aligned, with its sides facing the same way (so that the side
+	// numbers, and Cube::computeSurface(), work in object space as well):
+	const Matrix& m = node->T.m;
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 3; j++)
+			if (i == j ? !(m.m[i][j] > 0) : m.m[i][j] != 0) return false;
+	double h = cube->side * 0.5;
+	box.vmin = node->T.transformPoint(cube->O - Vector(h, h, h));
+	box.vmax = node->T.transformPoint(cube->O + Vector(h, h, h));
+	return true;
+}
+
+void CubeGroup::build(const std::vector<Node*>& groupNodes)
+{
+	nodes = groupNodes;
+	int n = int(nodes.size());
+	boxes.resize(n);
+	for (int i = 0; i < n; i++) getWorldBox(nodes[i], boxes[i]);
+	std::vector<int> order;
+	buildBlocks(boxes, order);
+	sortPrims(boxes, order);
+	// the padded float copies for the filter, plus 3 (unused) ones for the last block to read:
+	for (int k = 0; k < 2; k++)
+		for (int dim = 0; dim < 3; dim++)
+			bounds[k][dim].assign(n + 3, 0.0f);
+	for (int i = 0; i < n; i++) {
+		for (int dim = 0; dim < 3; dim++) {
+			double lo = boxes[i].vmin[dim], hi = boxes[i].vmax[dim];
+			double pad = (hi - lo + std::max(fabs(lo), fabs(hi))) * BOX_EPS;
+			bounds[0][dim][i] = float(lo - pad);
+			bounds[1][dim][i] = float(hi + pad);
+		}
+	}
+}
+
+int CubeGroup::filterBlock(const FloatRay& ray, int block, float maxDist) const
+{
+	int first = blocks[block].first;
+	const float* vmin[3] = { &bounds[0][0][first], &bounds[0][1][first], &bounds[0][2][first] };
+	const float* vmax[3] = { &bounds[1][0][first], &bounds[1][1][first], &bounds[1][2][first] };
+	return filterBoxes(ray, vmin, vmax, maxDist);
+}
+
+bool CubeGroup::isUpToDate() const
+{
+	for (int i = 0; i < int(nodes.size()); i++) {
+		BBox box;
+		if (!getWorldBox(nodes[i], box) || box.vmin != boxes[i].vmin || box.vmax != boxes[i].vmax) return false;
+	}
+	return true;
+}
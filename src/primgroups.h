@@ -0,0 +1,157 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2024 by Veselin Georgiev, Slavomir Kaslev,         *
+ *                              Deyan Hadzhiev et al                       *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File primgroups.h
+ * @Brief Groups of analytic primitives (spheres, cubes), intersected together with SIMD kernels
+ */
+#pragma once
+
+#include <vector>
+#include "vector.h"
+#include "bbox.h"
+#include "geometry.h"
+
+struct Node;
+
+/// the smallest number of nodes with the same primitive, which the scene puts into a group
+/// (below that, they are intersected one by one, as the other nodes)
+const int MIN_PRIMITIVE_GROUP_SIZE = 8;
+
+/// a ray, converted to floats for the SIMD filters below
+struct FloatRay {
+	float org[3], dir[3], invDir[3];
+
+	FloatRay() {}
+	FloatRay(const Ray& ray)
+	{
+		Vector inv = inverseDirection(ray.dir);
+		for (int dim = 0; dim < 3; dim++) {
+			org[dim] = float(ray.start[dim]);
+			dir[dim] = float(ray.dir[dim]);
+			invDir[dim] = float(inv[dim]);
+		}
+	}
+};
+
+/**
+ * The SIMD filter for four spheres, given in SoA layout (x[0..3], y[0..3], ...). Like filterTriangleBlock(),
+ * it's conservative: it may let through a few spheres, which the exact test (testSphere()) rejects.
+ * @returns a bitmask of the lanes, which are (possibly) hit before maxDist
+ */
+int filterSpheres(const FloatRay& ray, const float* x, const float* y, const float* z, const float* r, float maxDist);
+
+/// the same for four axis-aligned boxes, given by their SoA min and max corners; a slab test
+int filterBoxes(const FloatRay& ray, const float* const vmin[3], const float* const vmax[3], float maxDist);
+
+/// the exact test of a single sphere, with the same choice of root as Sphere::intersect().
+/// @returns true if the sphere is hit before dist (and updates it)
+inline bool testSphere(const Ray& ray, const Vector& center, double radius, double& dist)
+{
+	double A = ray.dir.lengthSqr();
+	Vector H = ray.start - center;
+	double B = 2 * dot(ray.dir, H);
+	double C = H.lengthSqr() - radius * radius;
+	double D = B * B - 4 * A * C;
+	if (D < 0) return false;
+	double sqrtD = sqrt(D);
+	double p1 = (-B - sqrtD) / (2 * A);
+	double p2 = (-B + sqrtD) / (2 * A);
+	double p = (p1 < 0) ? p2 : p1;
+	if (p < 0 || p >= dist) return false;
+	dist = p;
+	return true;
+}
+
+/**
+ * @Brief A set of scene nodes with the same kind of analytic primitive, in world space
+ *
+ * The primitives are stored with their node transforms already applied, in SoA arrays, and split into small
+ * spatially coherent blocks (of up to four primitives). The blocks go into the scene BVH, next to the other
+ * nodes, so the rays still visit everything front to back, in a single traversal. A block is intersected with
+ * one call of the SIMD filter, and only its candidates get the exact test; there are no virtual calls or ray
+ * transforms for the rest of the nodes.
+ * The candidates of the filter are then intersected by their nodes, with Node::intersect() or Node::occluded(),
+ * so the hits are exactly the ones, which the nodes give when they are not grouped (a world-space test would
+ * round differently, and the two would disagree on a few grazing rays).
+ */
+class PrimitiveGroup {
+protected:
+	struct Block {
+		int first, count; //!< the range of the primitives in the sorted arrays
+	};
+	std::vector<Node*> nodes;   //!< in block order
+	std::vector<Block> blocks;
+	std::vector<BBox> blockBoxes;
+
+	/// splits the primitives (with the given world-space boxes) into blocks; afterwards, the primitives must be
+	/// stored in the returned order (see sortPrims())
+	void buildBlocks(const std::vector<BBox>& boxes, std::vector<int>& order);
+	/// the SIMD filter of a block. @returns a bitmask of the primitives, which the ray may hit before maxDist
+	virtual int filterBlock(const FloatRay& ray, int block, float maxDist) const = 0;
+	/// reorders an array of per-primitive values in block order
+	template<typename T>
+	static void sortPrims(std::vector<T>& values, const std::vector<int>& order)
+	{
+		std::vector<T> sorted;
+		sorted.reserve(order.size());
+		for (int idx: order) sorted.push_back(values[idx]);
+		values.swap(sorted);
+	}
+public:
+	virtual ~PrimitiveGroup() {}
+	int size() const { return int(nodes.size()); }
+	int getNumBlocks() const { return int(blocks.size()); }
+	const BBox& getBlockBBox(int block) const { return blockBoxes[block]; }
+	/// finds the closest hit in a block, before maxDist; updates maxDist and info then
+	/// @returns the node, which was hit, or nullptr
+	Node* intersectBlock(const Ray& ray, const FloatRay& floatRay, int block, double& maxDist, IntersectionInfo& info) const;
+	bool occludedBlock(const Ray& ray, const FloatRay& floatRay, int block, double maxDist) const;
+};
+
+/// the nodes, whose geometry is a Sphere, and whose transform keeps it a sphere
+class SphereGroup: public PrimitiveGroup {
+	std::vector<float> x, y, z, r; //!< the world-space spheres, in block order, plus 3 unused ones (r = -1) at the end
+	std::vector<Vector> centers;   //!< the same, in double precision (see isUpToDate())
+	std::vector<double> radii;
+
+	int filterBlock(const FloatRay& ray, int block, float maxDist) const override;
+public:
+	/// checks whether a node can go into the group, and finds its world-space sphere
+	static bool getWorldSphere(const Node* node, Vector& center, double& radius);
+
+	void build(const std::vector<Node*>& nodes);
+	/// checks whether the nodes are still where the group has them (their transforms may change between frames)
+	bool isUpToDate() const;
+};
+
+/// the nodes, whose geometry is a Cube, and whose transform only scales (positively) and translates it
+class CubeGroup: public PrimitiveGroup {
+	std::vector<float> bounds[2][3]; //!< bounds[0 = min, 1 = max][axis]: the padded world-space boxes, in block order, plus 3 unused ones
+	std::vector<BBox> boxes;         //!< the same, in double precision and unpadded (see isUpToDate())
+
+	int filterBlock(const FloatRay& ray, int block, float maxDist) const override;
+public:
+	/// checks whether a node can go into the group, and finds its world-space box
+	static bool getWorldBox(const Node* node, BBox& box);
+
+	void build(const std::vector<Node*>& nodes);
+	bool isUpToDate() const;
+};
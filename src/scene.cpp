@@ -41,6 +41,9 @@
 #include "environment.h"
 #include "mesh.h"
 #include "heightfield.h"
+#include "instancearray.h"
+#include "spherecloud.h"
+#include "primgroups.h"
 #include "util.h"
 #include "sdl.h"
 #include "mesh.h"
@@ -56,6 +59,7 @@ SceneElement::SceneElement()
 }
 void SceneElement::beginRender() {}
 void SceneElement::beginFrame() {}
+void SceneElement::endRender() {}
 void SceneElement::fillProperties(ParsedBlock& pb) {}
 
 class DefaultSceneParser;
@@ -754,11 +758,275 @@ void Scene::visitSceneElements(std::function<void(SceneElement*)> visitor)
 void Scene::beginRender()
 {
     visitSceneElements([](SceneElement* element) { element->beginRender(); });
+    buildNodeBVH();
 }
 
 void Scene::beginFrame()
 {
     visitSceneElements([](SceneElement* element) { element->beginFrame(); });
+    // (after the camera's beginFrame(), as this needs its position and pixel size):
+    for (auto& node: nodes) node->updateLOD(camera->pos, camera->getPixelSize(), settings.lodPixelError);
+    lodBlends.clear();
+    for (auto& node: nodes) if (node->lodBlend > 0) lodBlends.push_back(node->lodBlend);
+    std::sort(lodBlends.begin(), lodBlends.end());
+    lodBlends.erase(std::unique(lodBlends.begin(), lodBlends.end()), lodBlends.end());
+    updateNodeBVH();
+}
+
+void Scene::endRender()
+{
+    visitSceneElements([](SceneElement* element) { element->endRender(); });
+}
+
+bool Scene::getPaddedWorldBBox(Node* node, BBox& bbox)
+{
+	if (!node->getWorldBBox(bbox)) return false;
+	// pad slightly, so that flat objects (e.g. bounded planes) don't slip through due to roundoff:
+	bbox.vmin += Vector(-1e-6, -1e-6, -1e-6);
+	bbox.vmax += Vector(+1e-6, +1e-6, +1e-6);
+	return true;
+}
+
+/**
+ * Puts the nodes with analytic primitives (spheres and axis-aligned cubes) into groups, which are intersected
+ * together, with no virtual calls and no ray transforms per node (see primgroups.h). Only done, if there are
+ * enough of them to pay off.
+ */
+void Scene::buildPrimitiveGroups(std::vector<bool>& grouped)
+{
+	sphereGroup.reset();
+	cubeGroup.reset();
+	grouped.assign(nodes.size(), false);
+	if (!settings.groupPrimitives) return;
+	std::vector<int> spheres, cubes;
+	for (int i = 0; i < int(nodes.size()); i++) {
+		Vector center;
+		double radius;
+		BBox box;
+		if (SphereGroup::getWorldSphere(nodes[i], center, radius)) spheres.push_back(i);
+		else if (CubeGroup::getWorldBox(nodes[i], box)) cubes.push_back(i);
+	}
+	auto takeNodes = [&] (const std::vector<int>& indices) {
+		std::vector<Node*> groupNodes;
+		for (int i: indices) {
+			groupNodes.push_back(nodes[i]);
+			grouped[i] = true;
+		}
+		return groupNodes;
+	};
+	if (int(spheres.size()) >= MIN_PRIMITIVE_GROUP_SIZE) {
+		sphereGroup.reset(new SphereGroup);
+		sphereGroup->build(takeNodes(spheres));
+	}
+	if (int(cubes.size()) >= MIN_PRIMITIVE_GROUP_SIZE) {
+		cubeGroup.reset(new CubeGroup);
+		cubeGroup->build(takeNodes(cubes));
+	}
+}
+
+void Scene::buildNodeBVH()
+{
+	Uint32 startBuild = SDL_GetTicks();
+	std::vector<bool> grouped;
+	buildPrimitiveGroups(grouped);
+	boundedNodes.clear();
+	unboundedNodes.clear();
+	nodeBoxes.clear();
+	for (int i = 0; i < int(nodes.size()); i++) {
+		Node* node = nodes[i];
+		if (grouped[i]) continue;
+		BBox bbox;
+		if (getPaddedWorldBBox(node, bbox)) {
+			boundedNodes.push_back(node);
+			nodeBoxes.push_back(bbox);
+		} else {
+			unboundedNodes.push_back(node);
+		}
+	}
+	// the blocks of the primitive groups come after the nodes (see intersectGroupBlock()):
+	for (PrimitiveGroup* group: { (PrimitiveGroup*) sphereGroup.get(), (PrimitiveGroup*) cubeGroup.get() }) {
+		if (!group) continue;
+		for (int i = 0; i < group->getNumBlocks(); i++) {
+			BBox bbox = group->getBlockBBox(i);
+			bbox.vmin += Vector(-1e-6, -1e-6, -1e-6);
+			bbox.vmax += Vector(+1e-6, +1e-6, +1e-6);
+			nodeBoxes.push_back(bbox);
+		}
+	}
+	nodeBVH.build(nodeBoxes, 1);
+	nodeBVHBuildCost = nodeBVH.getSAHCost();
+	Uint32 endBuild = SDL_GetTicks();
+	printf("Scene BVH built in %.2fs (%d BVH nodes over %d scene nodes, %d unbounded)\n",
+		(endBuild - startBuild) / 1000.0, nodeBVH.getNumNodes(), int(boundedNodes.size()), int(unboundedNodes.size()));
+	if (sphereGroup || cubeGroup)
+		printf("Primitive groups: %d spheres, %d cubes, in %d blocks\n", sphereGroup ? sphereGroup->size() : 0,
+			cubeGroup ? cubeGroup->size() : 0, int(nodeBoxes.size() - boundedNodes.size()));
+}
+
+/**
+ * Brings the scene BVH up to date with the node transforms, which may have changed in beginFrame().
+ *
+ * The geometries' own acceleration structures are in object space, so they aren't affected by the
+ * transforms at all; only the top level, over the nodes, needs updating. It is refit in O(n), and
+ * only rebuilt from scratch if its quality has degraded too much (see GlobalSettings::bvhRebuildThreshold).
+ */
+void Scene::updateNodeBVH()
+{
+	// the groups keep their primitives in world space, so they are rebuilt (with the BVH), if any of them moved.
+	// Otherwise, their blocks keep their boxes, and only the other nodes are checked:
+	if ((sphereGroup && !sphereGroup->isUpToDate()) || (cubeGroup && !cubeGroup->isUpToDate())) {
+		buildNodeBVH();
+		return;
+	}
+	bool changed = false;
+	for (int i = 0; i < int(boundedNodes.size()); i++) {
+		BBox bbox;
+		if (!getPaddedWorldBBox(boundedNodes[i], bbox)) {
+			// the node's geometry no longer has a bbox, so the node can't stay in the BVH (and has to be tested always):
+			buildNodeBVH();
+			return;
+		}
+		if (bbox.vmin != nodeBoxes[i].vmin || bbox.vmax != nodeBoxes[i].vmax) {
+			nodeBoxes[i] = bbox;
+			changed = true;
+		}
+	}
+	if (!changed) return;
+	nodeBVH.refit(nodeBoxes);
+	if (nodeBVH.getSAHCost() > nodeBVHBuildCost * settings.bvhRebuildThreshold)
+		buildNodeBVH();
+}
+
+/**
+ * Intersects a ray with a block of the primitive groups; the blocks are numbered after the nodeBVH items of
+ * boundedNodes: first the ones of sphereGroup, then those of cubeGroup
+ */
+Node* Scene::intersectGroupBlock(int block, const Ray& ray, const FloatRay& floatRay, double& maxDist,
+                                 IntersectionInfo& info)
+{
+	if (sphereGroup) {
+		if (block < sphereGroup->getNumBlocks()) return sphereGroup->intersectBlock(ray, floatRay, block, maxDist, info);
+		block -= sphereGroup->getNumBlocks();
+	}
+	return cubeGroup->intersectBlock(ray, floatRay, block, maxDist, info);
+}
+
+bool Scene::occludedGroupBlock(int block, const Ray& ray, const FloatRay& floatRay, double maxDist)
+{
+	if (sphereGroup) {
+		if (block < sphereGroup->getNumBlocks()) return sphereGroup->occludedBlock(ray, floatRay, block, maxDist);
+		block -= sphereGroup->getNumBlocks();
+	}
+	return cubeGroup->occludedBlock(ray, floatRay, block, maxDist);
+}
+
+Node* Scene::findClosestIntersection(const Ray& ray, IntersectionInfo& closestInfo)
+{
+	Node* closestNode = nullptr;
+	double closestDist = INF;
+	auto tryNode = [&] (Node* node, double& maxDist) {
+		IntersectionInfo info;
+		if (node->intersect(ray, info) && info.dist < maxDist) {
+			closestInfo = info;
+			closestNode = node;
+			maxDist = info.dist;
+		}
+	};
+	for (auto& node: unboundedNodes) tryNode(node, closestDist);
+	FloatRay floatRay(ray);
+	nodeBVH.traverse(ray, closestDist, [&] (int nodeIdx, double& maxDist) {
+		if (nodeIdx < int(boundedNodes.size())) {
+			tryNode(boundedNodes[nodeIdx], maxDist);
+		} else {
+			Node* node = intersectGroupBlock(nodeIdx - int(boundedNodes.size()), ray, floatRay, maxDist, closestInfo);
+			if (node) closestNode = node;
+		}
+		return false;
+	});
+	return closestNode;
+}
+
+bool Scene::findAnyIntersection(const Ray& ray, double maxDist)
+{
+	for (auto& node: unboundedNodes) {
+		if (node->occluded(ray, maxDist)) return true;
+	}
+	FloatRay floatRay(ray);
+	bool found = false;
+	nodeBVH.traverse(ray, maxDist, [&] (int nodeIdx, double& maxDist) {
+		if (nodeIdx < int(boundedNodes.size()))
+			found = boundedNodes[nodeIdx]->occluded(ray, maxDist);
+		else
+			found = occludedGroupBlock(nodeIdx - int(boundedNodes.size()), ray, floatRay, maxDist);
+		return found;
+	});
+	return found;
+}
+
+void Scene::findClosestIntersections(const RayPacket& packet, IntersectionInfo infos[], Node* closestNodes[])
+{
+	RayPacket p = packet;
+	for (int i = 0; i < RayPacket::SIZE; i++) {
+		closestNodes[i] = nullptr;
+		p.maxDist[i] = INF;
+	}
+	auto tryNode = [&] (Node* node, int rayMask) {
+		IntersectionInfo nodeInfos[RayPacket::SIZE];
+		int activeMask = p.activeMask;
+		p.activeMask = rayMask;
+		int hitMask = node->intersectPacket(p, nodeInfos);
+		p.activeMask = activeMask;
+		for (int i = 0; i < RayPacket::SIZE; i++) if (hitMask & (1 << i)) {
+			infos[i] = nodeInfos[i];
+			closestNodes[i] = node;
+			p.maxDist[i] = nodeInfos[i].dist;
+		}
+	};
+	for (auto& node: unboundedNodes) tryNode(node, p.activeMask);
+	FloatRay floatRays[RayPacket::SIZE];
+	for (int i = 0; i < RayPacket::SIZE; i++) floatRays[i] = FloatRay(p.rays[i]);
+	nodeBVH.traversePacket(p, [&] (int nodeIdx, int rayMask) {
+		if (nodeIdx < int(boundedNodes.size())) {
+			tryNode(boundedNodes[nodeIdx], rayMask);
+			return 0;
+		}
+		// the primitive blocks are cheap enough to test the rays one by one:
+		int block = nodeIdx - int(boundedNodes.size());
+		for (int i = 0; i < RayPacket::SIZE; i++) if (rayMask & (1 << i)) {
+			Node* node = intersectGroupBlock(block, p.rays[i], floatRays[i], p.maxDist[i], infos[i]);
+			if (node) closestNodes[i] = node;
+		}
+		return 0;
+	});
+}
+
+int Scene::findAnyIntersections(const RayPacket& packet)
+{
+	RayPacket p = packet;
+	int occludedMask = 0;
+	for (auto& node: unboundedNodes) {
+		occludedMask |= node->occludedPacket(p);
+		p.activeMask &= ~occludedMask;
+	}
+	FloatRay floatRays[RayPacket::SIZE];
+	for (int i = 0; i < RayPacket::SIZE; i++) floatRays[i] = FloatRay(p.rays[i]);
+	nodeBVH.traversePacket(p, [&] (int nodeIdx, int rayMask) {
+		int blocked = 0;
+		if (nodeIdx < int(boundedNodes.size())) {
+			int activeMask = p.activeMask;
+			p.activeMask = rayMask;
+			blocked = boundedNodes[nodeIdx]->occludedPacket(p);
+			p.activeMask = activeMask;
+		} else {
+			int block = nodeIdx - int(boundedNodes.size());
+			for (int i = 0; i < RayPacket::SIZE; i++) if (rayMask & (1 << i)) {
+				if (occludedGroupBlock(block, p.rays[i], floatRays[i], p.maxDist[i])) blocked |= 1 << i;
+			}
+		}
+		occludedMask |= blocked;
+		return blocked;
+	});
+	return occludedMask;
 }
 
 void GlobalSettings::fillProperties(ParsedBlock& pb)
@@ -772,9 +1040,14 @@ void GlobalSettings::fillProperties(ParsedBlock& pb)
 	pb.getIntProp("prepassSamples", &prepassSamples, 0);
 	pb.getBoolProp("gi", &gi);
 	pb.getIntProp("numPaths", &numPaths, 1);
+	pb.getBoolProp("wavefront", &wavefront);
 	pb.getIntProp("numThreads", &numThreads, 0, 1024);
 	pb.getBoolProp("interactive", &interactive);
 	pb.getIntProp("foveatedRadius", &foveatedRadius, 0, 1000);
+	pb.getDoubleProp("bvhRebuildThreshold", &bvhRebuildThreshold, 1.0);
+	pb.getBoolProp("rayPackets", &rayPackets);
+	pb.getDoubleProp("lodPixelError", &lodPixelError, 0.0);
+	pb.getBoolProp("groupPrimitives", &groupPrimitives);
 }
 
 SceneElement* DefaultSceneParser::newSceneElement(const char* className)
@@ -799,6 +1072,8 @@ SceneElement* DefaultSceneParser::newSceneElement(const char* className)
 	if (!strcmp(className, "Camera")) return new Camera;
 	if (!strcmp(className, "Mesh")) return new Mesh;
 	if (!strcmp(className, "Heightfield")) return new Heightfield;
+	if (!strcmp(className, "InstanceArray")) return new InstanceArray;
+	if (!strcmp(className, "SphereCloud")) return new SphereCloud;
 	if (!strcmp(className, "BumpTexture")) return new BumpTexture;
 	if (!strcmp(className, "Bumps")) return new Bumps;
 	if (!strcmp(className, "Const")) return new Const;
@@ -25,10 +25,13 @@
 #pragma once
 
 #include <vector>
+#include <memory>
 #include <functional>
+#include <algorithm>
 #include <limits.h>
 #include "color.h"
 #include "vector.h"
+#include "bvh.h"
 
 enum ElementType {
 	ELEM_GEOMETRY,
@@ -52,6 +55,10 @@ class Camera;
 class Bitmap;
 class Light;
 struct Transform;
+struct IntersectionInfo;
+struct FloatRay;
+class SphereGroup;
+class CubeGroup;
 
 class ParsedBlock;
 
@@ -130,6 +137,14 @@ public:
 	 */
 	virtual void beginFrame();
 
+	/**
+	 * @brief a callback that gets called after the rendering is done
+	 *
+	 * Useful for printing statistics that are collected during the render. The order is
+	 * the same as in beginRender().
+	 */
+	virtual void endRender();
+
 	friend class SceneParser;
 };
 
@@ -258,11 +273,16 @@ struct GlobalSettings: public SceneElement {
 	// GI-related
 	bool gi = false;
 	int numPaths = 32;
+	bool wavefront = false;                       //!< use the wavefront path tracer (many paths, extended one bounce at a time) instead of pathtrace()
 
 	// System/interactivity:
 	int numThreads = 0;                           //!< num rendering threads, or use 0 to auto-detect
 	bool interactive = false;					  //!< render in interactive mode (accepting user input)
 	int foveatedRadius = 0;                       //!< render with foveated rendering. This describes the radius (0 disables the feature)
+	double bvhRebuildThreshold = 1.5;             //!< when nodes move, the scene BVH is refit, until its SAH cost gets that many times worse than after a full build
+	bool rayPackets = true;                       //!< trace the primary rays (and their shadow rays to point lights) in 2x2 pixel packets
+	double lodPixelError = 0.5;                   //!< the meshes with LODs use the coarsest one, whose error is below that many pixels
+	bool groupPrimitives = true;                  //!< intersect the sphere and cube nodes in groups, with SIMD kernels, instead of one by one (see primgroups.h)
 
 	void fillProperties(ParsedBlock& pb);
 	ElementType getElementType() const { return ELEM_SETTINGS; }
@@ -285,8 +305,43 @@ struct Scene {
 	bool parseScene(const char* sceneFile); //!< Parses a scene file and loads the scene from it. Returns true on success.
 	void beginRender(); //!< Notifies the scene so that a render is about to begin. It calls the beginRender() method of all scene elements
 	void beginFrame(); //!< Notifies the scene so that a new frame is about to begin. It calls the beginFrame() method of all scene elements
+	void endRender(); //!< Notifies the scene that the render is done. It calls the endRender() method of all scene elements
+
+	/// finds the closest intersection of a ray with the scene nodes (lights are not considered)
+	/// @returns the intersected node (and fills `info'), or nullptr if nothing is hit. Only info.dist and info.geom
+	/// are valid, until the node's computeSurface() is called
+	Node* findClosestIntersection(const Ray& ray, IntersectionInfo& info);
+	/// checks whether a ray hits any scene node at a distance smaller than maxDist (lights are not considered)
+	bool findAnyIntersection(const Ray& ray, double maxDist);
+	/// the packet version of findClosestIntersection(): for each active ray, fills closestNodes[i] (nullptr if
+	/// nothing is hit) and infos[i]. The rays traverse the scene BVH together (packet.maxDist is ignored)
+	void findClosestIntersections(const RayPacket& packet, IntersectionInfo infos[], Node* closestNodes[]);
+	/// the packet version of findAnyIntersection(): returns the mask of the active rays, which hit a node before packet.maxDist[i]
+	int findAnyIntersections(const RayPacket& packet);
+	/// rays, whose lodDither-s give the same class, select the same LODs in all nodes in this frame, so they
+	/// can be traced together, with either of the dithers (see Node::selectLOD())
+	int getLODClass(float dither) const
+	{
+		return int(std::upper_bound(lodBlends.begin(), lodBlends.end(), dither) - lodBlends.begin());
+	}
 
 private:
+	BVH nodeBVH;                      //!< BVH over the world-space bounds of boundedNodes (and the primitive group blocks); built in beginRender()
+	std::vector<Node*> boundedNodes;  //!< the nodes, indexed by the nodeBVH primitive indices
+	std::vector<Node*> unboundedNodes;//!< nodes that cannot be bounded (e.g. infinite planes); these are always tested
+	std::vector<BBox> nodeBoxes;      //!< the world-space bounds of boundedNodes, as last seen by nodeBVH
+	double nodeBVHBuildCost = 0;      //!< the SAH cost of nodeBVH right after it was built
+	std::vector<float> lodBlends;     //!< the distinct nonzero Node::lodBlend-s of this frame, sorted (see getLODClass())
+	std::unique_ptr<SphereGroup> sphereGroup; //!< the nodes, which are plain spheres in world space (not in boundedNodes then);
+	                                          //!< their blocks are in nodeBVH, after boundedNodes
+	std::unique_ptr<CubeGroup> cubeGroup;     //!< the same for the axis-aligned cubes
+
+	void buildNodeBVH();
+	void updateNodeBVH();
+	void buildPrimitiveGroups(std::vector<bool>& grouped);
+	Node* intersectGroupBlock(int block, const Ray& ray, const FloatRay& floatRay, double& maxDist, IntersectionInfo& info);
+	bool occludedGroupBlock(int block, const Ray& ray, const FloatRay& floatRay, double maxDist);
+	bool getPaddedWorldBBox(Node* node, BBox& bbox);
 	void visitSceneElements(std::function<void(SceneElement*)> callback);
 };
 
@@ -43,6 +43,9 @@ public:
 class Shader: public SceneElement, public BRDF {
 public:
     virtual Color computeColor(const Ray& ray, const IntersectionInfo& info) = 0;
+	/// whether computeColor() checks the visibility of the light samples (used to trace these shadow rays
+	/// ahead of time, in packets)
+	virtual bool usesShadowRays() const { return false; }
 	virtual ElementType getElementType() const override { return ELEM_SHADER; }
 };
 
@@ -97,6 +100,7 @@ public:
     Color diffuse = Color(0.5, 0.5, 0.5);
     Texture* diffuseTex = nullptr;
     virtual Color computeColor(const Ray& ray, const IntersectionInfo& info) override;
+	virtual bool usesShadowRays() const override { return true; }
 	void fillProperties(ParsedBlock& pb)
 	{
 		pb.getColorProp("color", &diffuse);
@@ -173,6 +177,11 @@ class Layered: public Shader {
 public:
     void addLayer(Shader* shader, Color blend = Color(1, 1, 1), Texture* blendTex = nullptr);
     virtual Color computeColor(const Ray& ray, const IntersectionInfo& info) override;
+	virtual bool usesShadowRays() const override
+	{
+		for (auto& layer: m_layers) if (layer.shader->usesShadowRays()) return true;
+		return false;
+	}
 	void fillProperties(ParsedBlock& pb);
 };
 
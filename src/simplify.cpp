@@ -0,0 +1,248 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2024 by Veselin Georgiev, Slavomir Kaslev,         *
+ *                              Deyan Hadzhiev et al                       *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File simplify.cpp
+ * @Brief Implementation of the quadric error metric mesh simplifier
+ */
+
+#include <algorithm>
+#include <unordered_map>
+#include <math.h>
+#include "simplify.h"
+
+static const double BOUNDARY_WEIGHT = 10;     //!< how strongly the boundary edges are held in place
+static const double MIN_NORMAL_COSINE = 0.2;  //!< collapses may not turn a triangle by more than ~78 degrees
+
+Quadric::Quadric(const Vector& n, double d, double weight)
+{
+	a2 = n.x * n.x * weight; ab = n.x * n.y * weight; ac = n.x * n.z * weight; ad = n.x * d * weight;
+	b2 = n.y * n.y * weight; bc = n.y * n.z * weight; bd = n.y * d * weight;
+	c2 = n.z * n.z * weight; cd = n.z * d * weight;
+	d2 = d * d * weight;
+}
+
+void Quadric::operator += (const Quadric& q)
+{
+	a2 += q.a2; ab += q.ab; ac += q.ac; ad += q.ad;
+	b2 += q.b2; bc += q.bc; bd += q.bd;
+	c2 += q.c2; cd += q.cd;
+	d2 += q.d2;
+}
+
+double Quadric::evaluate(const Vector& p) const
+{
+	return a2 * p.x * p.x + 2 * ab * p.x * p.y + 2 * ac * p.x * p.z + 2 * ad * p.x
+	     + b2 * p.y * p.y + 2 * bc * p.y * p.z + 2 * bd * p.y
+	     + c2 * p.z * p.z + 2 * cd * p.z
+	     + d2;
+}
+
+bool Quadric::findOptimum(Vector& result) const
+{
+	// solve the 3x3 system, where the gradient is zero, with Cramer's rule:
+	double det = a2 * (b2 * c2 - bc * bc) - ab * (ab * c2 - bc * ac) + ac * (ab * bc - b2 * ac);
+	if (fabs(det) < 1e-10) return false;
+	double rx = -ad, ry = -bd, rz = -cd;
+	result.x = (rx * (b2 * c2 - bc * bc) - ab * (ry * c2 - bc * rz) + ac * (ry * bc - b2 * rz)) / det;
+	result.y = (a2 * (ry * c2 - bc * rz) - rx * (ab * c2 - bc * ac) + ac * (ab * rz - ry * ac)) / det;
+	result.z = (a2 * (b2 * rz - ry * bc) - ab * (ab * rz - ry * ac) + rx * (ab * bc - b2 * ac)) / det;
+	return true;
+}
+
+MeshSimplifier::MeshSimplifier(const std::vector<Vector>& positions, const std::vector<TriangleIndices>& triangles,
+                               const BBox& bbox):
+	positions(positions), triangles(triangles), bbox(bbox)
+{
+	int numVertices = int(positions.size());
+	quadrics.resize(numVertices);
+	stamps.assign(numVertices, 0);
+	vertexAlive.assign(numVertices, true);
+	vertexTriangles.resize(numVertices);
+	triangleAlive.assign(triangles.size(), true);
+	numTriangles = 0;
+	// the quadrics of the triangle planes, and the count of triangles on each edge:
+	std::unordered_map<long long, int> edgeCount;
+	auto edgeKey = [numVertices] (int a, int b) { return (long long) std::min(a, b) * numVertices + std::max(a, b); };
+	std::vector<Vector> faceNormals(triangles.size());
+	for (int i = 0; i < int(triangles.size()); i++) {
+		const int* v = triangles[i].v;
+		if (v[0] == v[1] || v[1] == v[2] || v[0] == v[2]) {
+			triangleAlive[i] = false;
+			continue;
+		}
+		numTriangles++;
+		Vector n = (positions[v[1]] - positions[v[0]]) ^ (positions[v[2]] - positions[v[0]]);
+		if (n.lengthSqr() > 1e-30) {
+			n.normalize();
+			Quadric q(n, -(n * positions[v[0]]));
+			for (int j = 0; j < 3; j++) quadrics[v[j]] += q;
+		}
+		faceNormals[i] = n;
+		for (int j = 0; j < 3; j++) {
+			vertexTriangles[v[j]].push_back(i);
+			edgeCount[edgeKey(v[j], v[(j + 1) % 3])]++;
+		}
+	}
+	// the boundary edges get a plane through them, perpendicular to their triangle, so that the
+	// outline of the mesh doesn't shrink:
+	for (int i = 0; i < int(triangles.size()); i++) if (triangleAlive[i] && faceNormals[i].lengthSqr() > 0) {
+		const int* v = triangles[i].v;
+		for (int j = 0; j < 3; j++) {
+			int a = v[j], b = v[(j + 1) % 3];
+			if (edgeCount[edgeKey(a, b)] != 1) continue;
+			Vector n = (positions[b] - positions[a]) ^ faceNormals[i];
+			if (n.lengthSqr() < 1e-30) continue;
+			n.normalize();
+			Quadric q(n, -(n * positions[a]), BOUNDARY_WEIGHT);
+			quadrics[a] += q;
+			quadrics[b] += q;
+		}
+	}
+	for (auto& edge: edgeCount)
+		addCollapse(int(edge.first / numVertices), int(edge.first % numVertices));
+}
+
+/// computes the best position and the cost of merging v1 into v0, and queues the collapse
+void MeshSimplifier::addCollapse(int v0, int v1)
+{
+	Quadric q = quadrics[v0];
+	q += quadrics[v1];
+	Collapse c;
+	c.v0 = v0;
+	c.v1 = v1;
+	c.stamp0 = stamps[v0];
+	c.stamp1 = stamps[v1];
+	if (q.findOptimum(c.target) && bbox.inside(c.target)) {
+		c.cost = q.evaluate(c.target);
+	} else {
+		// the optimum is ill-defined (e.g. on a flat or a straight part), or too far: pick the best of the
+		// endpoints and the midpoint
+		Vector candidates[3] = { positions[v0], positions[v1], (positions[v0] + positions[v1]) * 0.5 };
+		c.cost = INF;
+		for (auto& p: candidates) {
+			double cost = q.evaluate(p);
+			if (cost < c.cost) {
+				c.cost = cost;
+				c.target = p;
+			}
+		}
+	}
+	c.cost = std::max(0.0, c.cost); // (roundoff)
+	heap.push_back(c);
+	std::push_heap(heap.begin(), heap.end());
+}
+
+/// checks that merging v1 into v0 at `target' keeps the surface manifold, and doesn't flip or degenerate
+/// any of the remaining triangles
+bool MeshSimplifier::isValidCollapse(int v0, int v1, const Vector& target) const
+{
+	// the link condition: the only common neighbours of v0 and v1 are the opposite vertices of their shared triangles
+	std::vector<int> neighbours0;
+	int numShared = 0;
+	for (int t: vertexTriangles[v0]) if (triangleAlive[t]) {
+		const int* v = triangles[t].v;
+		bool shared = (v[0] == v1 || v[1] == v1 || v[2] == v1);
+		if (shared) numShared++;
+		for (int j = 0; j < 3; j++) if (v[j] != v0 && v[j] != v1) neighbours0.push_back(v[j]);
+	}
+	std::sort(neighbours0.begin(), neighbours0.end());
+	neighbours0.erase(std::unique(neighbours0.begin(), neighbours0.end()), neighbours0.end());
+	std::vector<int> common;
+	for (int t: vertexTriangles[v1]) if (triangleAlive[t]) {
+		const int* v = triangles[t].v;
+		for (int j = 0; j < 3; j++)
+			if (v[j] != v0 && v[j] != v1 && std::binary_search(neighbours0.begin(), neighbours0.end(), v[j]))
+				common.push_back(v[j]);
+	}
+	std::sort(common.begin(), common.end());
+	common.erase(std::unique(common.begin(), common.end()), common.end());
+	if (int(common.size()) > numShared) return false;
+	// the triangles, which survive the collapse, must keep their orientation:
+	for (int moved: { v0, v1 }) {
+		for (int t: vertexTriangles[moved]) if (triangleAlive[t]) {
+			const int* v = triangles[t].v;
+			if ((v[0] == v0 || v[1] == v0 || v[2] == v0) && (v[0] == v1 || v[1] == v1 || v[2] == v1)) continue;
+			Vector p[3], q[3];
+			for (int j = 0; j < 3; j++) {
+				p[j] = positions[v[j]];
+				q[j] = (v[j] == moved) ? target : p[j];
+			}
+			Vector before = (p[1] - p[0]) ^ (p[2] - p[0]);
+			Vector after = (q[1] - q[0]) ^ (q[2] - q[0]);
+			if (after.lengthSqr() < 1e-30) return false;
+			if (before.lengthSqr() < 1e-30) continue;
+			if (normalize(before) * normalize(after) < MIN_NORMAL_COSINE) return false;
+		}
+	}
+	return true;
+}
+
+void MeshSimplifier::collapse(const Collapse& c)
+{
+	int v0 = c.v0, v1 = c.v1;
+	positions[v0] = c.target;
+	quadrics[v0] += quadrics[v1];
+	vertexAlive[v1] = false;
+	stamps[v0]++;
+	stamps[v1]++;
+	for (int t: vertexTriangles[v1]) if (triangleAlive[t]) {
+		int* v = triangles[t].v;
+		if (v[0] == v0 || v[1] == v0 || v[2] == v0) {
+			triangleAlive[t] = false; // (the other vertices drop it from their lists lazily)
+			numTriangles--;
+		} else {
+			for (int j = 0; j < 3; j++) if (v[j] == v1) v[j] = v0;
+			vertexTriangles[v0].push_back(t);
+		}
+	}
+	std::vector<int>().swap(vertexTriangles[v1]);
+	std::vector<int>& around = vertexTriangles[v0];
+	around.erase(std::remove_if(around.begin(), around.end(), [this] (int t) { return !triangleAlive[t]; }), around.end());
+	// the edges around v0 have new costs now:
+	std::vector<int> neighbours;
+	for (int t: around)
+		for (int j = 0; j < 3; j++) if (triangles[t].v[j] != v0) neighbours.push_back(triangles[t].v[j]);
+	std::sort(neighbours.begin(), neighbours.end());
+	neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+	for (int w: neighbours) addCollapse(v0, w);
+}
+
+double MeshSimplifier::simplify(int targetTriangles)
+{
+	while (numTriangles > targetTriangles && !heap.empty()) {
+		std::pop_heap(heap.begin(), heap.end());
+		Collapse c = heap.back();
+		heap.pop_back();
+		// skip the stale entries (one of the vertices moved, or is gone, since the cost was computed):
+		if (!vertexAlive[c.v0] || !vertexAlive[c.v1] || stamps[c.v0] != c.stamp0 || stamps[c.v1] != c.stamp1) continue;
+		if (!isValidCollapse(c.v0, c.v1, c.target)) continue;
+		collapse(c);
+		maxError = std::max(maxError, sqrt(c.cost));
+	}
+	return maxError;
+}
+
+void MeshSimplifier::getTriangles(std::vector<TriangleIndices>& result) const
+{
+	result.clear();
+	for (int i = 0; i < int(triangles.size()); i++)
+		if (triangleAlive[i]) result.push_back(triangles[i]);
+}
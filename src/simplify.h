@@ -0,0 +1,90 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2024 by Veselin Georgiev, Slavomir Kaslev,         *
+ *                              Deyan Hadzhiev et al                       *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File simplify.h
+ * @Brief Contains the quadric error metric mesh simplifier, used for the mesh LODs
+ */
+#pragma once
+
+#include <vector>
+#include "vector.h"
+#include "bbox.h"
+
+/// the symmetric 4x4 matrix of a quadric error metric (Garland & Heckbert), which measures the sum of
+/// squared distances from a point to a set of planes
+struct Quadric {
+	double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+
+	Quadric() { a2 = ab = ac = ad = b2 = bc = bd = c2 = cd = d2 = 0; }
+	/// the quadric of the plane (n, p) = -d (n must be normalized), multiplied by weight
+	Quadric(const Vector& n, double d, double weight = 1);
+
+	void operator += (const Quadric& q);
+	/// the sum of squared distances from p to the planes
+	double evaluate(const Vector& p) const;
+	/// finds the point with the least error
+	/// @returns false if the quadric is (nearly) singular, e.g., all the planes are parallel
+	bool findOptimum(Vector& result) const;
+};
+
+/**
+ * @Brief Reduces the triangle count of a mesh with quadric-driven edge collapses
+ *
+ * Works only with the positions: the corners of the remaining triangles keep their original normal and
+ * uv indices. Boundary edges are held in place by extra, perpendicular planes, and collapses which would
+ * flip or degenerate a triangle are rejected.
+ */
+class MeshSimplifier {
+	struct Collapse {
+		double cost;
+		int v0, v1;         //!< v1 gets merged into v0
+		int stamp0, stamp1; //!< the versions of v0 and v1, when the cost was computed
+		Vector target;
+		bool operator < (const Collapse& other) const { return cost > other.cost; } // (for a min-heap)
+	};
+	std::vector<Vector> positions;
+	std::vector<TriangleIndices> triangles;
+	std::vector<bool> triangleAlive;
+	std::vector<Quadric> quadrics;
+	std::vector<int> stamps;                   //!< incremented each time a vertex moves (or dies)
+	std::vector<bool> vertexAlive;
+	std::vector<std::vector<int>> vertexTriangles; //!< the live triangles around each vertex
+	std::vector<Collapse> heap;
+	BBox bbox;
+	int numTriangles;
+	double maxError = 0;
+
+	void addCollapse(int v0, int v1);
+	bool isValidCollapse(int v0, int v1, const Vector& target) const;
+	void collapse(const Collapse& c);
+public:
+	/// @param positions - the vertex positions (the triangles index into them)
+	/// @param bbox      - the bounds of the mesh; the vertices aren't moved out of it
+	MeshSimplifier(const std::vector<Vector>& positions, const std::vector<TriangleIndices>& triangles, const BBox& bbox);
+
+	/// collapses edges, until at most targetTriangles remain (or no valid collapse is left)
+	/// @returns the largest geometric error introduced so far (in the units of the positions)
+	double simplify(int targetTriangles);
+
+	int getNumTriangles() const { return numTriangles; }
+	void getTriangles(std::vector<TriangleIndices>& result) const;
+	const Vector& getPosition(int v) const { return positions[v]; }
+};
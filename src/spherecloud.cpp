@@ -0,0 +1,165 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2024 by Veselin Georgiev, Slavomir Kaslev,         *
+ *                              Deyan Hadzhiev et al                       *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File spherecloud.cpp
+ * @Brief Implementation of the SphereCloud geometry
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <SDL.h>
+#include "spherecloud.h"
+#include "primgroups.h"
+#include "constants.h"
+#include "util.h"
+
+bool SphereCloud::loadFromFile(const char* fileName)
+{
+	MappedFile file;
+	if (!file.open(fileName)) return false;
+	int numFloats = (radius > 0) ? 3 : 4;
+	size_t stride = numFloats * sizeof(float);
+	if (file.getSize() % stride) {
+		fprintf(stderr, "%s: the size isn't a multiple of %d bytes (%s)\n", fileName, int(stride),
+		        radius > 0 ? "x, y, z" : "x, y, z, radius");
+		return false;
+	}
+	numSpheres = int(file.getSize() / stride);
+	x.resize(numSpheres);
+	y.resize(numSpheres);
+	z.resize(numSpheres);
+	r.resize(numSpheres);
+	const char* p = file.getData();
+	for (int i = 0; i < numSpheres; i++, p += stride) {
+		float values[4] = { 0, 0, 0, float(radius) };
+		memcpy(values, p, stride);
+		if (!(values[3] > 0)) {
+			fprintf(stderr, "%s: sphere %d has an invalid radius (%g)\n", fileName, i, values[3]);
+			return false;
+		}
+		x[i] = values[0];
+		y[i] = values[1];
+		z[i] = values[2];
+		r[i] = values[3];
+	}
+	return true;
+}
+
+void SphereCloud::beginRender()
+{
+	if (!bvh.empty() || !numSpheres) return; // (already built)
+	Uint32 startBuild = SDL_GetTicks();
+	std::vector<BBox> boxes(numSpheres);
+	bbox.makeEmpty();
+	for (int i = 0; i < numSpheres; i++) {
+		Vector center(x[i], y[i], z[i]);
+		boxes[i].vmin = center - Vector(r[i], r[i], r[i]);
+		boxes[i].vmax = center + Vector(r[i], r[i], r[i]);
+		bbox.extend(boxes[i]);
+	}
+	bvh.build(boxes, 8);
+	std::vector<BBox>().swap(boxes);
+	// sort the spheres in leaf order, so that the leaves can index them directly. The last leaf may read up
+	// to 3 spheres past the end, so these get a radius, which no ray can hit:
+	const std::vector<int>& order = bvh.getPrimIndices();
+	for (std::vector<float>* values: { &x, &y, &z, &r }) {
+		std::vector<float> sorted(numSpheres + 3, 0.0f);
+		for (int i = 0; i < numSpheres; i++) sorted[i] = (*values)[order[i]];
+		values->swap(sorted);
+	}
+	for (int i = numSpheres; i < numSpheres + 3; i++) r[i] = -1;
+	size_t memory = bvh.getMemoryUsage() + 4 * r.size() * sizeof(float);
+	printf("SphereCloud `%s': %d spheres, BVH built in %.2fs, %.1f bytes per sphere\n", name, numSpheres,
+	       (SDL_GetTicks() - startBuild) / 1000.0, double(memory) / numSpheres);
+}
+
+/**
+ * Intersects a ray with the spheres of a BVH leaf, [first, first + count) in the sorted arrays. The SIMD filter
+ * picks the candidates, and only these get the exact test (as in Mesh::intersectTriangleBlocks()).
+ * @param hitIdx - receives the index of the hit sphere in the sorted arrays
+ * @returns true if a hit closer than `dist' was found (dist and hitIdx are updated then)
+ */
+bool SphereCloud::intersectLeaf(const Ray& ray, int first, int count, double& dist, int& hitIdx, bool anyHit) const
+{
+	FloatRay blockRay(ray);
+	bool found = false;
+	for (int i = first; i < first + count; i += 4) {
+		int mask = filterSpheres(blockRay, &x[i], &y[i], &z[i], &r[i], float(std::min(dist, 1e20)));
+		mask &= (1 << std::min(4, first + count - i)) - 1; // (the lanes past the leaf belong to the next one)
+		for (int lane = 0; mask; lane++, mask >>= 1) {
+			if (!(mask & 1)) continue;
+			int idx = i + lane;
+			if (testSphere(ray, Vector(x[idx], y[idx], z[idx]), r[idx], dist)) {
+				hitIdx = idx;
+				if (anyHit) return true;
+				found = true;
+			}
+		}
+	}
+	return found;
+}
+
+bool SphereCloud::intersect(const Ray& ray, IntersectionInfo& info)
+{
+	if (bvh.empty()) return false;
+	double dist = INF;
+	int hitIdx = -1;
+	bvh.traverseLeaves(ray, dist, [&] (int first, int count, double& maxDist) {
+		intersectLeaf(ray, first, count, maxDist, hitIdx, false);
+		return false;
+	});
+	if (hitIdx < 0) return false;
+	info.dist = dist;
+	info.geom = this;
+	info.primIdx = hitIdx;
+	return true;
+}
+
+void SphereCloud::computeSurface(const Ray& ray, IntersectionInfo& info)
+{
+	int idx = info.primIdx;
+	Vector center(x[idx], y[idx], z[idx]);
+	// the same as Sphere::computeSurface():
+	info.ip = ray.start + ray.dir * info.dist;
+	info.norm = info.ip - center;
+	info.norm.normalize();
+	info.v = asin(info.norm.y); // [-pi/2..+pi/2]
+	info.u = atan2(info.norm.z, info.norm.x); // [-pi..+pi]
+	info.v = -(info.v / PI + 0.5f); // [0..1]
+	info.u = info.u / (2*PI) + 0.5f; // [0..1]
+	if (uvscaling != 1) {
+		info.u *= uvscaling;
+		info.v *= uvscaling;
+	}
+}
+
+bool SphereCloud::occluded(const Ray& ray, double maxDist)
+{
+	if (bvh.empty()) return false;
+	bool found = false;
+	int hitIdx;
+	bvh.traverseLeaves(ray, maxDist, [&] (int first, int count, double& maxDist) {
+		found = intersectLeaf(ray, first, count, maxDist, hitIdx, true);
+		return found;
+	});
+	return found;
+}
@@ -0,0 +1,73 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2024 by Veselin Georgiev, Slavomir Kaslev,         *
+ *                              Deyan Hadzhiev et al                       *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File spherecloud.h
+ * @Brief Contains the SphereCloud geometry class: a large set of spheres, e.g. particles or a point cloud.
+ */
+#pragma once
+
+#include <vector>
+#include "geometry.h"
+#include "bvh.h"
+
+/**
+ * @Brief A cloud of spheres, loaded from a binary file
+ *
+ * The file is a flat array of little-endian float32s: (x, y, z, radius) for each sphere, or only (x, y, z),
+ * if the `radius' property gives a common radius for all of them.
+ * The spheres are kept in SoA layout, as floats, sorted in the leaf order of their BVH, so each leaf is a
+ * contiguous run, which is tested four spheres at a time; only the candidates from the SIMD test get the
+ * exact one. The UVs and normals are only computed for the final hit, as for Sphere.
+ */
+class SphereCloud: public Geometry {
+	std::vector<float> x, y, z, r; //!< the spheres; after beginRender(), in the order of BVH::getPrimIndices(), plus 3 unused ones at the end
+	BVH bvh;
+	BBox bbox;
+	int numSpheres = 0;
+
+	bool intersectLeaf(const Ray& ray, int first, int count, double& dist, int& hitIdx, bool anyHit) const;
+public:
+	double radius = 0;    //!< if nonzero, the file only has the centers, and this is the radius of all spheres
+	double uvscaling = 1;
+
+	bool loadFromFile(const char* fileName);
+	void beginRender();
+	virtual bool intersect(const Ray& ray, IntersectionInfo& info) override;
+	virtual void computeSurface(const Ray& ray, IntersectionInfo& info) override;
+	virtual bool occluded(const Ray& ray, double maxDist) override;
+	virtual bool getBBox(BBox& bbox) override
+	{
+		bbox = this->bbox;
+		return !bbox.isEmpty();
+	}
+
+	void fillProperties(ParsedBlock& pb)
+	{
+		pb.getDoubleProp("radius", &radius, 0.0);
+		pb.getDoubleProp("uvscaling", &uvscaling, 1e-6);
+		char fn[256];
+		if (pb.getFilenameProp("file", fn)) {
+			if (!loadFromFile(fn)) pb.signalError("Could not load the spheres file!");
+		} else {
+			pb.requiredProp("file");
+		}
+	}
+};
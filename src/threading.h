@@ -28,6 +28,7 @@
 #include <vector>
 #include <thread>
 #include <functional>
+#include <memory>
 
 /**
  * A thread pool class with blocking run semantics
@@ -53,4 +54,22 @@ public:
 	ThreadPool(int threadCount);
 	~ThreadPool();
 	void run(std::function<void(int, int)> worker);
+	int getThreadCount() const { return int(m_workers.size()) + 1; }
 };
+
+/// the global thread pool, used for rendering and for scene preparation (defined in main.cpp)
+extern std::unique_ptr<ThreadPool> threadPool;
+
+/// splits [0, n) into equal ranges, one per thread, and runs func(begin, end) on each of them on the global
+/// thread pool. If there's no pool, or n is below minParallel, it just runs func(0, n) on the calling thread.
+template <typename Func>
+void parallelFor(int n, int minParallel, Func func)
+{
+	if (!threadPool || threadPool->getThreadCount() == 1 || n < minParallel) {
+		func(0, n);
+		return;
+	}
+	threadPool->run([n, &func] (int threadIdx, int threadCount) {
+		func(int((long long) n * threadIdx / threadCount), int((long long) n * (threadIdx + 1) / threadCount));
+	});
+}
@@ -29,6 +29,17 @@
 #include <sys/stat.h>
 #include <random>
 #include "util.h"
+#ifdef _WIN32
+#	define WIN32_LEAN_AND_MEAN
+#	define NOMINMAX
+#	include <windows.h>
+#	include <psapi.h>
+#else
+#	include <sys/mman.h>
+#	include <sys/resource.h>
+#	include <fcntl.h>
+#	include <unistd.h>
+#endif
 
 #include <string>
 #include <chrono>
@@ -127,3 +138,138 @@ Vector hemisphereSample(const Vector& normal)
 
 	return vec;
 }
+
+long long getFileModificationTime(const char* fileName)
+{
+	struct stat st;
+	if (stat(fileName, &st) != 0) return -1;
+	return (long long) st.st_mtime;
+}
+
+bool replaceFile(const char* newFileName, const char* fileName)
+{
+#ifdef _WIN32
+	return MoveFileExA(newFileName, fileName, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return rename(newFileName, fileName) == 0;
+#endif
+}
+
+#ifdef _WIN32
+bool MappedFile::open(const char* fileName)
+{
+	close();
+	HANDLE file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return false;
+	LARGE_INTEGER fileSize;
+	HANDLE mapping = NULL;
+	const void* view = NULL;
+	if (!GetFileSizeEx(file, &fileSize)) {
+		CloseHandle(file);
+		return false;
+	}
+	if (fileSize.QuadPart == 0) {
+		// (an empty file can't be mapped, but there's nothing to map anyway)
+		CloseHandle(file);
+		opened = true;
+		return true;
+	}
+	mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping) view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!view) {
+		if (mapping) CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+	fileHandle = file;
+	mappingHandle = mapping;
+	data = (const char*) view;
+	size = size_t(fileSize.QuadPart);
+	opened = true;
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (data) UnmapViewOfFile(data);
+	if (mappingHandle) CloseHandle(mappingHandle);
+	if (fileHandle) CloseHandle(fileHandle);
+	data = nullptr;
+	size = 0;
+	opened = false;
+	fileHandle = mappingHandle = nullptr;
+}
+
+long long MappedFile::getResidentSize() const
+{
+	return -1;
+}
+
+bool getProcessMemoryStats(ProcessMemoryStats& stats)
+{
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return false;
+	stats.peakResident = (long long) counters.PeakWorkingSetSize;
+	stats.pageFaults = (long long) counters.PageFaultCount;
+	stats.majorPageFaults = -1;
+	return true;
+}
+#else
+bool MappedFile::open(const char* fileName)
+{
+	close();
+	int fd = ::open(fileName, O_RDONLY);
+	if (fd < 0) return false;
+	struct stat st;
+	void* view = MAP_FAILED;
+	if (fstat(fd, &st) != 0) {
+		::close(fd);
+		return false;
+	}
+	// (an empty file can't be mapped, but there's nothing to map anyway)
+	if (st.st_size > 0) view = mmap(NULL, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd); // (the mapping keeps the file open)
+	if (st.st_size > 0 && view == MAP_FAILED) return false;
+	data = (st.st_size > 0) ? (const char*) view : nullptr;
+	size = size_t(st.st_size);
+	opened = true;
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (data) munmap((void*) data, size);
+	data = nullptr;
+	size = 0;
+	opened = false;
+}
+
+long long MappedFile::getResidentSize() const
+{
+#ifdef __linux__
+	if (!data) return 0;
+	long pageSize = sysconf(_SC_PAGESIZE);
+	vector<unsigned char> pages((size + pageSize - 1) / pageSize);
+	if (mincore((void*) data, size, pages.data()) != 0) return -1;
+	long long resident = 0;
+	for (auto page: pages) if (page & 1) resident += pageSize;
+	return resident;
+#else
+	return -1;
+#endif
+}
+
+bool getProcessMemoryStats(ProcessMemoryStats& stats)
+{
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) return false;
+#ifdef __APPLE__
+	stats.peakResident = (long long) usage.ru_maxrss; // (in bytes on Mac OS X...)
+#else
+	stats.peakResident = (long long) usage.ru_maxrss * 1024; // (...and in kilobytes on Linux)
+#endif
+	stats.pageFaults = (long long) (usage.ru_minflt + usage.ru_majflt);
+	stats.majorPageFaults = (long long) usage.ru_majflt;
+	return true;
+}
+#endif
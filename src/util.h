@@ -66,3 +66,49 @@ public:
 	FileRAII(const FileRAII&) = delete;
 	FileRAII& operator = (const FileRAII&) = delete;
 };
+
+/// returns the last modification time of a file (in seconds since the epoch), or -1 if it doesn't exist
+long long getFileModificationTime(const char* fileName);
+
+/// moves a (freshly written) file over another one, replacing it in a single step. Any MappedFile-s of the old
+/// file keep seeing its old contents
+bool replaceFile(const char* newFileName, const char* fileName);
+
+/**
+ * @Brief A read-only view of a whole file in memory
+ *
+ * The OS pages in the contents on demand, when they are first accessed, and may drop them again
+ * under memory pressure (as they are backed by the file itself, and not by the swap).
+ */
+class MappedFile {
+	const char* data = nullptr;
+	size_t size = 0;
+	bool opened = false;
+#ifdef _WIN32
+	void* fileHandle = nullptr;
+	void* mappingHandle = nullptr;
+#endif
+public:
+	MappedFile() {}
+	~MappedFile() { close(); }
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator = (const MappedFile&) = delete;
+
+	/// maps the whole file. An empty file opens as well, with getData() == nullptr and getSize() == 0
+	bool open(const char* fileName);
+	void close();
+	bool isOpen() const { return opened; }
+	const char* getData() const { return data; }
+	size_t getSize() const { return size; }
+	/// how much of the file is currently in physical memory, in bytes (-1 if the OS can't tell)
+	long long getResidentSize() const;
+};
+
+struct ProcessMemoryStats {
+	long long peakResident;    //!< the peak physical memory used by the process so far, in bytes
+	long long pageFaults;      //!< the number of page faults so far
+	long long majorPageFaults; //!< ...of these, the ones which needed a disk read (-1 if the OS can't tell)
+};
+
+/// gets the memory usage of the current process. Returns false if it isn't supported on this OS
+bool getProcessMemoryStats(ProcessMemoryStats& stats);
@@ -115,6 +115,16 @@ inline Vector operator - (const Vector& a)
 	return Vector(-a.x, -a.y, -a.z);
 }
 
+inline bool operator == (const Vector& a, const Vector& b)
+{
+	return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+inline bool operator != (const Vector& a, const Vector& b)
+{
+	return !(a == b);
+}
+
 /// dot product
 inline double operator * (const Vector& a, const Vector& b)
 {
@@ -171,6 +181,14 @@ struct Ray {
 	unsigned flags = 0;
 };
 
+/// a few coherent rays (e.g. through neighbouring pixels), which are traced together (see Intersectable::intersectPacket())
+struct RayPacket {
+	static const int SIZE = 4;
+	Ray rays[SIZE];
+	double maxDist[SIZE]; //!< only hits closer than that are of interest
+	int activeMask = 0;   //!< bit i is set if rays[i] is in use
+};
+
 enum RayFlags {
 	RF_DEBUG       = 0x0001,  //!< this is a debug ray
 	RF_GI_DIFFUSE  = 0x0002,  //!< last part of the path was a diffuse surface